@@ -120,6 +120,78 @@ ErrorCode startThread(pthread_t *thread, void *( *start_routine)(void *),
 }
 
 
+ErrorCode init_mem_pool(MemoryPool *pool, size_t slot_size, int num_slots){
+
+    int i;
+
+    memset(pool, 0, sizeof(MemoryPool));
+
+    if(0 == slot_size || num_slots <= 0){
+        return E_INPUT_PARAMETER;
+    }
+
+    pool->slot_size = (slot_size + MEM_POOL_SLOT_ALIGNMENT - 1) /
+                      MEM_POOL_SLOT_ALIGNMENT * MEM_POOL_SLOT_ALIGNMENT;
+    pool->num_slots = num_slots;
+    pool->slots = (uint8_t *)malloc(pool->slot_size * num_slots);
+    pool->next_free_slots = (int *)malloc(sizeof(int) * num_slots);
+
+    if(NULL == pool->slots || NULL == pool->next_free_slots){
+        free(pool->slots);
+        free(pool->next_free_slots);
+        memset(pool, 0, sizeof(MemoryPool));
+        return E_MALLOC;
+    }
+
+    /* Every slot is free, in the order of their addresses */
+    for(i = 0 ; i < num_slots - 1 ; i++){
+        pool->next_free_slots[i] = i + 1;
+    }
+    pool->next_free_slots[num_slots - 1] = -1;
+    pool->first_free_slot = 0;
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+void release_mem_pool(MemoryPool *pool){
+
+    free(pool->slots);
+    free(pool->next_free_slots);
+    memset(pool, 0, sizeof(MemoryPool));
+}
+
+
+void *mem_pool_alloc(MemoryPool *pool){
+
+    int index = pool->first_free_slot;
+
+    if(-1 == index){
+        pool->exhausted_allocations++;
+        return NULL;
+    }
+
+    pool->first_free_slot = pool->next_free_slots[index];
+
+    pool->used_slots++;
+    if(pool->used_slots > pool->max_used_slots){
+        pool->max_used_slots = pool->used_slots;
+    }
+
+    return pool->slots + index * pool->slot_size;
+}
+
+
+void mem_pool_free(MemoryPool *pool, void *slot){
+
+    int index = ((uint8_t *)slot - pool->slots) / pool->slot_size;
+
+    pool->next_free_slots[index] = pool->first_free_slot;
+    pool->first_free_slot = index;
+    pool->used_slots--;
+}
+
+
 int get_system_time() {
     /* Return value as a long long type */
     int system_time;
@@ -131,3 +203,55 @@ int get_system_time() {
 
     return system_time;
 }
+
+
+int parse_time_in_ms(char *value) {
+    char *end = NULL;
+    long integer_part;
+    long fraction_part = 0;
+    int fraction_digits = 0;
+
+    errno = 0;
+    integer_part = strtol(value, &end, 10);
+
+    if(end == value || 0 != errno || integer_part < 0 ||
+       integer_part > INT_MAX / 1000){
+        return -1;
+    }
+
+    /* value in milliseconds */
+    if(0 == strcmp(end, MILLISECOND_SUFFIX)){
+        return (int)integer_part;
+    }
+
+    /* value in seconds, with optional fraction part */
+    if(0 == strncmp(end, FRACTION_DOT, strlen(FRACTION_DOT))){
+        end += strlen(FRACTION_DOT);
+        while(isdigit((unsigned char)*end)){
+            if(fraction_digits < 3){
+                fraction_part = fraction_part * 10 + (*end - '0');
+                fraction_digits++;
+            }
+            end++;
+        }
+        while(fraction_digits < 3){
+            fraction_part *= 10;
+            fraction_digits++;
+        }
+    }
+
+    if('\0' != *end){
+        return -1;
+    }
+
+    return (int)(integer_part * 1000 + fraction_part);
+}
+
+
+long long get_clock_time_in_us() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
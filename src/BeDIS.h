@@ -79,6 +79,9 @@
 /* Parameter that marks the start of fracton part of float number */
 #define FRACTION_DOT "."
 
+/* Suffix of time values in config file given in milliseconds */
+#define MILLISECOND_SUFFIX "ms"
+
 /* Maximum number of characters in each line of config file */
 #define CONFIG_BUFFER_SIZE 64
 
@@ -97,6 +100,9 @@
 /* The number of slots in the memory pool */
 #define SLOTS_IN_MEM_POOL 1024
 
+/* The alignment in bytes of every slot of a memory pool */
+#define MEM_POOL_SLOT_ALIGNMENT 8
+
 /* Length of the IP address in byte */
 #define NETWORK_ADDR_LENGTH 16
 
@@ -189,6 +195,32 @@ typedef struct {
     char *message;
 } errordesc;
 
+/* A pool of fixed-size slots allocated once at initialization. Slots are
+   taken and returned through a free list in constant time. A pool is not
+   shared between threads, so the free list is not locked. */
+typedef struct MemoryPool {
+
+    /* The memory of the slots, and the size in bytes of each slot */
+    uint8_t *slots;
+    size_t slot_size;
+    int num_slots;
+
+    /* The index of the free slot after each free slot, or -1 */
+    int *next_free_slots;
+
+    /* The index of the first free slot, or -1 if no slot is free */
+    int first_free_slot;
+
+    /* Number of slots in use, and the highest number of slots ever in
+       use at once */
+    int used_slots;
+    int max_used_slots;
+
+    /* Number of allocations failed because every slot is in use */
+    unsigned long long exhausted_allocations;
+
+} MemoryPool;
+
 typedef enum _HealthReportErrorCode{
     S_NORMAL = 0,
     E_ERROR = 1
@@ -361,6 +393,77 @@ ErrorCode startThread(pthread_t *thread, void *( *start_routine)(void *),
                       void *arg);
 
 
+/*
+  init_mem_pool:
+
+     This function allocates the memory of all the slots of a pool once,
+     so that taking and returning slots afterwards never calls malloc or
+     free.
+
+  Parameters:
+
+     pool      - The pool to be initialized.
+     slot_size - The size in bytes of each slot.
+     num_slots - The number of slots.
+
+  Return value:
+
+     ErrorCode - The error code for the corresponding error if the function
+                 fails or WORK SUCCESSFULLY otherwise
+ */
+ErrorCode init_mem_pool(MemoryPool *pool, size_t slot_size, int num_slots);
+
+
+/*
+  release_mem_pool:
+
+     This function frees the memory of a pool whose slots are no longer
+     used.
+
+  Parameters:
+
+     pool - The pool to be released.
+
+  Return value:
+
+     None
+ */
+void release_mem_pool(MemoryPool *pool);
+
+
+/*
+  mem_pool_alloc:
+
+     This function takes a free slot from a pool.
+
+  Parameters:
+
+     pool - The pool.
+
+  Return value:
+
+     void * - The slot, or NULL if every slot is in use.
+ */
+void *mem_pool_alloc(MemoryPool *pool);
+
+
+/*
+  mem_pool_free:
+
+     This function returns a slot taken by mem_pool_alloc to its pool.
+
+  Parameters:
+
+     pool - The pool.
+     slot - The slot to be returned.
+
+  Return value:
+
+     None
+ */
+void mem_pool_free(MemoryPool *pool, void *slot);
+
+
 /*
   get_system_time:
 
@@ -378,6 +481,43 @@ ErrorCode startThread(pthread_t *thread, void *( *start_routine)(void *),
 int get_system_time();
 
 
+/*
+  parse_time_in_ms:
+
+     This helper function converts a time value read from config file to
+     milliseconds. A value with the "ms" suffix is in milliseconds, e.g.
+     "250ms". Otherwise the value is in seconds and may have a fraction
+     part of up to three digits, e.g. "2" or "0.75".
+
+  Parameters:
+
+     value - the time value in string type
+
+  Return value:
+
+     int - the time in milliseconds, or -1 if the value is not a valid
+           non-negative time
+*/
+int parse_time_in_ms(char *value);
+
+
+/*
+  get_clock_time_in_us:
+
+     This helper function fetches the current time of the monotonic clock,
+     which is not affected by adjustments of the system clock.
+
+  Parameters:
+
+     None
+
+  Return value:
+
+     long long - time of the monotonic clock in micro seconds
+*/
+long long get_clock_time_in_us();
+
+
 /*
   memset:
 
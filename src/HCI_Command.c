@@ -0,0 +1,268 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the implementation of the asynchronous HCI command
+      queue.
+
+ File Name:
+
+      HCI_Command.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include "HCI_Command.h"
+
+
+/* A static function to take the pending command at the index out of the
+   queue, keeping the other commands in the order they are written. The
+   command is removed before its callback is called, so that the callback
+   may submit or cancel commands. */
+static HCICommand remove_hci_command(HCICommandQueue *queue, int index){
+    HCICommand command = *queue->commands[index];
+
+    mem_pool_free(&queue->command_pool, queue->commands[index]);
+
+    memmove(&queue->commands[index], &queue->commands[index + 1],
+            sizeof(HCICommand *) * (queue->num_pending - index - 1));
+    queue->num_pending--;
+
+    return command;
+}
+
+
+ErrorCode init_hci_command_queue(HCICommandQueue *queue,
+                                 HCITransport *transport){
+
+    memset(queue, 0, sizeof(HCICommandQueue));
+    queue->transport = transport;
+
+    return init_mem_pool(&queue->command_pool, sizeof(HCICommand),
+                         MAX_PENDING_HCI_COMMANDS);
+}
+
+
+void release_hci_command_queue(HCICommandQueue *queue){
+
+    release_mem_pool(&queue->command_pool);
+}
+
+
+ErrorCode submit_hci_command(HCICommandQueue *queue,
+                             int dd,
+                             uint16_t ogf,
+                             uint16_t ocf,
+                             uint8_t plen,
+                             void *param,
+                             int timeout_in_ms,
+                             HCICommandCallback callback,
+                             void *context){
+    HCICommand *command;
+
+    command = (HCICommand *)mem_pool_alloc(&queue->command_pool);
+    if(NULL == command){
+        return E_SEND_REQUEST_TIMEOUT;
+    }
+
+    /* The kernel queues the commands of all sockets of a controller until
+       the controller has credits for them, so the write does not wait */
+    if(0 > queue->transport->send_cmd(dd, ogf, ocf, plen, param)){
+        mem_pool_free(&queue->command_pool, command);
+        return E_SEND_REQUEST_TIMEOUT;
+    }
+
+    queue->commands[queue->num_pending] = command;
+    command->dd = dd;
+    command->opcode = cmd_opcode_pack(ogf, ocf);
+    command->submit_time = get_clock_time_in_us();
+    command->deadline = command->submit_time + timeout_in_ms * 1000LL;
+    command->callback = callback;
+    command->context = context;
+
+    queue->num_pending++;
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+bool handle_hci_command_event(HCICommandQueue *queue,
+                              int dd,
+                              uint8_t *event,
+                              int length){
+    hci_event_hdr *header;
+    evt_cmd_complete *complete;
+    evt_cmd_status *command_status;
+    uint16_t opcode;
+    int status;
+    HCICommand command;
+    long long latency;
+    int i;
+
+    if(length < 1 + HCI_EVENT_HDR_SIZE || HCI_EVENT_PKT != event[0]){
+        return false;
+    }
+
+    header = (hci_event_hdr *)(event + 1);
+
+    switch(header->evt){
+        case EVT_CMD_COMPLETE:
+            if(length < 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE){
+                return true;
+            }
+            complete = (evt_cmd_complete *)(event + 1 + HCI_EVENT_HDR_SIZE);
+            opcode = btohs(complete->opcode);
+            /* The return parameters start with the status for every
+               command the Tag sends */
+            status = (length > 1 + HCI_EVENT_HDR_SIZE +
+                               EVT_CMD_COMPLETE_SIZE) ?
+                     event[1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE] :
+                     0;
+            break;
+
+        case EVT_CMD_STATUS:
+            if(length < 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_STATUS_SIZE){
+                return true;
+            }
+            command_status =
+                (evt_cmd_status *)(event + 1 + HCI_EVENT_HDR_SIZE);
+            opcode = btohs(command_status->opcode);
+            status = command_status->status;
+            break;
+
+        default:
+            return false;
+    }
+
+    /* The controller completes the commands of a device in the order they
+       are written, so the oldest command with the opcode is completed */
+    for(i = 0 ; i < queue->num_pending ; i++){
+        if(queue->commands[i]->dd == dd &&
+           queue->commands[i]->opcode == opcode){
+            break;
+        }
+    }
+
+    if(i == queue->num_pending){
+        /* The completion of a command of another socket or of a
+           synchronous request */
+        return true;
+    }
+
+    command = remove_hci_command(queue, i);
+
+    latency = get_clock_time_in_us() - command.submit_time;
+    queue->total_latency_in_us += latency;
+    if(latency > queue->max_latency_in_us){
+        queue->max_latency_in_us = latency;
+    }
+    record_latency(&queue->latency_histogram, latency);
+
+    if(0 == status){
+        queue->completed_commands++;
+    }else{
+        queue->failed_commands++;
+    }
+
+    if(NULL != command.callback){
+        command.callback(opcode, status, command.context);
+    }
+
+    return true;
+}
+
+
+void expire_hci_commands(HCICommandQueue *queue, long long now){
+    HCICommand command;
+    int i = 0;
+
+    while(i < queue->num_pending){
+        if(queue->commands[i]->deadline > now){
+            i++;
+            continue;
+        }
+
+        command = remove_hci_command(queue, i);
+        queue->timed_out_commands++;
+
+        if(NULL != command.callback){
+            command.callback(command.opcode, HCI_COMMAND_TIMED_OUT,
+                             command.context);
+        }
+
+        /* The callback may have changed the queue, so start over */
+        i = 0;
+    }
+}
+
+
+void cancel_hci_commands(HCICommandQueue *queue, int dd){
+    int i = 0;
+
+    while(i < queue->num_pending){
+        if(queue->commands[i]->dd == dd){
+            remove_hci_command(queue, i);
+        }else{
+            i++;
+        }
+    }
+}
+
+
+int count_hci_commands(HCICommandQueue *queue, int dd){
+    int num_commands = 0;
+    int i;
+
+    for(i = 0 ; i < queue->num_pending ; i++){
+        if(queue->commands[i]->dd == dd){
+            num_commands++;
+        }
+    }
+
+    return num_commands;
+}
+
+
+int get_hci_command_timeout_in_ms(HCICommandQueue *queue, long long now){
+    long long earliest_deadline;
+    int i;
+
+    if(0 == queue->num_pending){
+        return -1;
+    }
+
+    earliest_deadline = queue->commands[0]->deadline;
+    for(i = 1 ; i < queue->num_pending ; i++){
+        if(queue->commands[i]->deadline < earliest_deadline){
+            earliest_deadline = queue->commands[i]->deadline;
+        }
+    }
+
+    if(earliest_deadline <= now){
+        return 0;
+    }
+
+    /* Round up, so that the loop does not wake up just before the
+       deadline */
+    return (int)((earliest_deadline - now + 999) / 1000);
+}
@@ -0,0 +1,287 @@
+/*
+Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+License:
+
+    GPL 3.0 : The content of this file is subject to the terms and
+    conditions defined in file 'COPYING.txt', which is part of this source
+    code package.
+
+Project Name:
+
+    BeDIS
+
+File Description:
+
+    This header file contains declarations of the asynchronous HCI command
+    queue. Commands are written to the device without waiting, and the
+    Command Complete and Command Status events read by the event loop are
+    matched to the pending commands by device and opcode, so that sending a
+    command never stalls the processing of advertising reports.
+
+File Name:
+
+    HCI_Command.h
+
+Version:
+
+    1.0,  20190429
+
+Abstract:
+
+Authors:
+
+    Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#ifndef HCI_COMMAND_H
+#define HCI_COMMAND_H
+
+/*
+* INCLUDES
+*/
+
+#include "HCI_Transport.h"
+#include "Metrics.h"
+
+/*
+  CONSTANTS
+*/
+
+/* Maximum number of HCI commands waiting for completion at once, enough
+   for changing the scan profile of several scanning dongles at once */
+#define MAX_PENDING_HCI_COMMANDS 32
+
+/* The status reported to the callback of a command which is not
+   completed by the controller in time */
+#define HCI_COMMAND_TIMED_OUT -1
+
+/*
+  TYPEDEF STRUCTS
+*/
+
+/* The function called when a command completes, with the status returned
+   by the controller or HCI_COMMAND_TIMED_OUT */
+typedef void (*HCICommandCallback)(uint16_t opcode, int status,
+                                   void *context);
+
+/* A command waiting for its Command Complete or Command Status event */
+typedef struct HCICommand {
+
+    /* The device the command is written to */
+    int dd;
+
+    /* The opcode packing the OGF and OCF of the command */
+    uint16_t opcode;
+
+    /* Time in micro seconds on the monotonic clock when the command is
+       written, and when it times out */
+    long long submit_time;
+    long long deadline;
+
+    HCICommandCallback callback;
+    void *context;
+
+} HCICommand;
+
+typedef struct HCICommandQueue {
+
+    /* The transport the commands are written to */
+    HCITransport *transport;
+
+    /* The descriptors of the pending commands, taken from the pool and
+       packed in the order the commands are written */
+    MemoryPool command_pool;
+    HCICommand *commands[MAX_PENDING_HCI_COMMANDS];
+    int num_pending;
+
+    /* Number of commands completed successfully, completed with a non-zero
+       status, and timed out */
+    unsigned long long completed_commands;
+    unsigned long long failed_commands;
+    unsigned long long timed_out_commands;
+
+    /* Delay between writing commands and reading their completion */
+    long long total_latency_in_us;
+    long long max_latency_in_us;
+
+    /* The delays between writing commands and reading their completion
+       since the last dump of the metrics */
+    LatencyHistogram latency_histogram;
+
+} HCICommandQueue;
+
+/*
+  FUNCTIONS
+*/
+
+/*
+  init_hci_command_queue:
+
+      This function initializes an empty command queue, and allocates the
+      descriptors of the commands once.
+
+  Parameters:
+
+      queue - the queue to be initialized
+      transport - the transport the commands are written to
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+ErrorCode init_hci_command_queue(HCICommandQueue *queue,
+                                 HCITransport *transport);
+
+/*
+  release_hci_command_queue:
+
+      This function frees the descriptors of the commands.
+
+  Parameters:
+
+      queue - the queue to be released
+
+  Return value:
+
+      None
+*/
+
+void release_hci_command_queue(HCICommandQueue *queue);
+
+/*
+  submit_hci_command:
+
+      This function writes a command to the device without waiting for its
+      completion. The callback is called from handle_hci_command_event when
+      the completion is read, or from expire_hci_commands if the command is
+      not completed in time.
+
+  Parameters:
+
+      queue - the command queue
+      dd - the device the command is written to
+      ogf - the opcode group field of the command
+      ocf - the opcode command field of the command
+      plen - the length in number of bytes of the command parameters
+      param - the command parameters
+      timeout_in_ms - the time the controller has to complete the command
+      callback - the function called on completion, or NULL
+      context - the argument passed to the callback
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+ErrorCode submit_hci_command(HCICommandQueue *queue,
+                             int dd,
+                             uint16_t ogf,
+                             uint16_t ocf,
+                             uint8_t plen,
+                             void *param,
+                             int timeout_in_ms,
+                             HCICommandCallback callback,
+                             void *context);
+
+/*
+  handle_hci_command_event:
+
+      This function completes the oldest pending command of the device with
+      the opcode carried by a Command Complete or Command Status event.
+
+  Parameters:
+
+      queue - the command queue
+      dd - the device the event is read from
+      event - the event as read from the device, prefixed with the packet
+              type
+      length - the length in number of bytes of the event
+
+  Return value:
+
+      bool - true if the event is a Command Complete or Command Status
+             event, false otherwise
+*/
+
+bool handle_hci_command_event(HCICommandQueue *queue,
+                              int dd,
+                              uint8_t *event,
+                              int length);
+
+/*
+  expire_hci_commands:
+
+      This function fails the pending commands whose deadline has passed.
+
+  Parameters:
+
+      queue - the command queue
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      None
+*/
+
+void expire_hci_commands(HCICommandQueue *queue, long long now);
+
+/*
+  cancel_hci_commands:
+
+      This function forgets the pending commands of a device which is about
+      to be closed, without calling their callbacks.
+
+  Parameters:
+
+      queue - the command queue
+      dd - the device to be closed
+
+  Return value:
+
+      None
+*/
+
+void cancel_hci_commands(HCICommandQueue *queue, int dd);
+
+/*
+  count_hci_commands:
+
+      This function counts the pending commands of a device.
+
+  Parameters:
+
+      queue - the command queue
+      dd - the device
+
+  Return value:
+
+      int - the number of commands of the device waiting for their
+            completion
+*/
+
+int count_hci_commands(HCICommandQueue *queue, int dd);
+
+/*
+  get_hci_command_timeout_in_ms:
+
+      This function returns the time until the earliest deadline of the
+      pending commands, to be used as the timeout of the event loop.
+
+  Parameters:
+
+      queue - the command queue
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      int - the time in milliseconds, or -1 if no command is pending
+*/
+
+int get_hci_command_timeout_in_ms(HCICommandQueue *queue, long long now);
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the implementation of the HCI reader thread and
+      the ring of events it fills.
+
+ File Name:
+
+      HCI_Reader.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include "HCI_Reader.h"
+
+
+/* A static function to add to a counter read by the event loop. Only the
+   reader thread writes the counters. */
+static void add_to_counter(uint32_t *counter, uint32_t value){
+
+    __atomic_store_n(counter,
+                     __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                     __ATOMIC_RELAXED);
+}
+
+
+/* A static function to wake the event loop up on new events. */
+static void notify_event_loop(HCIReader *reader){
+
+    uint64_t value = 1;
+
+    /* A failed write leaves the counter set, which wakes the event loop up
+       anyway */
+    if(sizeof(value) != write(reader->notify_fd, &value, sizeof(value))){
+        return;
+    }
+}
+
+
+/* A static function to copy the events read into the scratch buffer,
+   other than the LE Meta events, into the reserved slots of the ring.
+   Returns the number of events copied. */
+static int forward_reserved_events(HCIReader *reader,
+                                   uint8_t (*events)[HCI_MAX_EVENT_SIZE],
+                                   int *lengths,
+                                   int num_events,
+                                   unsigned int head,
+                                   unsigned int num_free,
+                                   long long now){
+
+    unsigned int slot;
+    int num_forwarded = 0;
+    int i;
+
+    for(i = 0 ; i < num_events ; i++){
+
+        if(lengths[i] >= 1 + HCI_EVENT_HDR_SIZE &&
+           HCI_EVENT_PKT == events[i][0] &&
+           EVT_LE_META_EVENT == events[i][1]){
+            continue;
+        }
+
+        if((unsigned int)num_forwarded == num_free){
+            break;
+        }
+
+        slot = (head + num_forwarded) & (HCI_READER_RING_SIZE - 1);
+        memcpy(reader->events[slot], events[i], lengths[i]);
+        reader->lengths[slot] = lengths[i];
+        reader->receive_times[slot] = now;
+        num_forwarded++;
+    }
+
+    return num_forwarded;
+}
+
+
+/* A static function to read the events queued on the device into the
+   free slots of the ring, until no event is left or the reader is asked
+   to stop. When only the reserved slots are free, the events are read
+   into a scratch buffer, the advertising reports are dropped so that they
+   do not pile up in the kernel, and the other events are forwarded. */
+static bool drain_hci_events(HCIReader *reader){
+
+    uint8_t scratch[HCI_EVENT_BATCH_SIZE][HCI_MAX_EVENT_SIZE];
+    int scratch_lengths[HCI_EVENT_BATCH_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    unsigned int slot;
+    unsigned int num_free;
+    unsigned int num_used;
+    int max_events;
+    int num_events;
+    int i;
+    long long now;
+
+    while(true){
+
+        /* The stop request is checked before every read, since the device
+           may never be drained under a flood of events */
+        if(__atomic_load_n(&reader->is_stopping, __ATOMIC_ACQUIRE)){
+            return false;
+        }
+
+        head = reader->head;
+        tail = __atomic_load_n(&reader->tail, __ATOMIC_ACQUIRE);
+        slot = head & (HCI_READER_RING_SIZE - 1);
+        num_free = HCI_READER_RING_SIZE - (head - tail);
+
+        /* The events of a read land in consecutive slots, short of the
+           reserved slots */
+        max_events = HCI_READER_RING_SIZE - slot;
+        if(max_events > (int)num_free - HCI_READER_RESERVED_SLOTS){
+            max_events = (int)num_free - HCI_READER_RESERVED_SLOTS;
+        }
+        if(max_events < 0){
+            max_events = 0;
+        }
+        if(max_events > HCI_EVENT_BATCH_SIZE){
+            max_events = HCI_EVENT_BATCH_SIZE;
+        }
+
+        if(0 == max_events){
+            num_events = reader->transport->read_events(
+                             reader->dd, scratch, scratch_lengths,
+                             HCI_EVENT_BATCH_SIZE);
+        }else{
+            num_events = reader->transport->read_events(
+                             reader->dd, &reader->events[slot],
+                             &reader->lengths[slot], max_events);
+        }
+
+        if(num_events <= 0){
+            if(num_events < 0 && EAGAIN != errno &&
+               EWOULDBLOCK != errno && EINTR != errno){
+                __atomic_store_n(&reader->is_broken, true,
+                                 __ATOMIC_RELEASE);
+                notify_event_loop(reader);
+                return false;
+            }
+            return true;
+        }
+
+        add_to_counter(&reader->read_calls, 1);
+        add_to_counter(&reader->received_events, num_events);
+
+        now = get_clock_time_in_us();
+
+        if(0 == max_events){
+            i = forward_reserved_events(reader, scratch, scratch_lengths,
+                                        num_events, head, num_free, now);
+            add_to_counter(&reader->dropped_events, num_events - i);
+            if(0 == i){
+                continue;
+            }
+            num_events = i;
+        }else{
+            for(i = 0 ; i < num_events ; i++){
+                reader->receive_times[slot + i] = now;
+            }
+        }
+
+        /* Publish the events after their contents are written */
+        __atomic_store_n(&reader->head, head + num_events,
+                         __ATOMIC_RELEASE);
+
+        num_used = head + num_events - tail;
+        if(num_used > reader->max_used_slots){
+            __atomic_store_n(&reader->max_used_slots, num_used,
+                             __ATOMIC_RELAXED);
+        }
+
+        notify_event_loop(reader);
+    }
+}
+
+
+/* A static function run by the reader thread, which blocks on the device
+   until events arrive or the reader is stopped. */
+static void *hci_reader_routine(void *param){
+
+    HCIReader *reader = (HCIReader *)param;
+    struct pollfd fds[2];
+
+    fds[0].fd = reader->dd;
+    fds[0].events = POLLIN;
+    fds[1].fd = reader->stop_fd;
+    fds[1].events = POLLIN;
+
+    while(true){
+
+        if(0 > poll(fds, 2, -1)){
+            if(EINTR == errno){
+                continue;
+            }
+            break;
+        }
+
+        if(fds[1].revents & POLLIN){
+            break;
+        }
+
+        if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)){
+            __atomic_store_n(&reader->is_broken, true, __ATOMIC_RELEASE);
+            notify_event_loop(reader);
+            break;
+        }
+
+        if(fds[0].revents & POLLIN){
+            if(false == drain_hci_events(reader)){
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+ErrorCode init_hci_reader(HCIReader *reader, HCITransport *transport){
+
+    memset(reader, 0, sizeof(HCIReader));
+
+    reader->transport = transport;
+    reader->dd = -1;
+
+    reader->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(0 > reader->stop_fd){
+        return E_OPEN_FILE;
+    }
+
+    reader->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(0 > reader->notify_fd){
+        close(reader->stop_fd);
+        return E_OPEN_FILE;
+    }
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+void release_hci_reader(HCIReader *reader){
+
+    close(reader->stop_fd);
+    close(reader->notify_fd);
+}
+
+
+ErrorCode start_hci_reader(HCIReader *reader, int dd){
+
+    uint64_t value;
+
+    reader->dd = dd;
+    reader->head = 0;
+    reader->tail = 0;
+    reader->is_stopping = false;
+    reader->is_broken = false;
+
+    /* Clear the requests and notifications left by the previous thread */
+    while(sizeof(value) == read(reader->stop_fd, &value, sizeof(value))){
+    }
+    while(sizeof(value) == read(reader->notify_fd, &value, sizeof(value))){
+    }
+
+    /* Created joinable rather than with startThread, so that the device
+       is closed only after the thread stops reading it */
+    if(0 != pthread_create(&reader->thread, NULL, hci_reader_routine,
+                           reader)){
+        return E_START_THREAD;
+    }
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+void stop_hci_reader(HCIReader *reader){
+
+    uint64_t value = 1;
+
+    __atomic_store_n(&reader->is_stopping, true, __ATOMIC_RELEASE);
+
+    if(sizeof(value) != write(reader->stop_fd, &value, sizeof(value))){
+        zlog_warn(category_health_report,
+                  "Error waking HCI reader up: %s", strerror(errno));
+    }
+
+    pthread_join(reader->thread, NULL);
+
+    reader->dd = -1;
+}
+
+
+int peek_hci_events(HCIReader *reader,
+                    int max_events,
+                    uint8_t (**events)[HCI_MAX_EVENT_SIZE],
+                    int **lengths,
+                    long long **receive_times){
+
+    unsigned int head;
+    unsigned int tail;
+    unsigned int slot;
+    int num_events;
+
+    head = __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE);
+    tail = reader->tail;
+    slot = tail & (HCI_READER_RING_SIZE - 1);
+
+    num_events = head - tail;
+    if(num_events > HCI_READER_RING_SIZE - (int)slot){
+        num_events = HCI_READER_RING_SIZE - slot;
+    }
+    if(num_events > max_events){
+        num_events = max_events;
+    }
+
+    *events = &reader->events[slot];
+    *lengths = &reader->lengths[slot];
+    *receive_times = &reader->receive_times[slot];
+
+    return num_events;
+}
+
+
+void release_hci_events(HCIReader *reader, int num_events){
+
+    /* The slots are reused only after the events are processed */
+    __atomic_store_n(&reader->tail, reader->tail + num_events,
+                     __ATOMIC_RELEASE);
+}
+
+
+bool is_hci_reader_broken(HCIReader *reader){
+
+    return __atomic_load_n(&reader->is_broken, __ATOMIC_ACQUIRE);
+}
+
+
+uint32_t get_hci_reader_counter(uint32_t *counter){
+
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
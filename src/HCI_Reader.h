@@ -0,0 +1,266 @@
+/*
+Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+License:
+
+    GPL 3.0 : The content of this file is subject to the terms and
+    conditions defined in file 'COPYING.txt', which is part of this source
+    code package.
+
+Project Name:
+
+    BeDIS
+
+File Description:
+
+    This header file contains declarations of the HCI reader, a thread
+    which does nothing but drain the HCI socket into a preallocated ring of
+    events. The events are parsed, filtered and acted on by the event loop,
+    so that slow logging or commands waiting for the controller never leave
+    events queued in the kernel until the socket buffer overruns. The ring
+    has a single producer, the reader thread, and a single consumer, the
+    event loop, and is shared without locks.
+
+File Name:
+
+    HCI_Reader.h
+
+Version:
+
+    1.0,  20190429
+
+Abstract:
+
+Authors:
+
+    Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#ifndef HCI_READER_H
+#define HCI_READER_H
+
+/*
+* INCLUDES
+*/
+
+#include <sys/eventfd.h>
+#include "HCI_Transport.h"
+
+/*
+  CONSTANTS
+*/
+
+/* Number of events the ring holds, which has to be a power of 2. At the
+   highest report rate of the controllers this covers the longest stall of
+   the event loop seen while logging and reconfiguring. */
+#define HCI_READER_RING_SIZE 1024
+
+/* Number of slots of the ring kept for the events other than LE Meta
+   events, which is the number of commands pending at once. The
+   completions of the commands of the scanner are forwarded when the
+   advertising reports no longer fit into the ring and are dropped. */
+#define HCI_READER_RESERVED_SLOTS 32
+
+/*
+  TYPEDEF STRUCTS
+*/
+
+typedef struct HCIReader {
+
+    /* The transport and the device the events are read from */
+    HCITransport *transport;
+    int dd;
+
+    /* The events read from the device, the length of each event, and the
+       time in micro seconds on the monotonic clock when it is read */
+    uint8_t events[HCI_READER_RING_SIZE][HCI_MAX_EVENT_SIZE];
+    int lengths[HCI_READER_RING_SIZE];
+    long long receive_times[HCI_READER_RING_SIZE];
+
+    /* The number of events ever written by the reader thread, and ever
+       released by the event loop. The slot of an event is its number
+       modulo the ring size. */
+    unsigned int head;
+    unsigned int tail;
+
+    /* The reader thread, and the event file descriptors it is stopped
+       with and notifies the event loop with */
+    pthread_t thread;
+    int stop_fd;
+    int notify_fd;
+
+    /* Whether the reader thread is asked to stop, and whether it has
+       stopped on an error of the device */
+    bool is_stopping;
+    bool is_broken;
+
+    /* Number of read system calls on the device, of events read, and of
+       advertising reports dropped because the ring is full. Written only
+       by the reader thread, and kept across restarts of the thread. The
+       counters are 32 bits wide, which are loaded and stored atomically
+       on every target without libatomic, and wrap around, so they are
+       read as the difference to a previous value. */
+    uint32_t read_calls;
+    uint32_t received_events;
+    uint32_t dropped_events;
+
+    /* The highest number of events waiting in the ring */
+    uint32_t max_used_slots;
+
+} HCIReader;
+
+/*
+  FUNCTIONS
+*/
+
+/*
+  init_hci_reader:
+
+      This function initializes the ring and the counters of a reader,
+      and creates the event file descriptors it is stopped and watched
+      with.
+
+  Parameters:
+
+      reader - the reader to be initialized
+      transport - the transport the events are read with
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+ErrorCode init_hci_reader(HCIReader *reader, HCITransport *transport);
+
+/*
+  release_hci_reader:
+
+      This function closes the event file descriptors of a stopped reader.
+
+  Parameters:
+
+      reader - the reader to be released
+
+  Return value:
+
+      None
+*/
+
+void release_hci_reader(HCIReader *reader);
+
+/*
+  start_hci_reader:
+
+      This function starts the reader thread on a device. The events
+      already in the ring are discarded.
+
+  Parameters:
+
+      reader - the reader
+      dd - the device the events are read from
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+ErrorCode start_hci_reader(HCIReader *reader, int dd);
+
+/*
+  stop_hci_reader:
+
+      This function stops the reader thread and waits until it exits, so
+      that the device can be closed afterwards.
+
+  Parameters:
+
+      reader - the reader
+
+  Return value:
+
+      None
+*/
+
+void stop_hci_reader(HCIReader *reader);
+
+/*
+  peek_hci_events:
+
+      This function gets the oldest events waiting in the ring, which lie
+      in consecutive slots. The events stay in the ring until released with
+      release_hci_events.
+
+  Parameters:
+
+      reader - the reader
+      max_events - the maximum number of events to get
+      events - pointer to the first of the events
+      lengths - pointer to the length of the first of the events
+      receive_times - pointer to the read time of the first of the events
+
+  Return value:
+
+      int - the number of events, or 0 if the ring is empty
+*/
+
+int peek_hci_events(HCIReader *reader,
+                    int max_events,
+                    uint8_t (**events)[HCI_MAX_EVENT_SIZE],
+                    int **lengths,
+                    long long **receive_times);
+
+/*
+  release_hci_events:
+
+      This function returns the slots of the oldest events to the reader
+      thread.
+
+  Parameters:
+
+      reader - the reader
+      num_events - the number of events processed
+
+  Return value:
+
+      None
+*/
+
+void release_hci_events(HCIReader *reader, int num_events);
+
+/*
+  is_hci_reader_broken:
+
+      This function checks whether the reader thread has stopped on an
+      error of the device, after which no more events are read.
+
+  Parameters:
+
+      reader - the reader
+
+  Return value:
+
+      bool - true if the device has failed, false otherwise
+*/
+
+bool is_hci_reader_broken(HCIReader *reader);
+
+/*
+  get_hci_reader_counter:
+
+      This function reads a counter written by the reader thread.
+
+  Parameters:
+
+      counter - pointer to the counter in the reader
+
+  Return value:
+
+      uint32_t - the value of the counter
+*/
+
+uint32_t get_hci_reader_counter(uint32_t *counter);
+
+#endif
@@ -0,0 +1,826 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the BlueZ and the simulated implementations of the
+      HCI transport interface used by the Tag.
+
+ File Name:
+
+      HCI_Transport.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+/* recvmmsg() is a GNU extension */
+#define _GNU_SOURCE
+
+#include "HCI_Transport.h"
+
+/* Time interval in milliseconds for the simulated controller to check
+   whether it is closed while scanning is disabled */
+#define SIMULATED_IDLE_CHECK_IN_MS 10
+
+/* Number of HCI commands the simulated controller accepts at once, which
+   is reported in its Command Complete events */
+#define SIMULATED_COMMAND_CREDITS 1
+
+/* Number of nanoseconds in one second */
+#define NANOSECONDS_PER_SECOND 1000000000LL
+
+/* The state of one device opened on the simulated controller. The host end
+   of the socket pair is handed out as the device descriptor, and the
+   controller thread writes HCI events into the other end. */
+typedef struct SimulatedDevice {
+
+    bool is_used;
+
+    /* Whether the device is being closed, after which it is no longer
+       found by its descriptor while its thread is joined */
+    bool is_closing;
+
+    int host_fd;
+
+    int controller_fd;
+
+    volatile bool is_running;
+
+    volatile bool is_scan_enabled;
+
+    /* The scan interval and scan window in units of 0.625 ms. Reports are
+       emitted only within the window of each interval. */
+    volatile uint16_t scan_interval;
+    volatile uint16_t scan_window;
+
+    pthread_t thread;
+
+    unsigned int seed;
+
+    /* Number of advertising reports written to and dropped by the socket */
+    unsigned long long emitted_reports;
+    unsigned long long dropped_reports;
+
+    /* Number of HCI events written to the socket, including the events
+       discarded by a socket filter of the host */
+    unsigned long long emitted_events;
+
+    /* Number of HCI commands completed by the controller */
+    unsigned long long completed_commands;
+
+} SimulatedDevice;
+
+
+static SimulatedControllerConfig simulated_config;
+
+static SimulatedDevice simulated_devices[MAX_SIMULATED_DEVICES];
+
+static pthread_mutex_t simulated_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* A static function to find the simulated device of the descriptor. */
+static SimulatedDevice *find_simulated_device(int dd){
+    int i;
+
+    for(i = 0 ; i < MAX_SIMULATED_DEVICES ; i++){
+        if(simulated_devices[i].is_used &&
+           !simulated_devices[i].is_closing &&
+           simulated_devices[i].host_fd == dd){
+            return &simulated_devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/* A static function to check whether the descriptor is a device opened on
+   the simulated controller. */
+static bool is_simulated_device(int dd){
+    bool is_found;
+
+    pthread_mutex_lock(&simulated_devices_lock);
+    is_found = (NULL != find_simulated_device(dd));
+    pthread_mutex_unlock(&simulated_devices_lock);
+
+    return is_found;
+}
+
+
+/* A static function to build one advertising report carrying the LBeacon
+   advertisement of the specified simulated beacon. It returns the number
+   of bytes the report occupies in the event. */
+static int build_advertising_report(SimulatedDevice *device,
+                                    int beacon,
+                                    uint8_t *report){
+    le_advertising_info *info;
+    uint8_t *data;
+    int rssi;
+    int rssi_range;
+    int length = 0;
+
+    bool is_foreign;
+
+    /* Some advertisements come from other devices, e.g. phones */
+    is_foreign = ((int)(rand_r(&device->seed) % 100) <
+                  simulated_config.foreign_percentage);
+
+    info = (le_advertising_info *)report;
+    /* non-connectable undirected advertising */
+    info->evt_type = 0x03;
+    info->bdaddr_type = 0x00;
+    memset(&info->bdaddr, 0, sizeof(info->bdaddr));
+    info->bdaddr.b[0] = (uint8_t)beacon;
+    info->bdaddr.b[5] = is_foreign ? 0x4C : 0xC1;
+
+    data = info->data;
+
+    /* AD element of flags */
+    data[length++] = 2;
+    data[length++] = EIR_FLAGS;
+    data[length++] = 0x06;
+
+    /* AD element of manufacturer specific data in the LBeacon format:
+       Broadcom company identifier, beacon-like prefix and the UUID with
+       the X and Y coordinates of the beacon. Foreign advertisements use
+       the same layout with the Apple company identifier. */
+    data[length++] = 26;
+    data[length++] = EIR_MANUFACTURE_SPECIFIC_DATA;
+    data[length++] = is_foreign ? 0x4C : 0x0F;
+    data[length++] = 0x00;
+    data[length++] = 0x02;
+    data[length++] = 0x15;
+    memset(&data[length], 0, 16);
+    data[length + 9] = (uint8_t)(beacon + 1);
+    data[length + 15] = (uint8_t)(beacon + 1);
+    length += 16;
+    /* major, minor and measured power */
+    memset(&data[length], 0, 4);
+    length += 4;
+    data[length++] = 0xC5;
+
+    info->length = length;
+
+    /* Spread the mean RSSI of beacons over the range and add some noise */
+    rssi_range = SIMULATED_MAX_RSSI - SIMULATED_MIN_RSSI;
+    rssi = SIMULATED_MAX_RSSI -
+           (beacon * rssi_range) / simulated_config.num_lbeacons +
+           (int)(rand_r(&device->seed) % 9) - 4;
+    if(rssi > SIMULATED_MAX_RSSI){
+        rssi = SIMULATED_MAX_RSSI;
+    }
+    if(rssi < SIMULATED_MIN_RSSI){
+        rssi = SIMULATED_MIN_RSSI;
+    }
+    data[length] = (uint8_t)(int8_t)rssi;
+
+    return LE_ADVERTISING_INFO_SIZE + length + 1;
+}
+
+
+/* A static function to build an LE Meta advertising report event packing
+   the configured number of reports, starting from the specified simulated
+   beacon. The event is laid out as read from a HCI socket, i.e. prefixed
+   with the packet type. */
+static int build_advertising_event(SimulatedDevice *device,
+                                   int *beacon,
+                                   uint8_t *event){
+    evt_le_meta_event *meta;
+    uint8_t *report;
+    int i;
+
+    event[0] = HCI_EVENT_PKT;
+    event[1] = EVT_LE_META_EVENT;
+
+    meta = (evt_le_meta_event *)(event + HCI_EVENT_HDR_SIZE + 1);
+    meta->subevent = EVT_LE_ADVERTISING_REPORT;
+    /* number of reports */
+    meta->data[0] = simulated_config.reports_per_event;
+
+    report = meta->data + 1;
+    for(i = 0 ; i < simulated_config.reports_per_event ; i++){
+        report += build_advertising_report(device, *beacon, report);
+        *beacon = (*beacon + 1) % simulated_config.num_lbeacons;
+    }
+
+    /* parameter length of the event */
+    event[2] = report - (uint8_t *)meta;
+
+    return 1 + HCI_EVENT_HDR_SIZE + event[2];
+}
+
+
+/* A static function to execute the HCI commands the host has written to
+   the simulated device, and to answer each of them with a Command Complete
+   event. Commands are not dropped, so the answer waits for room in the
+   socket. */
+static void handle_simulated_commands(SimulatedDevice *device){
+    uint8_t command[HCI_MAX_EVENT_SIZE];
+    uint8_t event[1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE + 1];
+    hci_command_hdr *header;
+    evt_cmd_complete *complete;
+    le_set_scan_enable_cp *scan_enable_cp;
+    le_set_scan_parameters_cp *scan_parameters_cp;
+    ssize_t length;
+
+    while(0 < (length = recv(device->controller_fd, command,
+                             sizeof(command), MSG_DONTWAIT))){
+
+        if(length < 1 + HCI_COMMAND_HDR_SIZE ||
+           HCI_COMMAND_PKT != command[0]){
+            continue;
+        }
+
+        header = (hci_command_hdr *)(command + 1);
+
+        if(btohs(header->opcode) ==
+           cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE) &&
+           length >= 1 + HCI_COMMAND_HDR_SIZE +
+                     (ssize_t)sizeof(le_set_scan_enable_cp)){
+
+            scan_enable_cp = (le_set_scan_enable_cp *)
+                (command + 1 + HCI_COMMAND_HDR_SIZE);
+            device->is_scan_enabled = (0 != scan_enable_cp->enable);
+        }
+
+        if(btohs(header->opcode) ==
+           cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS) &&
+           length >= 1 + HCI_COMMAND_HDR_SIZE +
+                     (ssize_t)sizeof(le_set_scan_parameters_cp)){
+
+            scan_parameters_cp = (le_set_scan_parameters_cp *)
+                (command + 1 + HCI_COMMAND_HDR_SIZE);
+            device->scan_interval = btohs(scan_parameters_cp->interval);
+            device->scan_window = btohs(scan_parameters_cp->window);
+        }
+
+        /* Every command completes successfully with status 0 */
+        event[0] = HCI_EVENT_PKT;
+        event[1] = EVT_CMD_COMPLETE;
+        event[2] = EVT_CMD_COMPLETE_SIZE + 1;
+        complete = (evt_cmd_complete *)(event + 1 + HCI_EVENT_HDR_SIZE);
+        complete->ncmd = SIMULATED_COMMAND_CREDITS;
+        complete->opcode = header->opcode;
+        event[1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE] = 0;
+
+        if(0 > send(device->controller_fd, event, sizeof(event),
+                    MSG_NOSIGNAL)){
+            /* The host end is shut down */
+            return;
+        }
+
+        device->completed_commands++;
+        device->emitted_events++;
+    }
+}
+
+
+/* A static function to get the time until the scan window of the device
+   opens, which is 0 while the window is open. The windows are aligned to
+   the monotonic clock. */
+static long long get_time_to_scan_window_in_ns(SimulatedDevice *device){
+    /* One unit of the scan interval and window is 0.625 ms */
+    long long interval_in_ns = device->scan_interval * 625000LL;
+    long long window_in_ns = device->scan_window * 625000LL;
+    struct timespec now;
+    long long offset_in_ns;
+
+    if(window_in_ns >= interval_in_ns){
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    offset_in_ns = (now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec) %
+                   interval_in_ns;
+
+    return (offset_in_ns < window_in_ns) ? 0 : interval_in_ns - offset_in_ns;
+}
+
+
+/* A static function to wait until the time of the next advertising report,
+   or until the host writes a command. A NULL deadline waits for commands
+   only, checking regularly whether the device is closed. */
+static void wait_simulated_controller(SimulatedDevice *device,
+                                      struct timespec *deadline){
+    struct pollfd poll_fd;
+    struct timespec now;
+    struct timespec timeout;
+
+    if(NULL == deadline){
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = SIMULATED_IDLE_CHECK_IN_MS * 1000000L;
+    }else{
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        timeout.tv_sec = deadline->tv_sec - now.tv_sec;
+        timeout.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if(timeout.tv_nsec < 0){
+            timeout.tv_nsec += NANOSECONDS_PER_SECOND;
+            timeout.tv_sec--;
+        }
+        if(timeout.tv_sec < 0){
+            return;
+        }
+    }
+
+    poll_fd.fd = device->controller_fd;
+    poll_fd.events = POLLIN;
+    poll_fd.revents = 0;
+
+    if(0 < ppoll(&poll_fd, 1, &timeout, NULL)){
+        handle_simulated_commands(device);
+    }
+}
+
+
+/* The routine of the simulated controller thread. It answers the commands
+   of the host, and emits advertising reports at the configured rate while
+   scanning is enabled. When the rate is set, reports that do not fit into
+   the socket buffer are dropped, like a controller does when the host does
+   not keep up. */
+static void *simulated_controller_routine(void *param){
+    SimulatedDevice *device = (SimulatedDevice *)param;
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    struct timespec next_event;
+    struct timespec window_start;
+    long long interval_in_ns = 0;
+    long long time_to_window_in_ns;
+    int beacon = 0;
+    int length;
+    int flags = MSG_NOSIGNAL;
+
+    if(simulated_config.report_rate > 0){
+        interval_in_ns = NANOSECONDS_PER_SECOND *
+                         simulated_config.reports_per_event /
+                         simulated_config.report_rate;
+        flags |= MSG_DONTWAIT;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &next_event);
+
+    while(true == device->is_running){
+
+        handle_simulated_commands(device);
+
+        if(false == device->is_scan_enabled){
+            wait_simulated_controller(device, NULL);
+            clock_gettime(CLOCK_MONOTONIC, &next_event);
+            continue;
+        }
+
+        /* The radio does not listen between scan windows */
+        time_to_window_in_ns = get_time_to_scan_window_in_ns(device);
+        if(time_to_window_in_ns > 0){
+            clock_gettime(CLOCK_MONOTONIC, &window_start);
+            window_start.tv_sec += time_to_window_in_ns /
+                                   NANOSECONDS_PER_SECOND;
+            window_start.tv_nsec += time_to_window_in_ns %
+                                    NANOSECONDS_PER_SECOND;
+            if(window_start.tv_nsec >= NANOSECONDS_PER_SECOND){
+                window_start.tv_nsec -= NANOSECONDS_PER_SECOND;
+                window_start.tv_sec++;
+            }
+            wait_simulated_controller(device, &window_start);
+            clock_gettime(CLOCK_MONOTONIC, &next_event);
+            continue;
+        }
+
+        length = build_advertising_event(device, &beacon, event);
+
+        if(0 > send(device->controller_fd, event, length, flags)){
+            if(EAGAIN == errno || EWOULDBLOCK == errno || ENOBUFS == errno){
+                device->dropped_reports +=
+                    simulated_config.reports_per_event;
+            }else{
+                /* The host end is shut down */
+                break;
+            }
+        }else{
+            device->emitted_reports += simulated_config.reports_per_event;
+            device->emitted_events++;
+        }
+
+        if(interval_in_ns > 0){
+            next_event.tv_sec += interval_in_ns / NANOSECONDS_PER_SECOND;
+            next_event.tv_nsec += interval_in_ns % NANOSECONDS_PER_SECOND;
+            if(next_event.tv_nsec >= NANOSECONDS_PER_SECOND){
+                next_event.tv_nsec -= NANOSECONDS_PER_SECOND;
+                next_event.tv_sec++;
+            }
+            wait_simulated_controller(device, &next_event);
+        }
+    }
+
+    return NULL;
+}
+
+
+static int simulated_get_route(void){
+
+    return SIMULATED_DONGLE_ID;
+}
+
+
+static int simulated_open_dev(int dev_id){
+    SimulatedDevice *device = NULL;
+    int fds[2];
+    int i;
+
+    if(dev_id < SIMULATED_DONGLE_ID ||
+       dev_id >= SIMULATED_DONGLE_ID + SIMULATED_NUM_DONGLES){
+        errno = ENODEV;
+        return -1;
+    }
+
+    pthread_mutex_lock(&simulated_devices_lock);
+
+    for(i = 0 ; i < MAX_SIMULATED_DEVICES ; i++){
+        if(false == simulated_devices[i].is_used){
+            device = &simulated_devices[i];
+            break;
+        }
+    }
+
+    if(NULL == device){
+        pthread_mutex_unlock(&simulated_devices_lock);
+        errno = EMFILE;
+        return -1;
+    }
+
+    /* Sequenced packets preserve the boundaries of HCI events */
+    if(0 > socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)){
+        pthread_mutex_unlock(&simulated_devices_lock);
+        return -1;
+    }
+
+    memset(device, 0, sizeof(SimulatedDevice));
+    device->host_fd = fds[0];
+    device->controller_fd = fds[1];
+    device->seed = (unsigned int)fds[0];
+    device->is_running = true;
+
+    if(0 != pthread_create(&device->thread, NULL,
+                           simulated_controller_routine, device)){
+        close(fds[0]);
+        close(fds[1]);
+        pthread_mutex_unlock(&simulated_devices_lock);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    device->is_used = true;
+
+    pthread_mutex_unlock(&simulated_devices_lock);
+
+    return device->host_fd;
+}
+
+
+static int simulated_close_dev(int dd){
+    SimulatedDevice *device;
+
+    pthread_mutex_lock(&simulated_devices_lock);
+
+    device = find_simulated_device(dd);
+    if(NULL == device){
+        pthread_mutex_unlock(&simulated_devices_lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    device->is_closing = true;
+    device->is_running = false;
+    shutdown(device->host_fd, SHUT_RDWR);
+
+    /* The slot stays in use, so the thread is joined without holding the
+       lock the other devices are looked up with */
+    pthread_mutex_unlock(&simulated_devices_lock);
+
+    pthread_join(device->thread, NULL);
+
+    if(device->emitted_reports > 0 || device->dropped_reports > 0 ||
+       device->completed_commands > 0){
+        zlog_info(category_health_report,
+                  "Simulated controller emitted %llu reports, dropped %llu, "
+                  "completed %llu commands",
+                  device->emitted_reports, device->dropped_reports,
+                  device->completed_commands);
+    }
+
+    close(device->host_fd);
+    close(device->controller_fd);
+
+    pthread_mutex_lock(&simulated_devices_lock);
+    device->is_used = false;
+    pthread_mutex_unlock(&simulated_devices_lock);
+
+    return 0;
+}
+
+
+static int simulated_le_set_scan_enable(int dd,
+                                        uint8_t enable,
+                                        uint8_t filter_dup,
+                                        int timeout){
+    SimulatedDevice *device;
+
+    pthread_mutex_lock(&simulated_devices_lock);
+
+    device = find_simulated_device(dd);
+    if(NULL != device){
+        device->is_scan_enabled = (0 != enable);
+    }
+
+    pthread_mutex_unlock(&simulated_devices_lock);
+
+    if(NULL == device){
+        errno = EBADF;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int simulated_send_cmd(int dd,
+                              uint16_t ogf,
+                              uint16_t ocf,
+                              uint8_t plen,
+                              void *param){
+    uint8_t command[1 + HCI_COMMAND_HDR_SIZE + UINT8_MAX];
+    hci_command_hdr *header;
+
+    if(false == is_simulated_device(dd)){
+        errno = EBADF;
+        return -1;
+    }
+
+    /* The command is laid out as written to a HCI socket, and is executed
+       by the controller thread */
+    command[0] = HCI_COMMAND_PKT;
+    header = (hci_command_hdr *)(command + 1);
+    header->opcode = htobs(cmd_opcode_pack(ogf, ocf));
+    header->plen = plen;
+    if(plen > 0){
+        memcpy(command + 1 + HCI_COMMAND_HDR_SIZE, param, plen);
+    }
+
+    if(0 > send(dd, command, 1 + HCI_COMMAND_HDR_SIZE + plen,
+                MSG_NOSIGNAL)){
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int simulated_le_set_scan_parameters(int dd,
+                                            uint8_t type,
+                                            uint16_t interval,
+                                            uint16_t window,
+                                            uint8_t own_type,
+                                            uint8_t filter,
+                                            int timeout){
+    SimulatedDevice *device;
+
+    pthread_mutex_lock(&simulated_devices_lock);
+
+    device = find_simulated_device(dd);
+    if(NULL != device){
+        device->scan_interval = btohs(interval);
+        device->scan_window = btohs(window);
+    }
+
+    pthread_mutex_unlock(&simulated_devices_lock);
+
+    if(NULL == device){
+        errno = EBADF;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int simulated_send_req(int dd,
+                              struct hci_request *request,
+                              int timeout){
+    le_set_scan_enable_cp *scan_enable_cp;
+    le_set_scan_parameters_cp *scan_parameters_cp;
+
+    if(false == is_simulated_device(dd)){
+        errno = EBADF;
+        return -1;
+    }
+
+    if(OGF_LE_CTL == request->ogf &&
+       OCF_LE_SET_SCAN_ENABLE == request->ocf){
+
+        scan_enable_cp = (le_set_scan_enable_cp *)request->cparam;
+        simulated_le_set_scan_enable(dd, scan_enable_cp->enable,
+                                     scan_enable_cp->filter_dup, timeout);
+    }
+
+    if(OGF_LE_CTL == request->ogf &&
+       OCF_LE_SET_SCAN_PARAMETERS == request->ocf){
+
+        scan_parameters_cp = (le_set_scan_parameters_cp *)request->cparam;
+        simulated_le_set_scan_parameters(dd, scan_parameters_cp->type,
+                                         scan_parameters_cp->interval,
+                                         scan_parameters_cp->window,
+                                         scan_parameters_cp->own_bdaddr_type,
+                                         scan_parameters_cp->filter,
+                                         timeout);
+    }
+
+    /* Every command completes successfully with status 0 */
+    if(NULL != request->rparam && request->rlen > 0){
+        memset(request->rparam, 0, request->rlen);
+    }
+
+    return 0;
+}
+
+
+static int simulated_set_filter(int dd, struct hci_filter *filter){
+
+    /* Only advertising reports are emitted, so there is nothing to filter */
+    return 0;
+}
+
+
+static int simulated_get_event_count(int dev_id,
+                                    int dd,
+                                    unsigned long long *count){
+    SimulatedDevice *device;
+
+    pthread_mutex_lock(&simulated_devices_lock);
+
+    device = find_simulated_device(dd);
+    if(NULL != device){
+        *count = device->emitted_events;
+    }
+
+    pthread_mutex_unlock(&simulated_devices_lock);
+
+    if(NULL == device){
+        errno = EBADF;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int attach_filter(int dd, struct sock_fprog *program){
+
+    /* Socket filters apply to HCI sockets and to the socket pairs of the
+       simulated controller alike */
+    return setsockopt(dd, SOL_SOCKET, SO_ATTACH_FILTER, program,
+                      sizeof(struct sock_fprog));
+}
+
+
+static ssize_t read_events(int dd,
+                           uint8_t buffers[][HCI_MAX_EVENT_SIZE],
+                           int *lengths,
+                           int max_events){
+    struct mmsghdr messages[HCI_EVENT_BATCH_SIZE];
+    struct iovec iovecs[HCI_EVENT_BATCH_SIZE];
+    int num_events;
+    int i;
+
+    if(max_events > HCI_EVENT_BATCH_SIZE){
+        max_events = HCI_EVENT_BATCH_SIZE;
+    }
+
+    memset(messages, 0, sizeof(struct mmsghdr) * max_events);
+    for(i = 0 ; i < max_events ; i++){
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = HCI_MAX_EVENT_SIZE;
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* Take every event already queued on the socket, up to the size of the
+       batch, within one system call without blocking */
+    num_events = recvmmsg(dd, messages, max_events, MSG_DONTWAIT, NULL);
+
+    /* Once the other end of a socket pair is closed, every message is
+       empty, so the events end at the first empty message and the reader
+       finds the device hung up when it polls again */
+    for(i = 0 ; i < num_events ; i++){
+        if(0 == messages[i].msg_len){
+            return i;
+        }
+        lengths[i] = messages[i].msg_len;
+    }
+
+    return num_events;
+}
+
+
+static int bluez_get_route(void){
+
+    return hci_get_route(NULL);
+}
+
+
+static int bluez_set_filter(int dd, struct hci_filter *filter){
+
+    return setsockopt(dd, SOL_HCI, HCI_FILTER, filter,
+                      sizeof(struct hci_filter));
+}
+
+
+static int bluez_get_event_count(int dev_id,
+                                 int dd,
+                                 unsigned long long *count){
+    struct hci_dev_info device_info;
+
+    if(0 > hci_devinfo(dev_id, &device_info)){
+        return -1;
+    }
+
+    *count = device_info.stat.evt_rx;
+
+    return 0;
+}
+
+
+static HCITransport bluez_transport = {
+    .name = "bluez",
+    .get_route = bluez_get_route,
+    .open_dev = hci_open_dev,
+    .close_dev = hci_close_dev,
+    .send_req = hci_send_req,
+    .send_cmd = hci_send_cmd,
+    .le_set_scan_parameters = hci_le_set_scan_parameters,
+    .le_set_scan_enable = hci_le_set_scan_enable,
+    .set_filter = bluez_set_filter,
+    .attach_filter = attach_filter,
+    .get_event_count = bluez_get_event_count,
+    .read_events = read_events
+};
+
+
+static HCITransport simulated_transport = {
+    .name = "simulated",
+    .get_route = simulated_get_route,
+    .open_dev = simulated_open_dev,
+    .close_dev = simulated_close_dev,
+    .send_req = simulated_send_req,
+    .send_cmd = simulated_send_cmd,
+    .le_set_scan_parameters = simulated_le_set_scan_parameters,
+    .le_set_scan_enable = simulated_le_set_scan_enable,
+    .set_filter = simulated_set_filter,
+    .attach_filter = attach_filter,
+    .get_event_count = simulated_get_event_count,
+    .read_events = read_events
+};
+
+
+HCITransport *get_hci_transport(HCITransportType type,
+                                SimulatedControllerConfig *sim_config){
+
+    switch(type){
+        case HCI_TRANSPORT_BLUEZ:
+            return &bluez_transport;
+
+        case HCI_TRANSPORT_SIMULATED:
+            if(NULL == sim_config || sim_config->num_lbeacons <= 0 ||
+               sim_config->num_lbeacons > UINT8_MAX ||
+               sim_config->report_rate < 0 ||
+               sim_config->reports_per_event <= 0 ||
+               sim_config->reports_per_event >
+               SIMULATED_MAX_REPORTS_PER_EVENT ||
+               sim_config->foreign_percentage < 0 ||
+               sim_config->foreign_percentage > 100){
+                return NULL;
+            }
+            simulated_config = *sim_config;
+            return &simulated_transport;
+
+        default:
+            return NULL;
+    }
+}
@@ -0,0 +1,199 @@
+/*
+Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+License:
+
+    GPL 3.0 : The content of this file is subject to the terms and
+    conditions defined in file 'COPYING.txt', which is part of this source
+    code package.
+
+Project Name:
+
+    BeDIS
+
+File Description:
+
+    This header file contains declarations of the HCI transport interface
+    used by the Tag to talk to a Bluetooth controller. Two transports are
+    provided: the BlueZ transport which wraps the HCI socket library, and a
+    simulated transport which runs an in-process controller emitting LE Meta
+    advertising reports at a configurable rate, so that the scanning path
+    can be exercised and profiled without a physical dongle.
+
+File Name:
+
+    HCI_Transport.h
+
+Version:
+
+    1.0,  20190429
+
+Abstract:
+
+Authors:
+
+    Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#ifndef HCI_TRANSPORT_H
+#define HCI_TRANSPORT_H
+
+/*
+* INCLUDES
+*/
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <linux/filter.h>
+#include "BeDIS.h"
+
+/*
+  CONSTANTS
+*/
+
+/* For following EIR_ constants, please refer to Bluetooth specifications for
+the defined values.
+https://www.bluetooth.com/specifications/assigned-numbers/generic-access-profile
+*/
+/* BlueZ bluetooth extended inquiry response protocol: flags */
+#define EIR_FLAGS 0X01
+
+/* BlueZ bluetooth extended inquiry response protocol: short local name */
+#define EIR_NAME_SHORT 0x08
+
+/* BlueZ bluetooth extended inquiry response protocol: complete local name */
+#define EIR_NAME_COMPLETE 0x09
+
+/* BlueZ bluetooth extended inquiry response protocol: Manufacturer Specific
+   Data */
+#define EIR_MANUFACTURE_SPECIFIC_DATA 0xFF
+
+/* Maximum number of devices the simulated controller can open at once */
+#define MAX_SIMULATED_DEVICES 8
+
+/* The RSSI range of advertisements emitted by the simulated controller */
+#define SIMULATED_MIN_RSSI -95
+#define SIMULATED_MAX_RSSI -40
+
+/* The dongle id reported by the simulated controller */
+#define SIMULATED_DONGLE_ID 0
+
+/* Number of dongles of the simulated controller, whose ids start from
+   SIMULATED_DONGLE_ID */
+#define SIMULATED_NUM_DONGLES 4
+
+/* Maximum number of LBeacon advertising reports fitting into one event */
+#define SIMULATED_MAX_REPORTS_PER_EVENT 6
+
+/* Maximum number of HCI events taken from the socket in one read */
+#define HCI_EVENT_BATCH_SIZE 16
+
+/*
+  TYPEDEF STRUCTS
+*/
+
+/* Type of HCI transport used to reach the Bluetooth controller */
+typedef enum HCITransportType {
+
+    HCI_TRANSPORT_BLUEZ = 0,
+    HCI_TRANSPORT_SIMULATED = 1,
+    max_transport_type = 2
+
+} HCITransportType;
+
+/* Settings of the simulated controller */
+typedef struct SimulatedControllerConfig {
+
+    /* Number of advertising reports emitted per second while scanning is
+       enabled. 0 means emitting as fast as the reader drains the socket. */
+    int report_rate;
+
+    /* Number of distinct LBeacons the simulated controller advertises */
+    int num_lbeacons;
+
+    /* Number of advertising reports packed into each LE Meta event */
+    int reports_per_event;
+
+    /* Percentage of advertising reports coming from devices other than
+       LBeacons */
+    int foreign_percentage;
+
+} SimulatedControllerConfig;
+
+/* The operations of a HCI transport. Every function mirrors the HCI
+   library function of the same name and follows its return convention:
+   a negative return value means the operation failed and errno is set. */
+typedef struct HCITransport {
+
+    /* Name of the transport used in log messages */
+    char *name;
+
+    int (*get_route)(void);
+
+    int (*open_dev)(int dev_id);
+
+    int (*close_dev)(int dd);
+
+    int (*send_req)(int dd, struct hci_request *request, int timeout);
+
+    /* Writes a command to the device without waiting for its Command
+       Complete or Command Status event, which is read with the other
+       events of the device */
+    int (*send_cmd)(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen,
+                    void *param);
+
+    int (*le_set_scan_parameters)(int dd, uint8_t type, uint16_t interval,
+                                  uint16_t window, uint8_t own_type,
+                                  uint8_t filter, int timeout);
+
+    int (*le_set_scan_enable)(int dd, uint8_t enable, uint8_t filter_dup,
+                              int timeout);
+
+    int (*set_filter)(int dd, struct hci_filter *filter);
+
+    /* Attaches a classic BPF program to the device, which runs in the
+       kernel on every packet before it is queued to the device */
+    int (*attach_filter)(int dd, struct sock_fprog *program);
+
+    /* Gets the number of HCI events the controller has delivered to the
+       host, counted before any socket filter is applied */
+    int (*get_event_count)(int dev_id, int dd, unsigned long long *count);
+
+    /* Reads up to max_events HCI events already queued on the device into
+       buffers without blocking, and stores the length of each event into
+       lengths. Returns the number of events read, or -1 with errno set to
+       EAGAIN if no event is queued. */
+    ssize_t (*read_events)(int dd, uint8_t buffers[][HCI_MAX_EVENT_SIZE],
+                           int *lengths, int max_events);
+
+} HCITransport;
+
+/*
+  FUNCTIONS
+*/
+
+/*
+  get_hci_transport:
+
+      This function returns the HCI transport of the specified type. For the
+      simulated transport, the settings of the simulated controller are
+      copied and applied to devices opened afterwards.
+
+  Parameters:
+
+      type - the type of HCI transport
+      sim_config - settings of the simulated controller. This parameter is
+                   ignored by the BlueZ transport and may be NULL.
+
+  Return value:
+
+      HCITransport * - pointer to the transport, or NULL if the type is
+                       unknown
+*/
+
+HCITransport *get_hci_transport(HCITransportType type,
+                                SimulatedControllerConfig *sim_config);
+
+#endif
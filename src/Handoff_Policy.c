@@ -0,0 +1,294 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the implementation of the handoff policies.
+
+ File Name:
+
+      Handoff_Policy.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include "Handoff_Policy.h"
+
+
+/* The settings copied by get_handoff_policy */
+static HandoffPolicyConfig policy_config;
+
+/* The RSSI value of the associated LBeacon at the end of the previous scan
+   window, or when the association changed */
+static int previous_associated_rssi;
+
+/* Time in micro seconds on the monotonic clock when the association
+   changed */
+static long long association_time;
+
+/* The selected policy, whose operations are copied from one of the
+   policies below */
+static HandoffPolicy selected_policy;
+
+
+/* A static function to check whether the strongest LBeacon should take
+   over the association by the RSSI difference alone. */
+static bool is_stronger_by(HandoffCandidate *associated,
+                           HandoffCandidate *strongest,
+                           int margin){
+
+    if(strongest->index == -1){
+        return false;
+    }
+
+    if(associated->index == -1){
+        return true;
+    }
+
+    return strongest->index != associated->index &&
+           strongest->rssi - associated->rssi > margin;
+}
+
+
+static void record_association(LBeaconTable *table,
+                               HandoffCandidate *association,
+                               long long now){
+
+    previous_associated_rssi = association->rssi;
+    association_time = now;
+}
+
+
+static bool threshold_decide_on_window(LBeaconTable *table,
+                                       HandoffCandidate *associated,
+                                       HandoffCandidate *strongest,
+                                       long long now){
+
+    if(associated->index != -1 &&
+       associated->rssi <= previous_associated_rssi){
+        previous_associated_rssi = associated->rssi;
+        return false;
+    }
+
+    return is_stronger_by(associated, strongest,
+                          policy_config.change_criteria);
+}
+
+
+static int threshold_decide_on_report(LBeaconTable *table,
+                                      HandoffCandidate *associated,
+                                      HandoffCandidate *reported,
+                                      int report_rssi,
+                                      HandoffCandidate *strongest,
+                                      long long now){
+
+    return is_stronger_by(associated, strongest,
+                          policy_config.change_criteria) ?
+           strongest->index : -1;
+}
+
+
+static int cusum_decide_on_report(LBeaconTable *table,
+                                  HandoffCandidate *associated,
+                                  HandoffCandidate *reported,
+                                  int report_rssi,
+                                  HandoffCandidate *strongest,
+                                  long long now){
+    int32_t score;
+
+    /* Nothing to test against, so the sequential test starts from the
+       first LBeacon heard */
+    if(associated->index == -1){
+        return reported->index;
+    }
+
+    if(reported->index == associated->index){
+        return -1;
+    }
+
+    /* One-sided CUSUM: differences below the drift drain the evidence, so
+       ambiguous signals never accumulate enough to switch */
+    score = table->handoff_scores[reported->index] +
+            (report_rssi - associated->rssi) - policy_config.cusum_drift;
+    if(score < 0){
+        score = 0;
+    }
+    table->handoff_scores[reported->index] = score;
+
+    return (score > policy_config.cusum_threshold) ? reported->index : -1;
+}
+
+
+static bool dwell_decide_on_window(LBeaconTable *table,
+                                   HandoffCandidate *associated,
+                                   HandoffCandidate *strongest,
+                                   long long now){
+
+    if(associated->index != -1 &&
+       now - association_time < policy_config.min_dwell_time_in_ms * 1000LL){
+        return false;
+    }
+
+    return is_stronger_by(associated, strongest,
+                          policy_config.change_criteria);
+}
+
+
+static int dwell_decide_on_report(LBeaconTable *table,
+                                  HandoffCandidate *associated,
+                                  HandoffCandidate *reported,
+                                  int report_rssi,
+                                  HandoffCandidate *strongest,
+                                  long long now){
+
+    return dwell_decide_on_window(table, associated, strongest, now) ?
+           strongest->index : -1;
+}
+
+
+static bool variance_decide_on_window(LBeaconTable *table,
+                                      HandoffCandidate *associated,
+                                      HandoffCandidate *strongest,
+                                      long long now){
+    long long excess;
+    long long variance;
+
+    if(!is_stronger_by(associated, strongest,
+                       policy_config.change_criteria)){
+        return false;
+    }
+
+    if(associated->index == -1){
+        return true;
+    }
+
+    excess = strongest->rssi - associated->rssi -
+             policy_config.change_criteria;
+    variance = get_lbeacon_rssi_variance(table, strongest->index, now,
+                                         policy_config.variance_window_in_us) +
+               get_lbeacon_rssi_variance(table, associated->index, now,
+                                         policy_config.variance_window_in_us);
+
+    /* The excess has to be above the factor times the square root of the
+       mean variance of the two LBeacons. Both sides are squared to avoid
+       the square root. */
+    return ((2 * excess * excess) << RSSI_FRACTION_BITS) >
+           (long long)policy_config.variance_margin_factor *
+           policy_config.variance_margin_factor * variance;
+}
+
+
+static int variance_decide_on_report(LBeaconTable *table,
+                                     HandoffCandidate *associated,
+                                     HandoffCandidate *reported,
+                                     int report_rssi,
+                                     HandoffCandidate *strongest,
+                                     long long now){
+
+    return variance_decide_on_window(table, associated, strongest, now) ?
+           strongest->index : -1;
+}
+
+
+static HandoffPolicy threshold_policy = {
+    .name = "threshold",
+    .decide_on_window = threshold_decide_on_window,
+    .decide_on_report = threshold_decide_on_report,
+    .change_association = record_association
+};
+
+
+static HandoffPolicy cusum_policy = {
+    .name = "cusum",
+    .decide_on_window = NULL,
+    .decide_on_report = cusum_decide_on_report,
+    .change_association = record_association
+};
+
+
+static HandoffPolicy dwell_policy = {
+    .name = "dwell",
+    .decide_on_window = dwell_decide_on_window,
+    .decide_on_report = dwell_decide_on_report,
+    .change_association = record_association
+};
+
+
+static HandoffPolicy variance_policy = {
+    .name = "variance margin",
+    .decide_on_window = variance_decide_on_window,
+    .decide_on_report = variance_decide_on_report,
+    .change_association = record_association
+};
+
+
+HandoffPolicy *get_handoff_policy(HandoffPolicyType type,
+                                  HandoffPolicyConfig *config){
+
+    bool is_first_policy = (NULL == selected_policy.name);
+
+    if(NULL == config || config->cusum_drift < 0 ||
+       config->cusum_threshold <= 0 || config->min_dwell_time_in_ms < 0 ||
+       config->variance_margin_factor < 0 ||
+       config->variance_window_in_us <= 0){
+        return NULL;
+    }
+
+    switch(type){
+        case HANDOFF_POLICY_THRESHOLD:
+            selected_policy = threshold_policy;
+            break;
+
+        case HANDOFF_POLICY_CUSUM:
+            selected_policy = cusum_policy;
+            break;
+
+        case HANDOFF_POLICY_DWELL:
+            selected_policy = dwell_policy;
+            break;
+
+        case HANDOFF_POLICY_VARIANCE_MARGIN:
+            selected_policy = variance_policy;
+            break;
+
+        default:
+            return NULL;
+    }
+
+    /* The policies comparing the strongest LBeacon with the associated
+       LBeacon decide on every report only if asked to */
+    if(NULL != selected_policy.decide_on_window &&
+       !config->is_per_report_decision){
+        selected_policy.decide_on_report = NULL;
+    }
+
+    policy_config = *config;
+
+    /* The association outlives a change of the policy or its settings, so
+       that reloading the settings never skips the dwell time */
+    if(is_first_policy){
+        previous_associated_rssi = -100;
+        association_time = 0;
+    }
+
+    return &selected_policy;
+}
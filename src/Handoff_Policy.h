@@ -0,0 +1,182 @@
+/*
+Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+License:
+
+    GPL 3.0 : The content of this file is subject to the terms and
+    conditions defined in file 'COPYING.txt', which is part of this source
+    code package.
+
+Project Name:
+
+    BeDIS
+
+File Description:
+
+    This header file contains declarations of the handoff policies, which
+    decide when the Tag changes its association from one LBeacon to
+    another. Every change reconfigures the advertising and triggers
+    updates at the gateways, so the policies differ in how much evidence
+    they require before changing. A policy is selected in the config file
+    and accessed through the HandoffPolicy operations.
+
+File Name:
+
+    Handoff_Policy.h
+
+Version:
+
+    1.0,  20190429
+
+Abstract:
+
+Authors:
+
+    Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#ifndef HANDOFF_POLICY_H
+#define HANDOFF_POLICY_H
+
+/*
+* INCLUDES
+*/
+
+#include "LBeacon_Table.h"
+
+/*
+  TYPEDEF STRUCTS
+*/
+
+/* Type of handoff policy */
+typedef enum HandoffPolicyType {
+
+    /* The strongest LBeacon is associated when it is stronger than the
+       associated LBeacon by the change criteria. At the end of a scan
+       window, the association is kept while the associated LBeacon does
+       not get stronger than at the previous window. */
+    HANDOFF_POLICY_THRESHOLD = 0,
+
+    /* A LBeacon is associated as soon as the CUSUM of its RSSI values
+       over the estimate of the associated LBeacon, less the drift, exceeds
+       the CUSUM threshold */
+    HANDOFF_POLICY_CUSUM = 1,
+
+    /* The strongest LBeacon is associated when it is stronger than the
+       associated LBeacon by the change criteria, and the association has
+       lasted for the minimum dwell time */
+    HANDOFF_POLICY_DWELL = 2,
+
+    /* The strongest LBeacon is associated when it is stronger than the
+       associated LBeacon by the change criteria plus a multiple of the
+       standard deviation of their RSSI samples */
+    HANDOFF_POLICY_VARIANCE_MARGIN = 3,
+
+    max_handoff_policy = 4
+
+} HandoffPolicyType;
+
+/* Settings of the handoff policies */
+typedef struct HandoffPolicyConfig {
+
+    /* The RSSI difference in dB the strongest LBeacon has to exceed the
+       associated LBeacon by */
+    int change_criteria;
+
+    /* Whether the policies comparing the strongest LBeacon with the
+       associated LBeacon also decide on every advertising report, in
+       addition to the end of each scan window */
+    bool is_per_report_decision;
+
+    /* The RSSI difference in dB a LBeacon has to exceed the associated
+       LBeacon by before its evidence accumulates */
+    int cusum_drift;
+
+    /* The accumulated evidence in dB which triggers the handoff */
+    int cusum_threshold;
+
+    /* The minimum time in milliseconds an association lasts */
+    int min_dwell_time_in_ms;
+
+    /* The number of standard deviations added to the change criteria */
+    int variance_margin_factor;
+
+    /* The length of the sliding window the variance of the RSSI samples is
+       computed over */
+    long long variance_window_in_us;
+
+} HandoffPolicyConfig;
+
+/* A LBeacon considered by a handoff decision */
+typedef struct HandoffCandidate {
+
+    /* The index of the slot of the LBeacon in the table, or -1 if there is
+       no such LBeacon */
+    int index;
+
+    /* The RSSI value of the LBeacon in dBm the decision is made on */
+    int rssi;
+
+} HandoffCandidate;
+
+/* The operations of a handoff policy */
+typedef struct HandoffPolicy {
+
+    /* Name of the policy used in log messages */
+    char *name;
+
+    /* Decides at the end of a scan window whether the association changes
+       to the strongest LBeacon. NULL if the policy does not decide at the
+       end of scan windows. */
+    bool (*decide_on_window)(LBeaconTable *table,
+                             HandoffCandidate *associated,
+                             HandoffCandidate *strongest,
+                             long long now);
+
+    /* Decides on an advertising report which LBeacon the association
+       changes to, given the LBeacon of the report with the RSSI value of
+       the report, and the strongest LBeacon. Returns the index of the slot
+       of the LBeacon, or -1 to keep the association. NULL if the policy
+       does not decide on advertising reports. */
+    int (*decide_on_report)(LBeaconTable *table,
+                            HandoffCandidate *associated,
+                            HandoffCandidate *reported,
+                            int report_rssi,
+                            HandoffCandidate *strongest,
+                            long long now);
+
+    /* Records that the association changes to the LBeacon */
+    void (*change_association)(LBeaconTable *table,
+                               HandoffCandidate *association,
+                               long long now);
+
+} HandoffPolicy;
+
+/*
+  FUNCTIONS
+*/
+
+/*
+  get_handoff_policy:
+
+      This function returns the handoff policy of the specified type. The
+      settings are copied and used by the decisions made afterwards. The
+      RSSI value and the time of the current association are kept when
+      the policy is selected again, e.g. on a reload of the config file.
+
+  Parameters:
+
+      type - the type of handoff policy
+      config - settings of the handoff policies
+
+  Return value:
+
+      HandoffPolicy * - pointer to the policy, or NULL if the type is
+                        unknown or the settings are invalid
+*/
+
+HandoffPolicy *get_handoff_policy(HandoffPolicyType type,
+                                  HandoffPolicyConfig *config);
+
+#endif
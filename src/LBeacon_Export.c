@@ -0,0 +1,131 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the implementation of the export of the LBeacon
+      table into shared memory.
+
+ File Name:
+
+      LBeacon_Export.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include "LBeacon_Export.h"
+
+
+ErrorCode open_lbeacon_export(LBeaconExport **export){
+
+    int fd;
+    void *segment;
+
+    fd = shm_open(LBEACON_EXPORT_NAME, O_CREAT | O_RDWR, 0644);
+    if(0 > fd){
+        return E_OPEN_FILE;
+    }
+
+    if(0 > ftruncate(fd, sizeof(LBeaconExport))){
+        close(fd);
+        shm_unlink(LBEACON_EXPORT_NAME);
+        return E_OPEN_FILE;
+    }
+
+    segment = mmap(NULL, sizeof(LBeaconExport), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+
+    /* The mapping stays valid after the descriptor is closed */
+    close(fd);
+
+    if(MAP_FAILED == segment){
+        shm_unlink(LBEACON_EXPORT_NAME);
+        return E_MALLOC;
+    }
+
+    *export = (LBeaconExport *)segment;
+
+    memset(*export, 0, sizeof(LBeaconExport));
+    __atomic_store_n(&(*export)->version, LBEACON_EXPORT_VERSION,
+                     __ATOMIC_RELEASE);
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+void close_lbeacon_export(LBeaconExport *export){
+
+    munmap(export, sizeof(LBeaconExport));
+    shm_unlink(LBEACON_EXPORT_NAME);
+}
+
+
+void begin_lbeacon_export_update(LBeaconExport *export){
+
+    /* Only the Tag writes the sequence number */
+    __atomic_store_n(&export->sequence, export->sequence + 1,
+                     __ATOMIC_RELAXED);
+
+    /* The odd sequence number is visible before any field changes */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+void end_lbeacon_export_update(LBeaconExport *export){
+
+    /* The fields are visible before the even sequence number */
+    __atomic_store_n(&export->sequence, export->sequence + 1,
+                     __ATOMIC_RELEASE);
+}
+
+
+bool read_lbeacon_export(LBeaconExport *export, LBeaconExport *snapshot){
+
+    uint32_t sequence;
+    int retry_time;
+
+    if(LBEACON_EXPORT_VERSION !=
+       __atomic_load_n(&export->version, __ATOMIC_ACQUIRE)){
+        return false;
+    }
+
+    for(retry_time = 0 ; retry_time < LBEACON_EXPORT_READ_RETRIES ;
+        retry_time++){
+
+        sequence = __atomic_load_n(&export->sequence, __ATOMIC_ACQUIRE);
+        if(sequence & 1){
+            continue;
+        }
+
+        memcpy(snapshot, export, sizeof(LBeaconExport));
+
+        /* The copy completes before the sequence number is read again */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if(sequence == __atomic_load_n(&export->sequence,
+                                       __ATOMIC_RELAXED)){
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,218 @@
+/*
+Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+License:
+
+    GPL 3.0 : The content of this file is subject to the terms and
+    conditions defined in file 'COPYING.txt', which is part of this source
+    code package.
+
+Project Name:
+
+    BeDIS
+
+File Description:
+
+    This header file contains declarations of the export of the LBeacon
+    table and the association of the Tag into POSIX shared memory. Local
+    processes such as diagnostics UIs and health agents map the segment
+    read-only and poll it without system calls. The Tag updates the
+    segment under a sequence lock: the sequence number is odd while an
+    update is in progress, and readers retry when it is odd or changes
+    during their copy, so the Tag never waits for the readers.
+
+File Name:
+
+    LBeacon_Export.h
+
+Version:
+
+    1.0,  20190429
+
+Abstract:
+
+Authors:
+
+    Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#ifndef LBEACON_EXPORT_H
+#define LBEACON_EXPORT_H
+
+/*
+* INCLUDES
+*/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "LBeacon_Table.h"
+
+/*
+  CONSTANTS
+*/
+
+/* Name of the shared memory segment */
+#define LBEACON_EXPORT_NAME "/bedis_tag_lbeacons"
+
+/* Version of the layout of the segment, changed whenever LBeaconExport
+   changes */
+#define LBEACON_EXPORT_VERSION 1
+
+/* Maximum number of LBeacons in the segment, in the order of the heap of
+   the table, so that the strongest LBeacon comes first */
+#define MAX_EXPORTED_LBEACONS 256
+
+/* Number of times a reader copies the segment before giving up on
+   updates in progress */
+#define LBEACON_EXPORT_READ_RETRIES 100
+
+/*
+  TYPEDEF STRUCTS
+*/
+
+/* A LBeacon in the segment */
+typedef struct ExportedLBeacon {
+
+    LBeaconUUID uuid;
+
+    /* The RSSI value in dBm the association is decided on */
+    int32_t rssi;
+
+    /* Number of advertising reports in the current scan window */
+    int32_t count;
+
+    /* Time in micro seconds on the monotonic clock when the LBeacon was
+       last heard */
+    int64_t last_seen_time;
+
+} ExportedLBeacon;
+
+/* The layout of the segment. Only fixed-size types are used, so that
+   readers built separately agree on the layout. */
+typedef struct LBeaconExport {
+
+    /* LBEACON_EXPORT_VERSION once the segment is initialized */
+    uint32_t version;
+
+    /* The sequence number, odd while an update is in progress */
+    uint32_t sequence;
+
+    /* Time in micro seconds on the monotonic clock of the last update */
+    int64_t update_time;
+
+    /* The associated LBeacon, whether there is one, and its RSSI value in
+       dBm, or INT32_MIN if it is no longer heard */
+    LBeaconUUID association;
+    int32_t is_associated;
+    int32_t associated_rssi;
+
+    /* Time in micro seconds on the monotonic clock when the association
+       changed, and the number of changes */
+    int64_t association_time;
+    uint64_t association_changes;
+
+    /* The level of scan duty cycle */
+    int32_t scan_profile_level;
+
+    /* The LBeacons tracked by the Tag */
+    int32_t num_lbeacons;
+    ExportedLBeacon lbeacons[MAX_EXPORTED_LBEACONS];
+
+} LBeaconExport;
+
+/*
+  FUNCTIONS
+*/
+
+/*
+  open_lbeacon_export:
+
+      This function creates and maps the shared memory segment, which is
+      cleared and stays so until the first update.
+
+  Parameters:
+
+      export - pointer to the mapped segment, set on success
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+ErrorCode open_lbeacon_export(LBeaconExport **export);
+
+/*
+  close_lbeacon_export:
+
+      This function unmaps and removes the shared memory segment. Readers
+      which have mapped it keep the last content.
+
+  Parameters:
+
+      export - the mapped segment
+
+  Return value:
+
+      None
+*/
+
+void close_lbeacon_export(LBeaconExport *export);
+
+/*
+  begin_lbeacon_export_update:
+
+      This function marks the start of an update of the segment. Every
+      field except the version and the sequence number may be written
+      until end_lbeacon_export_update is called.
+
+  Parameters:
+
+      export - the mapped segment
+
+  Return value:
+
+      None
+*/
+
+void begin_lbeacon_export_update(LBeaconExport *export);
+
+/*
+  end_lbeacon_export_update:
+
+      This function publishes the fields written since
+      begin_lbeacon_export_update to the readers.
+
+  Parameters:
+
+      export - the mapped segment
+
+  Return value:
+
+      None
+*/
+
+void end_lbeacon_export_update(LBeaconExport *export);
+
+/*
+  read_lbeacon_export:
+
+      This function copies a consistent snapshot of the segment, for the
+      readers in other processes.
+
+  Parameters:
+
+      export - the segment mapped by the reader
+      snapshot - the copy of the segment
+
+  Return value:
+
+      bool - true if the snapshot is consistent, false if the segment is
+             not initialized or every copy overlapped an update
+*/
+
+bool read_lbeacon_export(LBeaconExport *export, LBeaconExport *snapshot);
+
+#endif
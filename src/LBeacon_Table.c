@@ -0,0 +1,723 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the implementation of the hash table of LBeacons
+      heard by the Tag, of the RSSI estimator of the LBeacons, and of the
+      selection of the strongest LBeacon.
+
+ File Name:
+
+      LBeacon_Table.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include "LBeacon_Table.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LBEACON_TABLE_NEON
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define LBEACON_TABLE_SSE
+#endif
+
+
+/* The smallest weight of a new RSSI value, so that reports read in the
+   same batch still move the estimate */
+#define MIN_RSSI_WEIGHT ((1 << RSSI_WEIGHT_BITS) / 16)
+
+
+/* A static function to divide by a positive divisor, rounding to the
+   nearest integer and halves upward. */
+static inline int divide_rounded(int dividend, int divisor){
+    int quotient = dividend / divisor;
+    int remainder = dividend % divisor;
+
+    /* Division truncates toward zero, so take the floor first */
+    if(remainder < 0){
+        quotient--;
+        remainder += divisor;
+    }
+
+    return (2 * remainder >= divisor) ? quotient + 1 : quotient;
+}
+
+
+/* A static function to sort the RSSI samples in ascending order with
+   Batcher's odd-even merge sort. The sequence of compare-exchanges does
+   not depend on the values, and each compare-exchange is a branchless
+   minimum and maximum, so the loops unroll into a sorting network. */
+static inline void sort_rssi_samples(int *samples){
+    int p, k, j, i;
+    int low, high;
+
+    for(p = 1 ; p < RSSI_SAMPLES_PER_LBEACON ; p <<= 1){
+        for(k = p ; k >= 1 ; k >>= 1){
+            for(j = k % p ; j + k < RSSI_SAMPLES_PER_LBEACON ; j += 2 * k){
+                for(i = 0 ; i < k ; i++){
+                    if((i + j) / (2 * p) == (i + j + k) / (2 * p)){
+                        low = samples[i + j];
+                        high = samples[i + j + k];
+                        samples[i + j] = (low < high) ? low : high;
+                        samples[i + j + k] = (low < high) ? high : low;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+/* A static function to place a LBeacon at a position of the heap. */
+static inline void set_heap_entry(LBeaconTable *table,
+                                  int position,
+                                  int index){
+
+    table->heap[position] = index;
+    table->heap_positions[index] = position;
+}
+
+
+/* A static function to aggregate the RSSI values of a LBeacon into its
+   heap key in the way of the table. */
+static int32_t get_heap_key(LBeaconTable *table, int index, long long now){
+
+    if(RSSI_AGGREGATION_EWMA == table->aggregation){
+        return table->rssi_estimates[index];
+    }
+
+    /* A LBeacon with no sample in the window sorts below the weakest RSSI
+       value heard */
+    return get_lbeacon_rssi_in_window(table, index, table->aggregation, now,
+                                      table->window_in_us, INT8_MIN - 1) *
+           (1 << RSSI_FRACTION_BITS);
+}
+
+
+/* A static function to move the LBeacon at a position of the heap toward
+   the top while its key is higher than the one of its parent. */
+static void sift_up_lbeacon(LBeaconTable *table, int position){
+    int index = table->heap[position];
+    int32_t key = table->heap_keys[index];
+    int parent;
+
+    while(position > 0){
+        parent = (position - 1) / 2;
+
+        if(table->heap_keys[table->heap[parent]] >= key){
+            break;
+        }
+
+        set_heap_entry(table, position, table->heap[parent]);
+        position = parent;
+    }
+
+    set_heap_entry(table, position, index);
+}
+
+
+/* A static function to move the LBeacon at a position of the heap toward
+   the bottom while its key is lower than the one of a child. */
+static void sift_down_lbeacon(LBeaconTable *table, int position){
+    int index = table->heap[position];
+    int32_t key = table->heap_keys[index];
+    int child;
+
+    while(true){
+        child = 2 * position + 1;
+
+        if(child >= table->heap_size){
+            break;
+        }
+
+        if(child + 1 < table->heap_size &&
+           table->heap_keys[table->heap[child + 1]] >
+           table->heap_keys[table->heap[child]]){
+            child++;
+        }
+
+        if(table->heap_keys[table->heap[child]] <= key){
+            break;
+        }
+
+        set_heap_entry(table, position, table->heap[child]);
+        position = child;
+    }
+
+    set_heap_entry(table, position, index);
+}
+
+
+/* A static function to take a LBeacon out of the heap. */
+static void remove_heap_lbeacon(LBeaconTable *table, int index){
+    int position = table->heap_positions[index];
+    int moved;
+
+    if(-1 == position){
+        return;
+    }
+
+    table->heap_positions[index] = -1;
+    table->heap_size--;
+
+    if(position == table->heap_size){
+        return;
+    }
+
+    /* The last LBeacon of the heap fills the hole, and moves either way */
+    moved = table->heap[table->heap_size];
+    set_heap_entry(table, position, moved);
+    sift_up_lbeacon(table, position);
+    sift_down_lbeacon(table, table->heap_positions[moved]);
+}
+
+
+/* A static function to move the LBeacon in a slot to a free slot, leaving
+   the first slot free. */
+static void move_lbeacon(LBeaconTable *table, int to, int from){
+
+    table->is_used[to] = true;
+    table->uuids[to] = table->uuids[from];
+    table->rssi_estimates[to] = table->rssi_estimates[from];
+    table->last_seen_times[to] = table->last_seen_times[from];
+    table->counts[to] = table->counts[from];
+    memcpy(table->rssi_samples[to], table->rssi_samples[from],
+           sizeof(table->rssi_samples[from]));
+    memcpy(table->sample_times[to], table->sample_times[from],
+           sizeof(table->sample_times[from]));
+    table->next_samples[to] = table->next_samples[from];
+    table->rssi_values[to] = table->rssi_values[from];
+    table->handoff_scores[to] = table->handoff_scores[from];
+    table->stronger_since_times[to] = table->stronger_since_times[from];
+    table->heap_keys[to] = table->heap_keys[from];
+
+    table->heap_positions[to] = table->heap_positions[from];
+    if(-1 != table->heap_positions[to]){
+        table->heap[table->heap_positions[to]] = to;
+    }
+
+    table->is_used[from] = false;
+    table->heap_positions[from] = -1;
+}
+
+
+/* A static function to reset the state of a free slot. */
+static void clear_lbeacon(LBeaconTable *table, int index){
+
+    table->is_used[index] = false;
+    memset(&table->uuids[index], 0, sizeof(LBeaconUUID));
+    table->rssi_estimates[index] = 0;
+    table->last_seen_times[index] = 0;
+    table->counts[index] = 0;
+    memset(table->rssi_samples[index], 0, sizeof(table->rssi_samples[index]));
+    memset(table->sample_times[index], 0, sizeof(table->sample_times[index]));
+    table->next_samples[index] = 0;
+    table->rssi_values[index] = LBEACON_RSSI_NONE;
+    table->heap_positions[index] = -1;
+    table->heap_keys[index] = 0;
+    table->handoff_scores[index] = 0;
+    table->stronger_since_times[index] = 0;
+}
+
+
+/* A static function to hash the binary UUID. LBeacon UUIDs are mostly
+   zeros with the coordinates in the last bytes of both halves, so both
+   halves are mixed and the high bits are folded into the low bits used to
+   index the slots. */
+static inline uint32_t hash_uuid(LBeaconUUID *uuid){
+    uint64_t hash;
+
+    hash = uuid->words[0] * 0x9E3779B97F4A7C15ULL ^
+           uuid->words[1] * 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 32;
+
+    return (uint32_t)hash;
+}
+
+
+char *uuid_to_str(LBeaconUUID *uuid, char *buf){
+    static const char hex_digits[] = "0123456789ABCDEF";
+    int i;
+
+    for(i = 0 ; i < UUID_DATA_LENGTH ; i++){
+        buf[2 * i] = hex_digits[uuid->bytes[i] >> 4];
+        buf[2 * i + 1] = hex_digits[uuid->bytes[i] & 0x0F];
+    }
+    buf[2 * UUID_DATA_LENGTH] = '\0';
+
+    return buf;
+}
+
+
+ErrorCode init_lbeacon_table(LBeaconTable *table, int max_lbeacons){
+    int capacity = MIN_LBEACON_TABLE_CAPACITY;
+    int i;
+
+    if(max_lbeacons <= 0 || max_lbeacons > MAX_LBEACONS_IN_TABLE){
+        return E_INPUT_PARAMETER;
+    }
+
+    /* Keep the load factor at most 3/4 */
+    while(capacity * 3 < max_lbeacons * 4){
+        capacity <<= 1;
+    }
+
+    memset(table, 0, sizeof(LBeaconTable));
+
+    table->is_used = (bool *)calloc(capacity, sizeof(bool));
+    table->uuids = (LBeaconUUID *)calloc(capacity, sizeof(LBeaconUUID));
+    table->rssi_estimates = (int32_t *)calloc(capacity, sizeof(int32_t));
+    table->last_seen_times = (long long *)calloc(capacity, sizeof(long long));
+    table->counts = (int *)calloc(capacity, sizeof(int));
+    table->rssi_samples = calloc(capacity, sizeof(table->rssi_samples[0]));
+    table->sample_times = calloc(capacity, sizeof(table->sample_times[0]));
+    table->next_samples = (int *)calloc(capacity, sizeof(int));
+    table->rssi_values = (int32_t *)calloc(capacity, sizeof(int32_t));
+    table->heap = (int *)calloc(capacity, sizeof(int));
+    table->heap_positions = (int *)calloc(capacity, sizeof(int));
+    table->heap_keys = (int32_t *)calloc(capacity, sizeof(int32_t));
+    table->handoff_scores = (int32_t *)calloc(capacity, sizeof(int32_t));
+    table->stronger_since_times =
+        (long long *)calloc(capacity, sizeof(long long));
+
+    if(NULL == table->is_used || NULL == table->uuids ||
+       NULL == table->rssi_estimates || NULL == table->last_seen_times ||
+       NULL == table->counts || NULL == table->rssi_samples ||
+       NULL == table->sample_times || NULL == table->next_samples ||
+       NULL == table->rssi_values || NULL == table->heap ||
+       NULL == table->heap_positions || NULL == table->heap_keys ||
+       NULL == table->handoff_scores ||
+       NULL == table->stronger_since_times){
+        release_lbeacon_table(table);
+        return E_MALLOC;
+    }
+
+    for(i = 0 ; i < capacity ; i++){
+        table->rssi_values[i] = LBEACON_RSSI_NONE;
+        table->heap_positions[i] = -1;
+    }
+
+    table->capacity = capacity;
+    table->max_lbeacons = max_lbeacons;
+    table->aggregation = RSSI_AGGREGATION_EWMA;
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+void release_lbeacon_table(LBeaconTable *table){
+
+    free(table->is_used);
+    free(table->uuids);
+    free(table->rssi_estimates);
+    free(table->last_seen_times);
+    free(table->counts);
+    free(table->rssi_samples);
+    free(table->sample_times);
+    free(table->next_samples);
+    free(table->rssi_values);
+    free(table->heap);
+    free(table->heap_positions);
+    free(table->heap_keys);
+    free(table->handoff_scores);
+    free(table->stronger_since_times);
+    memset(table, 0, sizeof(LBeaconTable));
+}
+
+
+int lbeacon_table_lookup(LBeaconTable *table, LBeaconUUID *uuid){
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = hash_uuid(uuid) & mask;
+
+    /* Linear probing stops at the first free slot, which always exists
+       because the table is never filled up */
+    while(table->is_used[index]){
+        if(is_same_uuid(&table->uuids[index], uuid)){
+            return index;
+        }
+        index = (index + 1) & mask;
+    }
+
+    return -1;
+}
+
+
+int lbeacon_table_insert(LBeaconTable *table,
+                         LBeaconUUID *uuid,
+                         bool *is_inserted){
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = hash_uuid(uuid) & mask;
+
+    *is_inserted = false;
+
+    while(table->is_used[index]){
+        if(is_same_uuid(&table->uuids[index], uuid)){
+            return index;
+        }
+        index = (index + 1) & mask;
+    }
+
+    if(table->num_lbeacons >= table->max_lbeacons){
+        table->overflowed_reports++;
+        return -1;
+    }
+
+    table->is_used[index] = true;
+    table->uuids[index] = *uuid;
+    table->num_lbeacons++;
+    *is_inserted = true;
+
+    return index;
+}
+
+
+void lbeacon_table_remove(LBeaconTable *table, int index){
+    uint32_t mask = table->capacity - 1;
+    uint32_t hole = index;
+    uint32_t next = index;
+    uint32_t home;
+
+    remove_heap_lbeacon(table, index);
+
+    /* Move each following LBeacon of the probe sequence into the hole,
+       unless its home slot lies cyclically between the hole and itself */
+    while(true){
+        next = (next + 1) & mask;
+
+        if(!table->is_used[next]){
+            break;
+        }
+
+        home = hash_uuid(&table->uuids[next]) & mask;
+
+        if((hole <= next) ? (hole < home && home <= next) :
+                            (hole < home || home <= next)){
+            continue;
+        }
+
+        move_lbeacon(table, hole, next);
+        hole = next;
+    }
+
+    clear_lbeacon(table, hole);
+    table->num_lbeacons--;
+}
+
+
+int lbeacon_table_evict(LBeaconTable *table,
+                        long long now,
+                        long long stale_timeout_in_us){
+    int num_evicted = 0;
+    int i = 0;
+
+    while(i < table->capacity){
+        if(table->is_used[i] &&
+           now - table->last_seen_times[i] > stale_timeout_in_us){
+
+            /* Another LBeacon may be shifted into the slot, so the slot
+               is checked again */
+            lbeacon_table_remove(table, i);
+            num_evicted++;
+        }else{
+            i++;
+        }
+    }
+
+    table->evicted_lbeacons += num_evicted;
+
+    return num_evicted;
+}
+
+
+void lbeacon_table_clear(LBeaconTable *table){
+    int i;
+
+    for(i = 0 ; i < table->capacity ; i++){
+        clear_lbeacon(table, i);
+    }
+    table->num_lbeacons = 0;
+    table->heap_size = 0;
+}
+
+
+void reset_lbeacon_handoff_state(LBeaconTable *table){
+
+    memset(table->handoff_scores, 0, sizeof(int32_t) * table->capacity);
+    memset(table->stronger_since_times, 0,
+           sizeof(long long) * table->capacity);
+}
+
+
+void set_lbeacon_aggregation(LBeaconTable *table,
+                             RSSIAggregation aggregation,
+                             long long window_in_us,
+                             long long now){
+    int position;
+
+    table->aggregation = aggregation;
+    table->window_in_us = window_in_us;
+
+    for(position = 0 ; position < table->heap_size ; position++){
+        table->heap_keys[table->heap[position]] =
+            get_heap_key(table, table->heap[position], now);
+    }
+
+    /* Build the heap again from the bottom up */
+    for(position = table->heap_size / 2 - 1 ; position >= 0 ; position--){
+        sift_down_lbeacon(table, position);
+    }
+}
+
+
+void update_lbeacon_rssi(LBeaconTable *table,
+                         int index,
+                         int rssi,
+                         long long now,
+                         long long time_constant_in_us){
+    int32_t sample = rssi * (1 << RSSI_FRACTION_BITS);
+    int next_sample = table->next_samples[index];
+    long long elapsed;
+    long long weight;
+
+    table->rssi_samples[index][next_sample] = (int8_t)rssi;
+    table->sample_times[index][next_sample] = now;
+    table->next_samples[index] =
+        (next_sample + 1) & (RSSI_SAMPLES_PER_LBEACON - 1);
+
+    if(0 == table->last_seen_times[index]){
+        table->rssi_estimates[index] = sample;
+        table->last_seen_times[index] = now;
+        table->heap_keys[index] = get_heap_key(table, index, now);
+
+        set_heap_entry(table, table->heap_size, index);
+        table->heap_size++;
+        sift_up_lbeacon(table, table->heap_positions[index]);
+        return;
+    }
+
+    elapsed = now - table->last_seen_times[index];
+    if(elapsed < 0){
+        elapsed = 0;
+    }
+
+    /* The weight elapsed / (elapsed + time constant) approximates
+       1 - exp(-elapsed / time constant) without floating point */
+    weight = (elapsed << RSSI_WEIGHT_BITS) / (elapsed + time_constant_in_us);
+    if(weight < MIN_RSSI_WEIGHT){
+        weight = MIN_RSSI_WEIGHT;
+    }
+
+    table->rssi_estimates[index] +=
+        (int32_t)((weight * (sample - table->rssi_estimates[index])) /
+                  (1 << RSSI_WEIGHT_BITS));
+    table->last_seen_times[index] = now;
+    table->heap_keys[index] = get_heap_key(table, index, now);
+
+    /* Only one of the two moves the LBeacon */
+    sift_up_lbeacon(table, table->heap_positions[index]);
+    sift_down_lbeacon(table, table->heap_positions[index]);
+}
+
+
+int get_lbeacon_rssi(LBeaconTable *table,
+                     int index,
+                     long long now,
+                     long long time_constant_in_us,
+                     int floor_rssi){
+    long long floor_estimate = floor_rssi * (1 << RSSI_FRACTION_BITS);
+    long long estimate = table->rssi_estimates[index];
+    long long elapsed;
+
+    /* A LBeacon heard within the time constant is current. Beyond that,
+       the estimate fades as the LBeacon stays silent. */
+    elapsed = now - table->last_seen_times[index] - time_constant_in_us;
+
+    if(elapsed > 0){
+        estimate = floor_estimate +
+                   ((estimate - floor_estimate) * time_constant_in_us) /
+                   (time_constant_in_us + elapsed);
+    }
+
+    /* Round to the nearest dBm */
+    if(estimate >= 0){
+        return (int)((estimate + (1 << (RSSI_FRACTION_BITS - 1))) /
+                     (1 << RSSI_FRACTION_BITS));
+    }
+    return -(int)((-estimate + (1 << (RSSI_FRACTION_BITS - 1))) /
+                  (1 << RSSI_FRACTION_BITS));
+}
+
+
+int get_lbeacon_rssi_in_window(LBeaconTable *table,
+                               int index,
+                               RSSIAggregation aggregation,
+                               long long now,
+                               long long window_in_us,
+                               int floor_rssi){
+    long long *sample_times = table->sample_times[index];
+    int samples[RSSI_SAMPLES_PER_LBEACON];
+    int num_samples = 0;
+    int trim;
+    int sum;
+    int i;
+
+    /* Samples out of the window sort after every RSSI value */
+    for(i = 0 ; i < RSSI_SAMPLES_PER_LBEACON ; i++){
+        if(0 != sample_times[i] && now - sample_times[i] <= window_in_us){
+            samples[i] = table->rssi_samples[index][i];
+            num_samples++;
+        }else{
+            samples[i] = INT_MAX;
+        }
+    }
+
+    if(0 == num_samples){
+        return floor_rssi;
+    }
+
+    sort_rssi_samples(samples);
+
+    if(RSSI_AGGREGATION_TRIMMED_MEAN == aggregation){
+        trim = num_samples / 4;
+        sum = 0;
+        for(i = trim ; i < num_samples - trim ; i++){
+            sum += samples[i];
+        }
+        num_samples -= 2 * trim;
+
+        return divide_rounded(sum, num_samples);
+    }
+
+    /* The median, which is the mean of the middle samples for an even
+       number of samples */
+    return divide_rounded(samples[(num_samples - 1) / 2] +
+                          samples[num_samples / 2], 2);
+}
+
+
+int get_lbeacon_rssi_variance(LBeaconTable *table,
+                              int index,
+                              long long now,
+                              long long window_in_us){
+    long long *sample_times = table->sample_times[index];
+    long long sum = 0;
+    long long sum_of_squares = 0;
+    int num_samples = 0;
+    int sample;
+    int i;
+
+    for(i = 0 ; i < RSSI_SAMPLES_PER_LBEACON ; i++){
+        if(0 != sample_times[i] && now - sample_times[i] <= window_in_us){
+            sample = table->rssi_samples[index][i];
+            sum += sample;
+            sum_of_squares += sample * sample;
+            num_samples++;
+        }
+    }
+
+    if(num_samples < 2){
+        return 0;
+    }
+
+    /* The population variance (n * sum of squares - sum ^ 2) / n ^ 2 */
+    return (int)(((num_samples * sum_of_squares - sum * sum) <<
+                  RSSI_FRACTION_BITS) / (num_samples * num_samples));
+}
+
+
+void get_lbeacon_candidates(LBeaconTable *table,
+                            int *best_index,
+                            int *runner_up_index){
+
+    *best_index = (table->heap_size > 0) ? table->heap[0] : -1;
+
+    /* The second highest estimate is at one of the children of the top */
+    if(table->heap_size > 2 &&
+       table->heap_keys[table->heap[2]] > table->heap_keys[table->heap[1]]){
+        *runner_up_index = table->heap[2];
+    }else{
+        *runner_up_index = (table->heap_size > 1) ? table->heap[1] : -1;
+    }
+}
+
+
+int find_strongest_lbeacon(LBeaconTable *table,
+                           int threshold_rssi,
+                           int *best_rssi){
+    int32_t *values = table->rssi_values;
+    int32_t max_value;
+    int i;
+
+    /* The first pass finds the highest value, and the second pass finds
+       the first slot holding it, so that ties go to the lowest index as in
+       a single scalar pass */
+#if defined(LBEACON_TABLE_NEON)
+    int32x4_t max_vector = vdupq_n_s32(LBEACON_RSSI_NONE);
+    int32x2_t max_pair;
+
+    for(i = 0 ; i < table->capacity ; i += 4){
+        max_vector = vmaxq_s32(max_vector, vld1q_s32(&values[i]));
+    }
+    max_pair = vpmax_s32(vget_low_s32(max_vector),
+                         vget_high_s32(max_vector));
+    max_pair = vpmax_s32(max_pair, max_pair);
+    max_value = vget_lane_s32(max_pair, 0);
+#elif defined(LBEACON_TABLE_SSE)
+    __m128i max_vector = _mm_set1_epi32(LBEACON_RSSI_NONE);
+
+    for(i = 0 ; i < table->capacity ; i += 4){
+        max_vector = _mm_max_epi32(max_vector,
+                                   _mm_loadu_si128((__m128i *)&values[i]));
+    }
+    max_vector = _mm_max_epi32(max_vector,
+                               _mm_shuffle_epi32(max_vector,
+                                                 _MM_SHUFFLE(1, 0, 3, 2)));
+    max_vector = _mm_max_epi32(max_vector,
+                               _mm_shuffle_epi32(max_vector,
+                                                 _MM_SHUFFLE(2, 3, 0, 1)));
+    max_value = _mm_cvtsi128_si32(max_vector);
+#else
+    max_value = LBEACON_RSSI_NONE;
+
+    for(i = 0 ; i < table->capacity ; i++){
+        max_value = (values[i] > max_value) ? values[i] : max_value;
+    }
+#endif
+
+    if(max_value <= threshold_rssi){
+        return -1;
+    }
+
+    i = 0;
+    while(values[i] != max_value){
+        i++;
+    }
+
+    *best_rssi = max_value;
+
+    return i;
+}
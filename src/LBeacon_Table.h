@@ -0,0 +1,580 @@
+/*
+Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+License:
+
+    GPL 3.0 : The content of this file is subject to the terms and
+    conditions defined in file 'COPYING.txt', which is part of this source
+    code package.
+
+Project Name:
+
+    BeDIS
+
+File Description:
+
+    This header file contains declarations of the table of LBeacons heard
+    by the Tag. The table is a fixed-capacity open-addressing hash table
+    keyed by the binary UUID of LBeacons, so that looking up the LBeacon of
+    an advertising report takes constant time. Each LBeacon carries a
+    fixed-point exponentially weighted estimate of its RSSI and a ring
+    buffer of its recent RSSI samples, which persist across scan windows
+    until the LBeacon is not heard for a while. The state of the LBeacons
+    is laid out as one array per field indexed by slot, so that the passes
+    over all LBeacons at the end of a scan window read contiguous memory,
+    and the strongest LBeacon is selected with SIMD instructions where the
+    processor has them. The LBeacons are also kept in an indexed max-heap
+    ordered by their RSSI values aggregated in the way the association is
+    decided on, which is updated on every RSSI value heard, so that the
+    strongest candidates are known at any time.
+
+File Name:
+
+    LBeacon_Table.h
+
+Version:
+
+    1.0,  20190429
+
+Abstract:
+
+Authors:
+
+    Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#ifndef LBEACON_TABLE_H
+#define LBEACON_TABLE_H
+
+/*
+* INCLUDES
+*/
+
+#include "BeDIS.h"
+
+/*
+  CONSTANTS
+*/
+
+/* Length of the LBeacon's UUID in number of bytes */
+#define UUID_DATA_LENGTH 16
+
+/* Number of characters in the uuid of a Bluetooth device in hexadecimal
+   text form */
+#define LENGTH_OF_UUID 33
+
+/* Maximum number of LBeacons a table can track */
+#define MAX_LBEACONS_IN_TABLE 4096
+
+/* Number of fractional bits of the fixed-point RSSI estimates */
+#define RSSI_FRACTION_BITS 8
+
+/* Number of fractional bits of the fixed-point weights of the estimator */
+#define RSSI_WEIGHT_BITS 16
+
+/* Number of recent RSSI samples kept per LBeacon, which is a power of two */
+#define RSSI_SAMPLES_PER_LBEACON 16
+
+/* Minimum number of slots of a table, which is a multiple of the number of
+   RSSI values compared by one SIMD instruction */
+#define MIN_LBEACON_TABLE_CAPACITY 16
+
+/* The RSSI value of free slots in the RSSI values selected from */
+#define LBEACON_RSSI_NONE INT32_MIN
+
+/*
+  TYPEDEF STRUCTS
+*/
+
+/* The way the RSSI values of a LBeacon are aggregated into the value the
+   association is decided on */
+typedef enum RSSIAggregation {
+
+    /* The exponentially weighted estimate */
+    RSSI_AGGREGATION_EWMA = 0,
+
+    /* The median of the samples in the sliding window */
+    RSSI_AGGREGATION_MEDIAN = 1,
+
+    /* The mean of the samples in the sliding window without the lowest and
+       the highest quarter */
+    RSSI_AGGREGATION_TRIMMED_MEAN = 2,
+
+    max_rssi_aggregation = 3
+
+} RSSIAggregation;
+
+/* The UUID of a LBeacon in binary form as carried in its advertisements.
+   The two 64-bit words allow comparing UUIDs with two loads. */
+typedef union LBeaconUUID {
+   uint8_t bytes[UUID_DATA_LENGTH];
+   uint64_t words[UUID_DATA_LENGTH / sizeof(uint64_t)];
+} LBeaconUUID;
+
+/* The table of LBeacons. Each array below has one entry per slot of the
+   hash table, and a LBeacon keeps the same index in all of them. */
+typedef struct LBeaconTable {
+
+    /* Whether the slot of the hash table is in use */
+    bool *is_used;
+
+    /* The UUIDs of the LBeacons, which are the keys of the hash table */
+    LBeaconUUID *uuids;
+
+    /* The RSSI estimates with RSSI_FRACTION_BITS fractional bits */
+    int32_t *rssi_estimates;
+
+    /* Time in micro seconds on the monotonic clock when the LBeacons are
+       last heard */
+    long long *last_seen_times;
+
+    /* Number of advertising reports heard in the current scan window */
+    int *counts;
+
+    /* Ring buffers of the recent RSSI samples and the times they are heard.
+       A sample time of 0 marks an empty entry. */
+    int8_t (*rssi_samples)[RSSI_SAMPLES_PER_LBEACON];
+    long long (*sample_times)[RSSI_SAMPLES_PER_LBEACON];
+
+    /* Index of the entry of each ring buffer the next sample is written
+       to */
+    int *next_samples;
+
+    /* The RSSI values in dBm the association is decided on, filled in at
+       the end of a scan window. Free slots hold LBEACON_RSSI_NONE. */
+    int32_t *rssi_values;
+
+    /* The max-heap of the indexes of the LBeacons heard at least once,
+       ordered by their heap keys */
+    int *heap;
+    int heap_size;
+
+    /* The keys of the heap with RSSI_FRACTION_BITS fractional bits, which
+       are the RSSI values aggregated in the way of the table when the
+       LBeacons are last heard */
+    int32_t *heap_keys;
+
+    /* The position of each LBeacon in the heap, or -1 if the slot is not in
+       the heap */
+    int *heap_positions;
+
+    /* The cumulative sums in dB of the evidence that each LBeacon is
+       stronger than the associated LBeacon, used by the sequential handoff
+       decision */
+    int32_t *handoff_scores;
+
+    /* Time in micro seconds on the monotonic clock since when the estimate
+       of each LBeacon stays higher than the one of the associated LBeacon,
+       or 0 if it is not higher */
+    long long *stronger_since_times;
+
+    /* The way the RSSI values are aggregated into the heap keys, and the
+       length in micro seconds of the sliding window of the aggregations
+       of samples */
+    RSSIAggregation aggregation;
+    long long window_in_us;
+
+    /* Number of slots, which is a power of two */
+    int capacity;
+
+    /* Maximum number of LBeacons tracked at once. It is kept below the
+       capacity so that probe sequences stay short. */
+    int max_lbeacons;
+
+    /* Number of LBeacons in the table */
+    int num_lbeacons;
+
+    /* Number of advertising reports of LBeacons not tracked because the
+       table is full */
+    unsigned long long overflowed_reports;
+
+    /* Number of LBeacons removed because they are not heard for a while */
+    unsigned long long evicted_lbeacons;
+
+} LBeaconTable;
+
+/*
+  FUNCTIONS
+*/
+
+/*
+  is_same_uuid:
+
+      This function compares two UUIDs of LBeacons.
+
+  Parameters:
+
+      uuid - the first UUID
+      other_uuid - the second UUID
+
+  Return value:
+
+      bool - true if the UUIDs are the same, false otherwise
+*/
+
+static inline bool is_same_uuid(LBeaconUUID *uuid, LBeaconUUID *other_uuid){
+    return uuid->words[0] == other_uuid->words[0] &&
+           uuid->words[1] == other_uuid->words[1];
+}
+
+/*
+  uuid_to_str:
+
+      This function formats the UUID of a LBeacon as 32 hexadecimal digits.
+      It is meant for log messages only.
+
+  Parameters:
+
+      uuid - the UUID to be formatted
+      buf - the output buffer of at least LENGTH_OF_UUID characters
+
+  Return value:
+
+      char * - the output buffer
+*/
+
+char *uuid_to_str(LBeaconUUID *uuid, char *buf);
+
+/*
+  init_lbeacon_table:
+
+      This function allocates the arrays of the table, sized for the
+      specified number of LBeacons with a load factor of at most 3/4. The
+      heap is ordered by the exponentially weighted estimates until
+      set_lbeacon_aggregation is called.
+
+  Parameters:
+
+      table - the table to be initialized
+      max_lbeacons - maximum number of LBeacons tracked at once
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+ErrorCode init_lbeacon_table(LBeaconTable *table, int max_lbeacons);
+
+/*
+  release_lbeacon_table:
+
+      This function frees the arrays of the table.
+
+  Parameters:
+
+      table - the table to be released
+
+  Return value:
+
+      None
+*/
+
+void release_lbeacon_table(LBeaconTable *table);
+
+/*
+  lbeacon_table_lookup:
+
+      This function finds the slot of the LBeacon with the specified UUID.
+
+  Parameters:
+
+      table - the table to search
+      uuid - the UUID of the LBeacon
+
+  Return value:
+
+      int - index of the slot of the LBeacon, or -1 if the LBeacon is not
+            in the table
+*/
+
+int lbeacon_table_lookup(LBeaconTable *table, LBeaconUUID *uuid);
+
+/*
+  lbeacon_table_insert:
+
+      This function finds the slot of the LBeacon with the specified UUID,
+      and claims a free slot for the LBeacon if it is not in the table.
+
+  Parameters:
+
+      table - the table to search
+      uuid - the UUID of the LBeacon
+      is_inserted - set to true if a slot is claimed for the LBeacon
+
+  Return value:
+
+      int - index of the slot of the LBeacon, or -1 if the LBeacon is not
+            in the table and the table is full
+*/
+
+int lbeacon_table_insert(LBeaconTable *table,
+                         LBeaconUUID *uuid,
+                         bool *is_inserted);
+
+/*
+  lbeacon_table_remove:
+
+      This function removes the LBeacon in the slot from the table. The
+      LBeacons following it in the probe sequence are shifted backward, so
+      the slots of other LBeacons may change.
+
+  Parameters:
+
+      table - the table
+      index - the index of the slot of the LBeacon
+
+  Return value:
+
+      None
+*/
+
+void lbeacon_table_remove(LBeaconTable *table, int index);
+
+/*
+  lbeacon_table_evict:
+
+      This function removes the LBeacons not heard for longer than the
+      specified time.
+
+  Parameters:
+
+      table - the table
+      now - the current time in micro seconds on the monotonic clock
+      stale_timeout_in_us - the time after which a LBeacon not heard is
+                            removed
+
+  Return value:
+
+      int - the number of LBeacons removed
+*/
+
+int lbeacon_table_evict(LBeaconTable *table,
+                        long long now,
+                        long long stale_timeout_in_us);
+
+/*
+  lbeacon_table_clear:
+
+      This function removes all LBeacons from the table.
+
+  Parameters:
+
+      table - the table to be cleared
+
+  Return value:
+
+      None
+*/
+
+void lbeacon_table_clear(LBeaconTable *table);
+
+/*
+  reset_lbeacon_handoff_state:
+
+      This function clears the handoff scores and the times since when the
+      LBeacons are stronger, which are relative to the associated LBeacon,
+      when the association changes.
+
+  Parameters:
+
+      table - the table
+
+  Return value:
+
+      None
+*/
+
+void reset_lbeacon_handoff_state(LBeaconTable *table);
+
+/*
+  set_lbeacon_aggregation:
+
+      This function sets the way the RSSI values of the LBeacons are
+      aggregated into the keys of the heap, which has to be the way the
+      association is decided on, and reorders the heap by the keys of the
+      samples heard within the window ending now.
+
+  Parameters:
+
+      table - the table
+      aggregation - the way the RSSI values are aggregated
+      window_in_us - the length of the sliding window of
+                     RSSI_AGGREGATION_MEDIAN and
+                     RSSI_AGGREGATION_TRIMMED_MEAN
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      None
+*/
+
+void set_lbeacon_aggregation(LBeaconTable *table,
+                             RSSIAggregation aggregation,
+                             long long window_in_us,
+                             long long now);
+
+/*
+  update_lbeacon_rssi:
+
+      This function updates the RSSI estimate of the LBeacon with an RSSI
+      value just heard, and stores the value into the ring buffer of
+      samples. The weight of the new value grows with the time since the
+      LBeacon is last heard, so that the estimate follows the same time
+      constant whatever the advertising rate is. The heap key of the
+      LBeacon is aggregated again, and the LBeacon is moved to its new
+      position in the heap.
+
+  Parameters:
+
+      table - the table
+      index - the index of the slot of the LBeacon
+      rssi - the RSSI value of the advertising report
+      now - the current time in micro seconds on the monotonic clock
+      time_constant_in_us - the time constant of the estimator
+
+  Return value:
+
+      None
+*/
+
+void update_lbeacon_rssi(LBeaconTable *table,
+                         int index,
+                         int rssi,
+                         long long now,
+                         long long time_constant_in_us);
+
+/*
+  get_lbeacon_rssi:
+
+      This function returns the RSSI estimate of the LBeacon in dBm. An
+      estimate not refreshed within the time constant decays toward the
+      floor value as the LBeacon stays silent.
+
+  Parameters:
+
+      table - the table
+      index - the index of the slot of the LBeacon
+      now - the current time in micro seconds on the monotonic clock
+      time_constant_in_us - the time constant of the estimator
+      floor_rssi - the RSSI value the estimate decays toward
+
+  Return value:
+
+      int - the RSSI estimate rounded to dBm
+*/
+
+int get_lbeacon_rssi(LBeaconTable *table,
+                     int index,
+                     long long now,
+                     long long time_constant_in_us,
+                     int floor_rssi);
+
+/*
+  get_lbeacon_rssi_in_window:
+
+      This function aggregates the RSSI samples of the LBeacon heard within
+      the sliding window ending now. The samples are sorted with a sorting
+      network, which has no data dependent branches.
+
+  Parameters:
+
+      table - the table
+      index - the index of the slot of the LBeacon
+      aggregation - RSSI_AGGREGATION_MEDIAN or RSSI_AGGREGATION_TRIMMED_MEAN
+      now - the current time in micro seconds on the monotonic clock
+      window_in_us - the length of the sliding window
+      floor_rssi - the value returned if no sample is in the window
+
+  Return value:
+
+      int - the aggregated RSSI value in dBm
+*/
+
+int get_lbeacon_rssi_in_window(LBeaconTable *table,
+                               int index,
+                               RSSIAggregation aggregation,
+                               long long now,
+                               long long window_in_us,
+                               int floor_rssi);
+
+/*
+  get_lbeacon_rssi_variance:
+
+      This function returns the variance of the RSSI samples of the
+      LBeacon heard within the sliding window ending now.
+
+  Parameters:
+
+      table - the table
+      index - the index of the slot of the LBeacon
+      now - the current time in micro seconds on the monotonic clock
+      window_in_us - the length of the sliding window
+
+  Return value:
+
+      int - the variance in dB squared with RSSI_FRACTION_BITS fractional
+            bits, or 0 if fewer than two samples are in the window
+*/
+
+int get_lbeacon_rssi_variance(LBeaconTable *table,
+                              int index,
+                              long long now,
+                              long long window_in_us);
+
+/*
+  get_lbeacon_candidates:
+
+      This function returns the LBeacons with the highest and the second
+      highest heap keys, in constant time from the top of the heap. The
+      keys are aggregated when the LBeacons are last heard, so they have
+      neither the decay nor the samples leaving the window of LBeacons
+      staying silent.
+
+  Parameters:
+
+      table - the table
+      best_index - set to the index of the slot of the LBeacon with the
+                   highest key, or -1 if no LBeacon is heard
+      runner_up_index - set to the index of the slot of the LBeacon with
+                        the second highest key, or -1 if fewer than two
+                        LBeacons are heard
+
+  Return value:
+
+      None
+*/
+
+void get_lbeacon_candidates(LBeaconTable *table,
+                            int *best_index,
+                            int *runner_up_index);
+
+/*
+  find_strongest_lbeacon:
+
+      This function selects the LBeacon with the highest of the RSSI values
+      filled in the rssi_values array of the table, among the LBeacons whose
+      value is above the threshold. The values are compared four at a time
+      with NEON or SSE4.1 instructions when the compiler targets them, and
+      one at a time otherwise.
+
+  Parameters:
+
+      table - the table
+      threshold_rssi - the value the RSSI value of the selected LBeacon has
+                       to be above
+      best_rssi - set to the RSSI value of the selected LBeacon
+
+  Return value:
+
+      int - index of the slot of the LBeacon with the highest RSSI value,
+            the lowest index among equal values, or -1 if no value is above
+            the threshold
+*/
+
+int find_strongest_lbeacon(LBeaconTable *table,
+                           int threshold_rssi,
+                           int *best_rssi);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the implementation of the latency histograms of
+      the runtime metrics.
+
+ File Name:
+
+      Metrics.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include "Metrics.h"
+
+
+/* A static function to get the bucket of a value. Values below
+   HISTOGRAM_SUB_BUCKETS are their own bucket; higher values are bucketed
+   by their most significant HISTOGRAM_SUB_BUCKET_BITS + 1 bits. */
+static int get_histogram_bucket(unsigned long long value){
+
+    int exponent;
+
+    if(value < HISTOGRAM_SUB_BUCKETS){
+        return (int)value;
+    }
+
+    if(value >> HISTOGRAM_VALUE_BITS){
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    /* The position of the most significant bit */
+    exponent = 63 - __builtin_clzll(value);
+
+    return HISTOGRAM_SUB_BUCKETS +
+           (exponent - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_SUB_BUCKETS +
+           (int)(value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) -
+           HISTOGRAM_SUB_BUCKETS;
+}
+
+
+/* A static function to get the largest value counted in a bucket. */
+static long long get_histogram_bucket_limit(int bucket){
+
+    int shift;
+    int sub_bucket;
+
+    if(bucket < HISTOGRAM_SUB_BUCKETS){
+        return bucket;
+    }
+
+    shift = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    sub_bucket = (bucket - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+
+    return ((long long)(HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+
+void reset_latency_histogram(LatencyHistogram *histogram){
+
+    memset(histogram, 0, sizeof(LatencyHistogram));
+}
+
+
+void record_latency(LatencyHistogram *histogram, long long latency_in_us){
+
+    if(latency_in_us < 0){
+        latency_in_us = 0;
+    }
+
+    histogram->counts[get_histogram_bucket(latency_in_us)]++;
+    histogram->num_values++;
+
+    if(latency_in_us > histogram->max_value){
+        histogram->max_value = latency_in_us;
+    }
+}
+
+
+long long get_latency_percentile(LatencyHistogram *histogram,
+                                 double percentile){
+
+    unsigned long long rank;
+    unsigned long long num_values = 0;
+    long long limit;
+    int bucket;
+
+    if(0 == histogram->num_values){
+        return 0;
+    }
+
+    /* The rank of the value at the percentile, counted from 1 */
+    rank = (unsigned long long)(percentile / 100.0 *
+                                histogram->num_values + 0.5);
+    if(rank < 1){
+        rank = 1;
+    }
+
+    for(bucket = 0 ; bucket < HISTOGRAM_BUCKETS ; bucket++){
+        num_values += histogram->counts[bucket];
+        if(num_values >= rank){
+            break;
+        }
+    }
+
+    limit = get_histogram_bucket_limit(bucket);
+
+    return (limit < histogram->max_value) ? limit : histogram->max_value;
+}
@@ -0,0 +1,144 @@
+/*
+Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+License:
+
+    GPL 3.0 : The content of this file is subject to the terms and
+    conditions defined in file 'COPYING.txt', which is part of this source
+    code package.
+
+Project Name:
+
+    BeDIS
+
+File Description:
+
+    This header file contains declarations of the latency histograms of
+    the runtime metrics. A histogram counts values in buckets of
+    logarithmic width, each power of 2 split into linear sub-buckets in
+    the manner of HDR histograms, so that recording a value is an index
+    computation and an increment, and percentiles are reported within a
+    fixed relative error over the whole range of latencies.
+
+File Name:
+
+    Metrics.h
+
+Version:
+
+    1.0,  20190429
+
+Abstract:
+
+Authors:
+
+    Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+* INCLUDES
+*/
+
+#include "BeDIS.h"
+
+/*
+  CONSTANTS
+*/
+
+/* Number of bits of the sub-bucket index. Each power of 2 is split into
+   2^HISTOGRAM_SUB_BUCKET_BITS sub-buckets, which bounds the relative error
+   of percentiles to 1/2^HISTOGRAM_SUB_BUCKET_BITS. */
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/* Number of bits of the largest value counted exactly. Larger values are
+   counted in the last bucket. */
+#define HISTOGRAM_VALUE_BITS 32
+
+/* Number of buckets: the values below HISTOGRAM_SUB_BUCKETS have a bucket
+   each, and each higher power of 2 has HISTOGRAM_SUB_BUCKETS buckets */
+#define HISTOGRAM_BUCKETS \
+    (HISTOGRAM_SUB_BUCKETS + \
+     (HISTOGRAM_VALUE_BITS - HISTOGRAM_SUB_BUCKET_BITS) * \
+     HISTOGRAM_SUB_BUCKETS)
+
+/*
+  TYPEDEF STRUCTS
+*/
+
+typedef struct LatencyHistogram {
+
+    /* Number of values recorded in each bucket */
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+
+    /* Number of values recorded, and the largest value in micro seconds */
+    unsigned long long num_values;
+    long long max_value;
+
+} LatencyHistogram;
+
+/*
+  FUNCTIONS
+*/
+
+/*
+  reset_latency_histogram:
+
+      This function clears all the values recorded in a histogram.
+
+  Parameters:
+
+      histogram - the histogram
+
+  Return value:
+
+      None
+*/
+
+void reset_latency_histogram(LatencyHistogram *histogram);
+
+/*
+  record_latency:
+
+      This function records a latency into a histogram. Negative latencies,
+      which the monotonic clock does not produce, are recorded as 0.
+
+  Parameters:
+
+      histogram - the histogram
+      latency_in_us - the latency in micro seconds
+
+  Return value:
+
+      None
+*/
+
+void record_latency(LatencyHistogram *histogram, long long latency_in_us);
+
+/*
+  get_latency_percentile:
+
+      This function gets the latency below or at which the specified
+      percentage of the recorded values lie. The latency is the upper end
+      of the bucket holding the percentile, and is not larger than the
+      largest value recorded.
+
+  Parameters:
+
+      histogram - the histogram
+      percentile - the percentage, from 0 to 100
+
+  Return value:
+
+      long long - the latency in micro seconds, or 0 if no value is
+                  recorded
+*/
+
+long long get_latency_percentile(LatencyHistogram *histogram,
+                                 double percentile);
+
+#endif
@@ -37,6 +37,95 @@
 
 #define Debugging
 
+/* The scan profiles of the levels of scan duty cycle. Duplicate filtering
+   stays off, because the RSSI estimates need every advertisement. */
+static const ScanProfile scan_profiles[max_scan_profile_level] = {
+    /* 480 * 0.625 ms = 300 ms of every 300 ms */
+    { .name = "alert", .type = 0x01, .interval = 0x01E0, .window = 0x01E0,
+      .filter_dup = 0x00 },
+    /* 150 ms of every 300 ms */
+    { .name = "normal", .type = 0x00, .interval = 0x01E0, .window = 0x00F0,
+      .filter_dup = 0x00 },
+    /* 75 ms of every 600 ms */
+    { .name = "idle", .type = 0x00, .interval = 0x03C0, .window = 0x0078,
+      .filter_dup = 0x00 }
+};
+
+/* The settings in the config file. A setting missing from the file takes
+   its default value. */
+static const ConfigItem config_items[] = {
+    { "advertise_dongle_id", CONFIG_ITEM_INT,
+      offsetof(Config, advertise_dongle_id), "0", 0, HCI_MAX_DEV - 1,
+      false },
+    { "advertise_rssi_value", CONFIG_ITEM_INT,
+      offsetof(Config, advertise_rssi_value), "-50", -127, 20, true },
+    { "scan_rssi_coverage", CONFIG_ITEM_INT,
+      offsetof(Config, scan_rssi_coverage), "-100", -127, 20, true },
+    { "scan_timeout", CONFIG_ITEM_TIME,
+      offsetof(Config, scan_timeout_in_ms), "2", 1, 3600000, true },
+    { "change_lbeacon_rssi_criteria", CONFIG_ITEM_INT,
+      offsetof(Config, change_lbeacon_rssi_criteria), "10", 0, 100, true },
+    { "hci_transport", CONFIG_ITEM_INT,
+      offsetof(Config, hci_transport), "0", 0, max_transport_type - 1,
+      false },
+    { "simulated_report_rate", CONFIG_ITEM_INT,
+      offsetof(Config, simulated_controller.report_rate), "1000",
+      0, 1000000, false },
+    { "simulated_num_lbeacons", CONFIG_ITEM_INT,
+      offsetof(Config, simulated_controller.num_lbeacons), "8",
+      1, UINT8_MAX, false },
+    { "simulated_reports_per_event", CONFIG_ITEM_INT,
+      offsetof(Config, simulated_controller.reports_per_event), "1",
+      1, SIMULATED_MAX_REPORTS_PER_EVENT, false },
+    { "simulated_foreign_percentage", CONFIG_ITEM_INT,
+      offsetof(Config, simulated_controller.foreign_percentage), "0",
+      0, 100, false },
+    { "max_lbeacons", CONFIG_ITEM_INT,
+      offsetof(Config, max_lbeacons), "256", 1, MAX_LBEACONS_IN_TABLE,
+      false },
+    { "live_advertising_update", CONFIG_ITEM_BOOL,
+      offsetof(Config, is_live_advertising_update), "1", 0, 1, true },
+    { "rssi_time_constant", CONFIG_ITEM_TIME,
+      offsetof(Config, rssi_time_constant_in_ms), "1000ms", 1, 3600000,
+      true },
+    { "lbeacon_stale_timeout", CONFIG_ITEM_TIME,
+      offsetof(Config, lbeacon_stale_timeout_in_ms), "10000ms", 1, 3600000,
+      true },
+    { "rssi_aggregation", CONFIG_ITEM_INT,
+      offsetof(Config, rssi_aggregation), "1", 0, max_rssi_aggregation - 1,
+      true },
+    { "per_report_decision", CONFIG_ITEM_BOOL,
+      offsetof(Config, handoff_policy_config.is_per_report_decision), "0",
+      0, 1, true },
+    { "handoff_policy", CONFIG_ITEM_INT,
+      offsetof(Config, handoff_policy), "0", 0, max_handoff_policy - 1,
+      true },
+    { "cusum_drift", CONFIG_ITEM_INT,
+      offsetof(Config, handoff_policy_config.cusum_drift), "3", 0, 100,
+      true },
+    { "cusum_threshold", CONFIG_ITEM_INT,
+      offsetof(Config, handoff_policy_config.cusum_threshold), "30",
+      1, 10000, true },
+    { "min_dwell_time", CONFIG_ITEM_TIME,
+      offsetof(Config, handoff_policy_config.min_dwell_time_in_ms),
+      "5000ms", 0, 3600000, true },
+    { "variance_margin_factor", CONFIG_ITEM_INT,
+      offsetof(Config, handoff_policy_config.variance_margin_factor), "2",
+      0, 100, true },
+    { "adaptive_scan", CONFIG_ITEM_BOOL,
+      offsetof(Config, is_adaptive_scan), "1", 0, 1, true },
+    { "scan_steady_windows", CONFIG_ITEM_INT,
+      offsetof(Config, scan_steady_windows), "3", 1, 1000, true },
+    { "scan_dongle_ids", CONFIG_ITEM_DONGLE_IDS,
+      offsetof(Config, scan_dongle_ids), "-1",
+      DEFAULT_SCAN_DONGLE_ID, HCI_MAX_DEV - 1, false },
+    { "lbeacon_export", CONFIG_ITEM_BOOL,
+      offsetof(Config, is_lbeacon_export), "1", 0, 1, false },
+    { "metrics_interval", CONFIG_ITEM_TIME,
+      offsetof(Config, metrics_interval_in_ms), "60000ms", 0, 86400000,
+      true }
+};
+
 ErrorCode single_running_instance(char *file_name){
     int retry_time = 0;
     int lock_file = 0;
@@ -94,6 +183,96 @@ ErrorCode single_running_instance(char *file_name){
 }
 
 
+/* A static function to parse an integer setting, which has to be a whole
+   number within the range of the setting. */
+static ErrorCode parse_config_int(const ConfigItem *item,
+                                  char *value,
+                                  int *result){
+    char *end = NULL;
+    long number;
+
+    errno = 0;
+    number = strtol(value, &end, 10);
+
+    if(end == value || '\0' != *end || 0 != errno ||
+       number < item->min_value || number > item->max_value){
+        return E_INPUT_PARAMETER;
+    }
+
+    *result = (int)number;
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+/* A static function to parse the value of a setting into its field of the
+   Config struct. */
+static ErrorCode parse_config_value(const ConfigItem *item,
+                                    char *value,
+                                    Config *config){
+    void *field = (uint8_t *)config + item->offset;
+    char *dongle_id = NULL;
+    char *save_pointer = NULL;
+    int number;
+    int i;
+
+    switch(item->type){
+        case CONFIG_ITEM_INT:
+            return parse_config_int(item, value, (int *)field);
+
+        case CONFIG_ITEM_BOOL:
+            if(WORK_SUCCESSFULLY != parse_config_int(item, value, &number)){
+                return E_INPUT_PARAMETER;
+            }
+            *(bool *)field = (0 != number);
+            return WORK_SUCCESSFULLY;
+
+        case CONFIG_ITEM_TIME:
+            number = parse_time_in_ms(value);
+            if(number < item->min_value || number > item->max_value){
+                return E_INPUT_PARAMETER;
+            }
+            *(int *)field = number;
+            return WORK_SUCCESSFULLY;
+
+        case CONFIG_ITEM_DONGLE_IDS:
+            /* The number of dongles is stored with the list */
+            memset(config->scan_dongle_ids, 0,
+                   sizeof(config->scan_dongle_ids));
+            config->num_scan_dongles = 0;
+
+            dongle_id = strtok_r(value, DONGLE_ID_DELIMITER, &save_pointer);
+            while(NULL != dongle_id){
+                if(config->num_scan_dongles == MAX_SCAN_DONGLES ||
+                   WORK_SUCCESSFULLY != parse_config_int(item, dongle_id,
+                                                         &number)){
+                    return E_INPUT_PARAMETER;
+                }
+
+                /* Either the default dongle alone, or distinct dongles */
+                for(i = 0 ; i < config->num_scan_dongles ; i++){
+                    if(config->scan_dongle_ids[i] == number ||
+                       DEFAULT_SCAN_DONGLE_ID == number ||
+                       DEFAULT_SCAN_DONGLE_ID ==
+                       config->scan_dongle_ids[i]){
+                        return E_INPUT_PARAMETER;
+                    }
+                }
+
+                config->scan_dongle_ids[config->num_scan_dongles++] = number;
+                dongle_id = strtok_r(NULL, DONGLE_ID_DELIMITER,
+                                     &save_pointer);
+            }
+
+            return (config->num_scan_dongles > 0) ?
+                   WORK_SUCCESSFULLY : E_INPUT_PARAMETER;
+
+        default:
+            return E_INPUT_PARAMETER;
+    }
+}
+
+
 ErrorCode get_config(Config *config, char *file_name) {
     /* Return value is a struct containing all config information */
     int retry_time = 0;
@@ -101,7 +280,10 @@ ErrorCode get_config(Config *config, char *file_name) {
 
     /* Create spaces for storing the string of the current line being read */
     char config_setting[CONFIG_BUFFER_SIZE];
+    char *config_key = NULL;
     char *config_message = NULL;
+    int line_number = 0;
+    int i;
 
     retry_time = FILE_OPEN_RETRY;
     while(retry_time--){
@@ -122,168 +304,242 @@ ErrorCode get_config(Config *config, char *file_name) {
         return E_OPEN_FILE;
     }
 
-    /* Keep reading each line and store into the config struct */
-    /* item 1 */
-    fgets(config_setting, sizeof(config_setting), file);
-    config_message = strstr((char *)config_setting, DELIMITER);
-    config_message = config_message + strlen(DELIMITER);
-    trim_string_tail(config_message);
-    config->advertise_dongle_id = atoi(config_message);
-
-    /* item 2 */
-    fgets(config_setting, sizeof(config_setting), file);
-    config_message = strstr((char *)config_setting, DELIMITER);
-    config_message = config_message + strlen(DELIMITER);
-    trim_string_tail(config_message);
-    config->advertise_rssi_value = atoi(config_message);
-
-    /* item 3 */
-    fgets(config_setting, sizeof(config_setting), file);
-    config_message = strstr((char *)config_setting, DELIMITER);
-    config_message = config_message + strlen(DELIMITER);
-    trim_string_tail(config_message);
-    config->scan_rssi_coverage = atoi(config_message);
-
-    /* item 4 */
-    fgets(config_setting, sizeof(config_setting), file);
-    config_message = strstr((char *)config_setting, DELIMITER);
-    config_message = config_message + strlen(DELIMITER);
-    trim_string_tail(config_message);
-    config->scan_timeout = atoi(config_message);
-
-    /* item 5 */
-    fgets(config_setting, sizeof(config_setting), file);
-    config_message = strstr((char *)config_setting, DELIMITER);
-    config_message = config_message + strlen(DELIMITER);
-    trim_string_tail(config_message);
-    config->change_lbeacon_rssi_criteria = atoi(config_message);
+    /* Start from the defaults, so that every setting has a valid value
+       even if it is missing from the file */
+    memset(config, 0, sizeof(Config));
 
-    fclose(file);
+    for(i = 0 ; i < sizeof(config_items) / sizeof(config_items[0]) ; i++){
+        strncpy(config_setting, config_items[i].default_value,
+                sizeof(config_setting) - 1);
+        config_setting[sizeof(config_setting) - 1] = '\0';
+        parse_config_value(&config_items[i], config_setting, config);
+    }
 
-    return WORK_SUCCESSFULLY;
-}
+    /* Keep reading each line of the form key=value and store the value
+       into the config struct */
+    while(NULL != fgets(config_setting, sizeof(config_setting), file)){
+        line_number++;
 
-ErrorCode enable_advertising(int dongle_device_id,
-                             int advertising_interval,
-                             char *advertising_uuid,
-                             int major_number,
-                             int minor_number,
-                             int rssi_value) {
+        if(NULL == strchr(config_setting, '\n') && !feof(file)){
+            zlog_error(category_health_report,
+                       "Line [%d] too long in config file", line_number);
 #ifdef Debugging
-    zlog_debug(category_debug, ">> enable_advertising ");
+            zlog_error(category_debug,
+                       "Line [%d] too long in config file", line_number);
 #endif
-    int device_handle = 0;
-    int retry_time = 0;
-    uint8_t status;
-    struct hci_request request;
-    int return_value = 0;
-    uint8_t segment_length = 1;
-    unsigned int *xy_coordinates = NULL;
-    int uuid_iterator;
-    char uuid_identifier[17];
-    int index = 0;
-    int i;
+            fclose(file);
+            return E_INPUT_PARAMETER;
+        }
+
+        /* Skip empty lines and comments */
+        config_key = config_setting;
+        while(isspace((unsigned char)*config_key)){
+            config_key++;
+        }
+        if('\0' == *config_key ||
+           0 == strncmp(config_key, CONFIG_COMMENT, strlen(CONFIG_COMMENT))){
+            continue;
+        }
+        trim_string_tail(config_key);
 
+        config_message = strstr(config_key, DELIMITER);
+        if(NULL == config_message){
+            zlog_error(category_health_report,
+                       "Line [%d] without value in config file",
+                       line_number);
 #ifdef Debugging
-    zlog_info(category_debug, "Using dongle id [%d] uuid [%s]\n", dongle_device_id, advertising_uuid);
+            zlog_error(category_debug,
+                       "Line [%d] without value in config file",
+                       line_number);
 #endif
-    //dongle_device_id = hci_get_route(NULL);
-    if (dongle_device_id < 0){
-        zlog_error(category_health_report,
-                   "Error openning the device");
+            fclose(file);
+            return E_INPUT_PARAMETER;
+        }
+
+        *config_message = '\0';
+        config_message = config_message + strlen(DELIMITER);
+        trim_string_tail(config_key);
+        while(isspace((unsigned char)*config_message)){
+            config_message++;
+        }
+
+        for(i = 0 ; i < sizeof(config_items) / sizeof(config_items[0]) ;
+            i++){
+            if(0 == strcmp(config_key, config_items[i].key)){
+                break;
+            }
+        }
+
+        /* Settings of newer versions do not stop older versions */
+        if(i == sizeof(config_items) / sizeof(config_items[0])){
+            zlog_warn(category_health_report,
+                      "Unknown setting [%s] in config file", config_key);
 #ifdef Debugging
-        zlog_error(category_debug,
-                   "Error openning the device");
+            zlog_warn(category_debug,
+                      "Unknown setting [%s] in config file", config_key);
 #endif
-        return E_OPEN_DEVICE;
+            continue;
+        }
+
+        if(WORK_SUCCESSFULLY != parse_config_value(&config_items[i],
+                                                   config_message,
+                                                   config)){
+            zlog_error(category_health_report,
+                       "Invalid %s in config file", config_key);
+#ifdef Debugging
+            zlog_error(category_debug,
+                       "Invalid %s in config file", config_key);
+#endif
+            fclose(file);
+            return E_INPUT_PARAMETER;
+        }
     }
 
-    retry_time = SOCKET_OPEN_RETRY;
-    while(retry_time--){
-        device_handle = hci_open_dev(dongle_device_id);
+    fclose(file);
 
-        if(device_handle >= 0){
-            break;
-        }
+    return WORK_SUCCESSFULLY;
+}
+
+
+/* A static function to get the size of the field of a setting in the
+   Config struct. */
+static size_t get_config_item_size(const ConfigItem *item){
+
+    switch(item->type){
+        case CONFIG_ITEM_BOOL:
+            return sizeof(bool);
+
+        case CONFIG_ITEM_DONGLE_IDS:
+            return sizeof(g_config.scan_dongle_ids);
+
+        default:
+            return sizeof(int);
     }
+}
+
+
+static bool reload_config(){
+    Config config;
+    HandoffPolicy *new_handoff_policy = NULL;
+    bool is_handoff_policy_changed;
+    bool is_scan_window_changed;
+    int i;
 
-    if (device_handle < 0) {
+    if(WORK_SUCCESSFULLY != get_config(&config, CONFIG_FILE_NAME)){
         zlog_error(category_health_report,
-                   "Error openning socket");
+                   "Invalid config file, keep the current settings");
 #ifdef Debugging
         zlog_error(category_debug,
-                   "Error openning socket");
+                   "Invalid config file, keep the current settings");
 #endif
-        return E_OPEN_DEVICE;
+        return false;
     }
 
-    le_set_advertising_parameters_cp advertising_parameters_copy;
-    memset(&advertising_parameters_copy, 0,
-           sizeof(advertising_parameters_copy));
-    advertising_parameters_copy.min_interval = htobs(0x01E0);
-    advertising_parameters_copy.max_interval = htobs(0x01E0);
-    /* advertising non-connectable */
-    advertising_parameters_copy.advtype = 3;
-    /*set bitmap to 111 (i.e., circulate on channels 37,38,39) */
-    advertising_parameters_copy.chan_map = 7; /* all three advertising
-                                              channels*/
+    /* The devices, the transport and the memory allocated for the table
+       are set up once, so their settings keep the current values */
+    for(i = 0 ; i < sizeof(config_items) / sizeof(config_items[0]) ; i++){
+        if(config_items[i].is_reloadable){
+            continue;
+        }
 
-    memset(&request, 0, sizeof(request));
-    request.ogf = OGF_LE_CTL;
-    request.ocf = OCF_LE_SET_ADVERTISING_PARAMETERS;
-    request.cparam = &advertising_parameters_copy;
-    request.clen = LE_SET_ADVERTISING_PARAMETERS_CP_SIZE;
-    request.rparam = &status;
-    request.rlen = 1; /* length of request.rparam */
+        if(0 != memcmp((uint8_t *)&config + config_items[i].offset,
+                       (uint8_t *)&g_config + config_items[i].offset,
+                       get_config_item_size(&config_items[i])) ||
+           (CONFIG_ITEM_DONGLE_IDS == config_items[i].type &&
+            config.num_scan_dongles != g_config.num_scan_dongles)){
 
-    return_value = hci_send_req(device_handle, &request,
-                                HCI_SEND_REQUEST_TIMEOUT_IN_MS);
+            zlog_warn(category_health_report,
+                      "Changed %s takes effect after restart",
+                      config_items[i].key);
+#ifdef Debugging
+            zlog_warn(category_debug,
+                      "Changed %s takes effect after restart",
+                      config_items[i].key);
+#endif
+        }
 
-    if (return_value < 0) {
-        /* Error handling */
-        hci_close_dev(device_handle);
-        zlog_error(category_health_report,
-                   "Can't send request %s (%d)", strerror(errno),
-                   errno);
+        memcpy((uint8_t *)&config + config_items[i].offset,
+               (uint8_t *)&g_config + config_items[i].offset,
+               get_config_item_size(&config_items[i]));
+    }
+    config.num_scan_dongles = g_config.num_scan_dongles;
+
+    config.handoff_policy_config.change_criteria =
+        config.change_lbeacon_rssi_criteria;
+    config.handoff_policy_config.variance_window_in_us =
+        config.scan_timeout_in_ms * 1000LL;
+
+    is_handoff_policy_changed =
+        config.handoff_policy != g_config.handoff_policy ||
+        config.handoff_policy_config.change_criteria !=
+        g_config.handoff_policy_config.change_criteria ||
+        config.handoff_policy_config.is_per_report_decision !=
+        g_config.handoff_policy_config.is_per_report_decision ||
+        config.handoff_policy_config.cusum_drift !=
+        g_config.handoff_policy_config.cusum_drift ||
+        config.handoff_policy_config.cusum_threshold !=
+        g_config.handoff_policy_config.cusum_threshold ||
+        config.handoff_policy_config.min_dwell_time_in_ms !=
+        g_config.handoff_policy_config.min_dwell_time_in_ms ||
+        config.handoff_policy_config.variance_margin_factor !=
+        g_config.handoff_policy_config.variance_margin_factor ||
+        config.handoff_policy_config.variance_window_in_us !=
+        g_config.handoff_policy_config.variance_window_in_us;
+
+    /* The policy is checked before any setting is changed, so that an
+       invalid policy leaves the Tag as it is */
+    if(is_handoff_policy_changed){
+        new_handoff_policy = get_handoff_policy(
+                                 config.handoff_policy,
+                                 &config.handoff_policy_config);
+        if(NULL == new_handoff_policy){
+            zlog_error(category_health_report,
+                       "Unknown or invalid handoff policy [%d], keep the " \
+                       "current settings", config.handoff_policy);
 #ifdef Debugging
-        zlog_error(category_debug,
-                   "Can't send request %s (%d)", strerror(errno),
-                   errno);
+            zlog_error(category_debug,
+                       "Unknown or invalid handoff policy [%d], keep the " \
+                       "current settings", config.handoff_policy);
 #endif
-        return E_SEND_REQUEST_TIMEOUT;
+            return false;
+        }
+
+        /* The scores of the previous policy mean nothing to the new one */
+        handoff_policy = new_handoff_policy;
+        reset_lbeacon_handoff_state(&lbeacon_table);
     }
 
-    le_set_advertise_enable_cp advertisement_copy;
-    memset(&advertisement_copy, 0, sizeof(advertisement_copy));
-    advertisement_copy.enable = 0x01;
+    is_scan_window_changed =
+        config.scan_timeout_in_ms != g_config.scan_timeout_in_ms;
 
-    memset(&request, 0, sizeof(request));
-    request.ogf = OGF_LE_CTL;
-    request.ocf = OCF_LE_SET_ADVERTISE_ENABLE;
-    request.cparam = &advertisement_copy;
-    request.clen = LE_SET_ADVERTISE_ENABLE_CP_SIZE;
-    request.rparam = &status;
-    request.rlen = 1; /* length of request.rparam */
+    /* The heap has to be ordered by the values the association is decided
+       on */
+    if(config.rssi_aggregation != g_config.rssi_aggregation ||
+       is_scan_window_changed){
+        set_lbeacon_aggregation(&lbeacon_table, config.rssi_aggregation,
+                                config.scan_timeout_in_ms * 1000LL,
+                                get_clock_time_in_us());
+    }
 
-    return_value = hci_send_req(device_handle, &request,
-                                HCI_SEND_REQUEST_TIMEOUT_IN_MS);
+    g_config = config;
 
-    if (return_value < 0) {
-        /* Error handling */
-        hci_close_dev(device_handle);
-        zlog_error(category_health_report,
-                   "Can't send request %s (%d)", strerror(errno),
-                   errno);
+    zlog_info(category_health_report,
+              "Reloaded config file, using handoff policy [%s]",
+              handoff_policy->name);
 #ifdef Debugging
-        zlog_error(category_debug,
-                   "Can't send request %s (%d)", strerror(errno),
-                   errno);
+    zlog_info(category_debug,
+              "Reloaded config file, using handoff policy [%s]",
+              handoff_policy->name);
 #endif
-        return E_SEND_REQUEST_TIMEOUT;
-    }
 
-    le_set_advertising_data_cp advertisement_data_copy;
-    memset(&advertisement_data_copy, 0, sizeof(advertisement_data_copy));
+    return is_scan_window_changed;
+}
+
+
+void init_advertising_data_template(){
+    uint8_t segment_length = 1;
+
+    memset(&advertising_data_template, 0, sizeof(advertising_data_template));
 
     /* The Advertising data consists of one or more Advertising Data (AD)
     elements. Each element is formatted as follows:
@@ -297,8 +553,8 @@ ErrorCode enable_advertising(int dongle_device_id,
     related information
     */
     segment_length = 1;
-    advertisement_data_copy
-        .data[advertisement_data_copy.length + segment_length] =
+    advertising_data_template
+        .data[advertising_data_template.length + segment_length] =
         htobs(EIR_FLAGS);
     segment_length++;
 
@@ -312,24 +568,24 @@ ErrorCode enable_advertising(int dongle_device_id,
     bit 4: Simultaneous LE and BR/EDR to Same Device Capable (Host)
     bit 5-7: Reserved
     */
-    advertisement_data_copy
-        .data[advertisement_data_copy.length + segment_length] =
+    advertising_data_template
+        .data[advertising_data_template.length + segment_length] =
         htobs(0x04);
     segment_length++;
 
     /* Fill the length for EIR_FLAGS type (0x01 in Bluetooth AD type) */
-    advertisement_data_copy
-        .data[advertisement_data_copy.length] =
+    advertising_data_template
+        .data[advertising_data_template.length] =
         htobs(segment_length - 1);
 
-    advertisement_data_copy.length += segment_length;
+    advertising_data_template.length += segment_length;
 
     /* 2. Fill the EIR_MANUFACTURE_SPECIFIC_DATA (0xFF in Bluetooth AD type)
     related information
     */
     segment_length = 1;
-    advertisement_data_copy
-        .data[advertisement_data_copy.length + segment_length] =
+    advertising_data_template
+        .data[advertising_data_template.length + segment_length] =
         htobs(EIR_MANUFACTURE_SPECIFIC_DATA);
     segment_length++;
 
@@ -340,68 +596,107 @@ ErrorCode enable_advertising(int dongle_device_id,
     For Raspberry Pi, we should use 0x000F to specify the manufacturer as
     Broadcom Corporation.
     */
-    advertisement_data_copy
-        .data[advertisement_data_copy.length + segment_length] =
+    advertising_data_template
+        .data[advertising_data_template.length + segment_length] =
         htobs(0x0F);
     segment_length++;
-    advertisement_data_copy
-        .data[advertisement_data_copy.length + segment_length] =
+    advertising_data_template
+        .data[advertising_data_template.length + segment_length] =
         htobs(0x00);
     segment_length++;
 
     /* 8 bytes: LBeacon UUID identifier.
-    4 bytes for X coordinate and 4 bytes for Y coordinate.
+    4 bytes for X coordinate and 4 bytes for Y coordinate, which are
+    patched by enable_advertising.
     */
-    memset(uuid_identifier, 0, sizeof(uuid_identifier));
-    for(i  = 12 ; i < 20 ; i++){
-        uuid_identifier[index] = *(advertising_uuid+i);
-        index++;
-    }
-    for(i = 24 ; i < 32 ; i++){
-        uuid_identifier[index] = *(advertising_uuid+i);
-        index++;
-    }
-    xy_coordinates = uuid_str_to_data(uuid_identifier);
-
-    for (uuid_iterator = 0;
-         uuid_iterator < strlen(uuid_identifier) / 2;
-         uuid_iterator++) {
+    segment_length += 8;
 
-        advertisement_data_copy
-            .data[advertisement_data_copy.length + segment_length] =
-            htobs(xy_coordinates[uuid_iterator]);
-
-        segment_length++;
-    }
-
-    /* 1 bytes: Push-button information */
-    int is_button_pressed = 0;
-    advertisement_data_copy
-        .data[advertisement_data_copy.length + segment_length] =
-        htobs(is_button_pressed & 0x00FF);
+    /* 1 bytes: Push-button information, which is patched by
+    enable_advertising */
     segment_length++;
 
     /* Fill the length for EIR_MANUFACTURE_SPECIFIC_DATA type
     (0xFF in Bluetooth AD type) */
-    advertisement_data_copy.data[advertisement_data_copy.length] =
+    advertising_data_template.data[advertising_data_template.length] =
         htobs(segment_length - 1);
 
-    advertisement_data_copy.length += segment_length;
+    advertising_data_template.length += segment_length;
+}
+
+
+/* A static function called when a command of the scanner does not
+   complete successfully. The context is the message to be logged. */
+static void log_hci_command_failure(uint16_t opcode,
+                                    int status,
+                                    void *context){
+
+    if(0 == status){
+        return;
+    }
+
+    zlog_error(category_health_report,
+               "%s: command 0x%04x returned status %d",
+               (char *)context, opcode, status);
+#ifdef Debugging
+    zlog_error(category_debug,
+               "%s: command 0x%04x returned status %d",
+               (char *)context, opcode, status);
+#endif
+}
+
+
+/* A static function called when a command of the advertiser completes,
+   which marks its setting applied. If the command fails, the handle is
+   closed, so that the next call of enable_advertising re-opens the device
+   and re-applies every setting. */
+static void complete_advertiser_command(uint16_t opcode,
+                                        int status,
+                                        void *context){
+
+    if(0 == status){
+        if(cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_ADVERTISING_PARAMETERS) ==
+           opcode){
+            advertiser.is_parameters_applied = true;
+        }else if(cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_ADVERTISING_DATA) ==
+                 opcode){
+            advertiser.is_data_applied = true;
+        }else if(cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_ADVERTISE_ENABLE) ==
+                 opcode){
+            advertiser.is_enabled = advertiser.is_enable_written;
+        }
+        return;
+    }
+
+    zlog_error(category_health_report,
+               "LE advertising command 0x%04x returned status %d",
+               opcode, status);
+#ifdef Debugging
+    zlog_error(category_debug,
+               "LE advertising command 0x%04x returned status %d",
+               opcode, status);
+#endif
+    close_advertiser();
+
+    /* Retried at the end of the scan window rather than right away, so
+       that a controller failing every command is not flooded */
+    is_advertising_failed = true;
+}
 
-    memset(&request, 0, sizeof(request));
-    request.ogf = OGF_LE_CTL;
-    request.ocf = OCF_LE_SET_ADVERTISING_DATA;
-    request.cparam = &advertisement_data_copy;
-    request.clen = LE_SET_ADVERTISING_DATA_CP_SIZE;
-    request.rparam = &status;
-    request.rlen = 1; /* length of request.rparam */
 
-    return_value = hci_send_req(device_handle, &request,
-                                HCI_SEND_REQUEST_TIMEOUT_IN_MS);
+/* A static function to write one LE controller command of the advertiser
+   through the cached device handle without waiting for its completion. */
+static ErrorCode send_advertiser_command(uint16_t ocf,
+                                         int clen,
+                                         void *cparam){
+    ErrorCode return_value = WORK_SUCCESSFULLY;
 
-    hci_close_dev(device_handle);
+    return_value = submit_hci_command(&hci_command_queue,
+                                      advertiser.device_handle,
+                                      OGF_LE_CTL, ocf, clen, cparam,
+                                      HCI_SEND_REQUEST_TIMEOUT_IN_MS,
+                                      complete_advertiser_command, NULL);
 
-    if (return_value < 0) {
+    if (WORK_SUCCESSFULLY != return_value) {
         /* Error handling */
         zlog_error(category_health_report,
                    "Can't send request %s (%d)", strerror(errno),
@@ -411,42 +706,87 @@ ErrorCode enable_advertising(int dongle_device_id,
                    "Can't send request %s (%d)", strerror(errno),
                    errno);
 #endif
+        close_advertiser();
         return E_SEND_REQUEST_TIMEOUT;
     }
 
-    if (status) {
-        /* Error handling */
-        zlog_error(category_health_report,
-                   "LE set advertise returned status %d", status);
-#ifdef Debugging
-        zlog_error(category_debug,
-                   "LE set advertise returned status %d", status);
-#endif
-        return E_ADVERTISE_STATUS;
-    }
-#ifdef Debugging
-    zlog_debug(category_debug, "<< enable_advertising ");
-#endif
     return WORK_SUCCESSFULLY;
 }
 
 
-ErrorCode disable_advertising(int dongle_device_id) {
-    int device_handle = 0;
+/* A static function to process the events read from the device of the
+   advertiser, which are the completions of its commands. */
+static void handle_advertiser_events(){
+    uint8_t buffers[HCI_EVENT_BATCH_SIZE][HCI_MAX_EVENT_SIZE];
+    int lengths[HCI_EVENT_BATCH_SIZE];
+    int device_handle = advertiser.device_handle;
+    int num_events;
+    int i;
+
+    /* A failed command closes the handle, after which the rest of the
+       events are not read */
+    while(device_handle >= 0 && device_handle == advertiser.device_handle){
+
+        num_events = hci_transport->read_events(device_handle, buffers,
+                                                lengths,
+                                                HCI_EVENT_BATCH_SIZE);
+        if(num_events <= 0){
+            break;
+        }
+
+        for(i = 0 ; i < num_events &&
+                    device_handle == advertiser.device_handle ; i++){
+            handle_hci_command_event(&hci_command_queue, device_handle,
+                                     buffers[i], lengths[i]);
+        }
+    }
+}
+
+
+/* A static function to wait for the completions of the commands of the
+   advertiser, used when the event loop no longer runs. */
+static void wait_advertiser_commands(int timeout_in_ms){
+    struct pollfd fds[1];
+    long long deadline;
+    long long now;
+
+    deadline = get_clock_time_in_us() + timeout_in_ms * 1000LL;
+
+    /* A failed command closes the handle */
+    while(advertiser.device_handle >= 0 &&
+          count_hci_commands(&hci_command_queue,
+                             advertiser.device_handle) > 0){
+
+        now = get_clock_time_in_us();
+        if(now >= deadline){
+            zlog_warn(category_health_report,
+                      "Advertising commands not completed in [%d] ms",
+                      timeout_in_ms);
+            break;
+        }
+
+        fds[0].fd = advertiser.device_handle;
+        fds[0].events = POLLIN;
+
+        if(0 > poll(fds, 1, (int)((deadline - now + 999) / 1000)) &&
+           EINTR != errno){
+            break;
+        }
+
+        handle_advertiser_events();
+    }
+}
+
+
+/* A static function to open the device of the advertiser, or to reuse the
+   cached handle if the same device is already open. */
+static ErrorCode open_advertiser(int dongle_device_id){
     int retry_time = 0;
-    uint8_t status;
-    struct hci_request request;
-    int return_value = 0;
-    le_set_advertise_enable_cp advertisement_copy;
+    struct hci_filter filter;
+    struct epoll_event epoll_event;
 
-#ifdef Debugging
-    zlog_debug(category_debug,
-               ">> disable_advertising ");
-#endif
-    /* Open Bluetooth device */
-    retry_time = DONGLE_GET_RETRY;
     //dongle_device_id = hci_get_route(NULL);
-    if (dongle_device_id < 0) {
+    if (dongle_device_id < 0){
         zlog_error(category_health_report,
                    "Error openning the device");
 #ifdef Debugging
@@ -456,16 +796,24 @@ ErrorCode disable_advertising(int dongle_device_id) {
         return E_OPEN_DEVICE;
     }
 
+    if (advertiser.device_handle >= 0 &&
+        advertiser.dongle_device_id == dongle_device_id){
+        return WORK_SUCCESSFULLY;
+    }
+
+    close_advertiser();
+
     retry_time = SOCKET_OPEN_RETRY;
     while(retry_time--){
-        device_handle = hci_open_dev(dongle_device_id);
+        advertiser.device_handle =
+            hci_transport->open_dev(dongle_device_id);
 
-        if(device_handle >= 0){
+        if(advertiser.device_handle >= 0){
             break;
         }
     }
 
-    if (device_handle < 0) {
+    if (advertiser.device_handle < 0) {
         zlog_error(category_health_report,
                    "Error openning socket");
 #ifdef Debugging
@@ -475,109 +823,258 @@ ErrorCode disable_advertising(int dongle_device_id) {
         return E_OPEN_DEVICE;
     }
 
-    memset(&advertisement_copy, 0, sizeof(advertisement_copy));
-
-    memset(&request, 0, sizeof(request));
-    request.ogf = OGF_LE_CTL;
-    request.ocf = OCF_LE_SET_ADVERTISE_ENABLE;
-    request.cparam = &advertisement_copy;
-    request.clen = LE_SET_ADVERTISE_ENABLE_CP_SIZE;
-    request.rparam = &status;
-    request.rlen = 1; /* length of request.rparam */
-
-    return_value = hci_send_req(device_handle, &request,
-                                HCI_SEND_REQUEST_TIMEOUT_IN_MS);
+    advertiser.dongle_device_id = dongle_device_id;
 
-    hci_close_dev(device_handle);
+    /* The completions of the commands are read by the event loop of BLE
+       scanning */
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &filter);
+    hci_filter_set_event(EVT_CMD_STATUS, &filter);
 
-    if (return_value < 0) {
-        /* Error handling */
-        zlog_error(category_health_report,
-                   "Can't set advertise mode: %s (%d)",
-                   strerror(errno), errno);
-#ifdef Debugging
-        zlog_error(category_debug,
-                   "Can't set advertise mode: %s (%d)",
-                   strerror(errno), errno);
-#endif
-        return E_ADVERTISE_MODE;
-    }
+    memset(&epoll_event, 0, sizeof(epoll_event));
+    epoll_event.events = EPOLLIN;
+    epoll_event.data.fd = advertiser.device_handle;
 
-    if (status) {
-        /* Error handling */
+    if (0 > hci_transport->set_filter(advertiser.device_handle, &filter) ||
+        0 > epoll_ctl(epoll_fd, EPOLL_CTL_ADD, advertiser.device_handle,
+                      &epoll_event)) {
         zlog_error(category_health_report,
-                   "LE set advertise enable on returned status %d",
-                   status);
+                   "Error watching advertising device: %s",
+                   strerror(errno));
 #ifdef Debugging
         zlog_error(category_debug,
-                   "LE set advertise enable on returned status %d",
-                   status);
+                   "Error watching advertising device: %s",
+                   strerror(errno));
 #endif
-        return E_ADVERTISE_STATUS;
+        close_advertiser();
+        return E_OPEN_DEVICE;
     }
-#ifdef Debugging
-    zlog_debug(category_debug,
-               "<< disable_advertising ");
-#endif
 
     return WORK_SUCCESSFULLY;
 }
 
 
+void close_advertiser(){
 
-/* A static struct function that returns specific bluetooth BLE request. */
-const struct hci_request ble_hci_request(uint16_t ocf,
-                                         int clen,
-                                         void * status,
-                                         void * cparam){
-    struct hci_request rq;
-    memset(&rq, 0, sizeof(rq));
-    rq.ogf = OGF_LE_CTL;
-    rq.ocf = ocf;
-    rq.cparam = cparam;
-    rq.clen = clen;
-    rq.rparam = status;
-    rq.rlen = 1; /* length of request.rparam */
+    if (advertiser.device_handle >= 0) {
+        /* Closing the device also removes it from the epoll set */
+        cancel_hci_commands(&hci_command_queue, advertiser.device_handle);
+        hci_transport->close_dev(advertiser.device_handle);
+    }
 
-    return rq;
+    /* Nothing is known to be applied to a device which is not open */
+    memset(&advertiser, 0, sizeof(advertiser));
+    advertiser.device_handle = -1;
+    advertiser.dongle_device_id = -1;
 }
 
-/* A static function to prase the name from the BLE device. */
-static ErrorCode eir_parse_uuid(uint8_t *eir,
-                           size_t eir_len,
-                           char *buf,
-                           size_t buf_len){
-    size_t offset;
-    uint8_t field_len;
-    size_t uuid_len;
-    int index;
-    int i;
-	bool has_uuid = false;
 
-    offset = 0;
-
-    while (offset < eir_len) {
-        field_len = eir[0];
-
-        /* Check for the end of EIR */
-        if (field_len == 0)
-            break;
+ErrorCode enable_advertising(int dongle_device_id,
+                             int advertising_interval,
+                             LBeaconUUID *advertising_uuid,
+                             int major_number,
+                             int minor_number,
+                             int rssi_value) {
+#ifdef Debugging
+    zlog_debug(category_debug, ">> enable_advertising ");
+#endif
+    ErrorCode return_value = WORK_SUCCESSFULLY;
+    int is_button_pressed = 0;
+    le_set_advertising_parameters_cp advertising_parameters_copy;
+    le_set_advertise_enable_cp advertisement_copy;
+#ifdef Debugging
+    char uuid_text[LENGTH_OF_UUID];
+
+    zlog_info(category_debug, "Using dongle id [%d] uuid [%s]\n", dongle_device_id, uuid_to_str(advertising_uuid, uuid_text));
+#endif
+
+    return_value = open_advertiser(dongle_device_id);
+    if (WORK_SUCCESSFULLY != return_value) {
+        return return_value;
+    }
+
+    memset(&advertising_parameters_copy, 0,
+           sizeof(advertising_parameters_copy));
+    advertising_parameters_copy.min_interval = htobs(0x01E0);
+    advertising_parameters_copy.max_interval = htobs(0x01E0);
+    /* advertising non-connectable */
+    advertising_parameters_copy.advtype = 3;
+    /*set bitmap to 111 (i.e., circulate on channels 37,38,39) */
+    advertising_parameters_copy.chan_map = 7; /* all three advertising
+                                              channels*/
+
+    /* The settings are compared with the ones last written, so that a
+       command is not written again while it waits for its completion.
+       The controller rejects new parameters while advertising, so
+       advertising is stopped first if the parameters changed. */
+    if (!advertiser.is_parameters_written ||
+        0 != memcmp(&advertising_parameters_copy,
+                    &advertiser.parameters,
+                    sizeof(advertising_parameters_copy))) {
+
+        if (advertiser.is_enable_written) {
+            return_value = disable_advertising(dongle_device_id);
+            if (WORK_SUCCESSFULLY != return_value) {
+                return return_value;
+            }
+        }
+
+        return_value = send_advertiser_command(
+            OCF_LE_SET_ADVERTISING_PARAMETERS,
+            LE_SET_ADVERTISING_PARAMETERS_CP_SIZE,
+            &advertising_parameters_copy);
+        if (WORK_SUCCESSFULLY != return_value) {
+            return return_value;
+        }
+
+        advertiser.parameters = advertising_parameters_copy;
+        advertiser.is_parameters_written = true;
+        advertiser.is_parameters_applied = false;
+    }
 
-        if (offset + field_len > eir_len)
-            goto failed;
+    /* Patch the coordinates of the associated LBeacon into the cached
+    payload. The X coordinate is in bytes 6 to 9 and the Y coordinate is in
+    bytes 12 to 15 of the UUID. */
+    memcpy(&advertising_data_template
+                .data[ADVERTISING_DATA_COORDINATES_OFFSET],
+           &advertising_uuid->bytes[6], 4);
+    memcpy(&advertising_data_template
+                .data[ADVERTISING_DATA_COORDINATES_OFFSET + 4],
+           &advertising_uuid->bytes[12], 4);
+
+    /* 1 bytes: Push-button information */
+    advertising_data_template.data[ADVERTISING_DATA_BUTTON_OFFSET] =
+        is_button_pressed & 0x00FF;
+
+    /* The advertising data can be changed while advertising */
+    if (!advertiser.is_data_written ||
+        0 != memcmp(&advertising_data_template,
+                    &advertiser.data,
+                    sizeof(advertising_data_template))) {
+
+        return_value = send_advertiser_command(
+            OCF_LE_SET_ADVERTISING_DATA,
+            LE_SET_ADVERTISING_DATA_CP_SIZE,
+            &advertising_data_template);
+        if (WORK_SUCCESSFULLY != return_value) {
+            return return_value;
+        }
+
+        advertiser.data = advertising_data_template;
+        advertiser.is_data_written = true;
+        advertiser.is_data_applied = false;
+    }
+
+    if (!advertiser.is_enable_written) {
+        memset(&advertisement_copy, 0, sizeof(advertisement_copy));
+        advertisement_copy.enable = 0x01;
+
+        return_value = send_advertiser_command(
+            OCF_LE_SET_ADVERTISE_ENABLE,
+            LE_SET_ADVERTISE_ENABLE_CP_SIZE,
+            &advertisement_copy);
+        if (WORK_SUCCESSFULLY != return_value) {
+            return return_value;
+        }
+
+        advertiser.is_enable_written = true;
+    }
+
+#ifdef Debugging
+    zlog_debug(category_debug, "<< enable_advertising ");
+#endif
+    return WORK_SUCCESSFULLY;
+}
+
+
+ErrorCode disable_advertising(int dongle_device_id) {
+    ErrorCode return_value = WORK_SUCCESSFULLY;
+    le_set_advertise_enable_cp advertisement_copy;
+
+#ifdef Debugging
+    zlog_debug(category_debug,
+               ">> disable_advertising ");
+#endif
+
+    return_value = open_advertiser(dongle_device_id);
+    if (WORK_SUCCESSFULLY != return_value) {
+        return return_value;
+    }
+
+    memset(&advertisement_copy, 0, sizeof(advertisement_copy));
+
+    return_value = send_advertiser_command(OCF_LE_SET_ADVERTISE_ENABLE,
+                                           LE_SET_ADVERTISE_ENABLE_CP_SIZE,
+                                           &advertisement_copy);
+    if (WORK_SUCCESSFULLY != return_value) {
+        zlog_error(category_health_report,
+                   "Can't set advertise mode");
+#ifdef Debugging
+        zlog_error(category_debug,
+                   "Can't set advertise mode");
+#endif
+        return E_ADVERTISE_MODE;
+    }
+
+    advertiser.is_enable_written = false;
+
+#ifdef Debugging
+    zlog_debug(category_debug,
+               "<< disable_advertising ");
+#endif
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+
+/* A static struct function that returns specific bluetooth BLE request. */
+const struct hci_request ble_hci_request(uint16_t ocf,
+                                         int clen,
+                                         void * status,
+                                         void * cparam){
+    struct hci_request rq;
+    memset(&rq, 0, sizeof(rq));
+    rq.ogf = OGF_LE_CTL;
+    rq.ocf = ocf;
+    rq.cparam = cparam;
+    rq.clen = clen;
+    rq.rparam = status;
+    rq.rlen = 1; /* length of request.rparam */
+
+    return rq;
+}
+
+/* A static function to prase the name from the BLE device. */
+static ErrorCode eir_parse_uuid(uint8_t *eir,
+                           size_t eir_len,
+                           LBeaconUUID *uuid){
+    size_t offset;
+    uint8_t field_len;
+    size_t uuid_len;
+
+    offset = 0;
+
+    while (offset < eir_len) {
+        field_len = eir[0];
+
+        /* Check for the end of EIR */
+        if (field_len == 0)
+            break;
+
+        /* The length byte and the field both lie within the data */
+        if (offset + field_len + 1 > eir_len)
+            break;
 
         switch (eir[1]) {
             case EIR_MANUFACTURE_SPECIFIC_DATA:
                 uuid_len = field_len - 1;
-/*
-                printf("parse result:\n");
-                for(int i = 0 ; i < uuid_len ; i++)
-                   printf("%d\n", eir[2+i]);
-*/
-                if (uuid_len > buf_len)
-                       goto failed;
 
-                index = 0;
+                /* Company identifier, beacon type and length, and UUID */
+                if (uuid_len < 4 + UUID_DATA_LENGTH)
+                    return E_PARSE_UUID;
+
                 // Ensure the Beacon is our LBeacon
                 // Broafcom Corporation is 0x000F, so the 
                 // eir[2] is 0x0F and eir[3] is 0x00
@@ -588,315 +1085,1239 @@ static ErrorCode eir_parse_uuid(uint8_t *eir,
                         // LBeacon UUID format has six leading 0, so the 
                         // eir[6], eir[7] and eir[8] are all 0x00
                         if(eir[6] ==0 && eir[7] == 0 && eir[8] ==0){
-                            for(i = 6 ; i < 22 ; i++)
-                            {
-                                buf[index] = eir[i] / 16 + '0';
-                                buf[index+1] = eir[i] % 16 + '0';
-                                index=index+2;
-                            }
-                            buf[index] = '\0';
-                            has_uuid = true;
+                            memcpy(uuid->bytes, &eir[6], UUID_DATA_LENGTH);
+                            return WORK_SUCCESSFULLY;
                         }
                     }
                 }
-                if(has_uuid){
-                    return WORK_SUCCESSFULLY;
-                }
                 return E_PARSE_UUID;
         }
 
-        offset += field_len + 1;
-        eir += field_len + 1;
+        offset += field_len + 1;
+        eir += field_len + 1;
+    }
+
+    return E_PARSE_UUID;
+}
+
+
+/* A static function to attach the socket filter passing only LBeacon
+   advertisements. */
+static ErrorCode attach_lbeacon_filter(int socket){
+    struct sock_filter code[LBEACON_FILTER_LENGTH];
+    struct sock_fprog program;
+    int check;
+    int accept;
+    int drop;
+    int length = 0;
+    int i;
+
+    /* Positions of the jump targets. See the layout below. */
+    check = 12 + 6 * MAX_AD_STRUCTURES_IN_FILTER;
+    accept = check + 6;
+    drop = accept + 1;
+
+    /* Pass every packet other than an LE Meta advertising report event,
+       e.g. the Command Complete events of HCI requests. The packet starts
+       with the packet type, followed by the event header. */
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0);
+    code[length] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, HCI_EVENT_PKT,
+                 0, accept - length - 1);
+    length++;
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1);
+    code[length] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, EVT_LE_META_EVENT,
+                 0, accept - length - 1);
+    length++;
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1 + HCI_EVENT_HDR_SIZE);
+    code[length] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, EVT_LE_ADVERTISING_REPORT,
+                 0, accept - length - 1);
+    length++;
+
+    /* Events packing several reports are left to the userspace check */
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1 + HCI_EVENT_HDR_SIZE + 1);
+    code[length] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, accept - length - 1);
+    length++;
+
+    /* Walk the AD structures of the report with the index register, which
+       starts at the first AD structure */
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_LDX | BPF_IMM,
+                 1 + HCI_EVENT_HDR_SIZE + 2 + LE_ADVERTISING_INFO_SIZE);
+
+    for(i = 0 ; i < MAX_AD_STRUCTURES_IN_FILTER ; i++){
+        /* AD type */
+        code[length++] = (struct sock_filter)
+            BPF_STMT(BPF_LD | BPF_B | BPF_IND, 1);
+        code[length] = (struct sock_filter)
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                     EIR_MANUFACTURE_SPECIFIC_DATA, check - length - 1, 0);
+        length++;
+        /* Move to the next AD structure by its length */
+        code[length++] = (struct sock_filter)
+            BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0);
+        code[length++] = (struct sock_filter)
+            BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 1);
+        code[length++] = (struct sock_filter)
+            BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0);
+        code[length++] = (struct sock_filter)
+            BPF_STMT(BPF_MISC | BPF_TAX, 0);
+    }
+
+    /* No manufacturer specific data in the walked AD structures. If the
+       walk stops before the end of the data, the rest is left to the
+       userspace check rather than dropped. */
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+                 1 + HCI_EVENT_HDR_SIZE + 2 + LE_ADVERTISING_INFO_SIZE - 1);
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K,
+                 1 + HCI_EVENT_HDR_SIZE + 2 + LE_ADVERTISING_INFO_SIZE);
+    code[length] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_X, 0,
+                 accept - length - 1, drop - length - 1);
+    length++;
+
+    /* The same signature as checked by eir_parse_uuid: Broadcom company
+       identifier 0x000F, beacon-like prefix 0x02 0x15 and the leading
+       zeros of the LBeacon UUID. Loads are in network byte order. */
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2);
+    code[length] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0F00, 0, drop - length - 1);
+    length++;
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_W | BPF_IND, 4);
+    code[length] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x02150000,
+                 0, drop - length - 1);
+    length++;
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8);
+    code[length] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x00, 0, drop - length - 1);
+    length++;
+
+    code[length++] = (struct sock_filter)
+        BPF_STMT(BPF_RET | BPF_K, HCI_MAX_EVENT_SIZE + 1);
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+    program.len = length;
+    program.filter = code;
+
+    if(0 > hci_transport->attach_filter(socket, &program)){
+        return E_SCAN_SET_HCI_FILTER;
+    }
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+/* A static function to update the LBeacon table with one advertising
+   report. */
+static void track_advertising_report(le_advertising_info *info,
+                                     long long now){
+    LBeaconUUID uuid;
+    int rssi;
+    int lbeacon_index;
+    bool is_inserted;
+
+    rssi = (signed char)info->data[info->length];
+
+    if(rssi > g_config.scan_rssi_coverage){
+
+        if(WORK_SUCCESSFULLY == eir_parse_uuid(info->data,
+                                               info->length,
+                                               &uuid)){
+            TRACE_REPORT(TRACE_DETECTED_LBEACON, TRACE_UUID_ARGS(&uuid),
+                         rssi, TRACE_ADDRESS_ARGS(&info->bdaddr));
+
+            lbeacon_index = lbeacon_table_insert(&lbeacon_table,
+                                                 &uuid,
+                                                 &is_inserted);
+            if(lbeacon_index == -1){
+                /* The table is full. The report is counted in the
+                   overflowed reports of the table. */
+                return;
+            }
+
+            update_lbeacon_rssi(&lbeacon_table, lbeacon_index, rssi, now,
+                                g_config.rssi_time_constant_in_ms * 1000LL);
+            lbeacon_table.counts[lbeacon_index]++;
+
+            decide_association_on_report(lbeacon_index, rssi, now);
+        }else{
+            scan_statistics.rejected_reports++;
+        } // end of if lbeacon
+    } // end of if rssi is higher than threshold
+}
+
+
+/* A static function to process a batch of HCI events read from the
+   socket, walking every advertising report of each LE Meta event. */
+static void handle_advertising_events(
+    int socket,
+    uint8_t buffers[][HCI_MAX_EVENT_SIZE],
+    int *lengths,
+    int num_events,
+    long long now){
+    evt_le_meta_event *meta;
+    le_advertising_info *info;
+    int event_index;
+    int num_reports;
+    int report_index;
+    uint8_t *report;
+    uint8_t *event_end;
+
+    for(event_index = 0 ; event_index < num_events ; event_index++){
+
+        if(lengths[event_index] < 1 + HCI_EVENT_HDR_SIZE +
+                                  EVT_LE_META_EVENT_SIZE + 1){
+            continue;
+        }
+
+        /* Completions of the commands written to the socket */
+        if(handle_hci_command_event(&hci_command_queue, socket,
+                                    buffers[event_index],
+                                    lengths[event_index])){
+            continue;
+        }
+
+        meta = (evt_le_meta_event*)
+            (buffers[event_index] + HCI_EVENT_HDR_SIZE + 1);
+
+        if(EVT_LE_ADVERTISING_REPORT != meta->subevent){
+            continue;
+        }
+
+        /* The first byte of the event data is the number of reports, which
+           are packed back to back and each followed by its RSSI byte. */
+        num_reports = meta->data[0];
+        report = meta->data + 1;
+        event_end = buffers[event_index] + lengths[event_index];
+
+        for(report_index = 0 ; report_index < num_reports ; report_index++){
+
+            info = (le_advertising_info *)report;
+
+            if(report + LE_ADVERTISING_INFO_SIZE > event_end ||
+               info->data + info->length + 1 > event_end){
+                /* truncated event */
+                break;
+            }
+
+            scan_statistics.reports++;
+
+            track_advertising_report(info, now);
+
+            report = info->data + info->length + 1;
+        }
+    }
+}
+
+
+/* A static function to aggregate the RSSI values of a LBeacon in the way
+   selected in the config file. */
+static int estimate_lbeacon_rssi(int index, long long now){
+
+    if(RSSI_AGGREGATION_EWMA == g_config.rssi_aggregation){
+        return get_lbeacon_rssi(&lbeacon_table, index, now,
+                                g_config.rssi_time_constant_in_ms * 1000LL,
+                                g_config.scan_rssi_coverage);
+    }
+
+    return get_lbeacon_rssi_in_window(&lbeacon_table, index,
+                                      g_config.rssi_aggregation, now,
+                                      g_config.scan_timeout_in_ms * 1000LL,
+                                      g_config.scan_rssi_coverage);
+}
+
+
+/* A static function to switch the association to another LBeacon. */
+static void change_association(HandoffCandidate *association, long long now){
+    long long latency;
+
+    if(0 != lbeacon_table.stronger_since_times[association->index]){
+        latency = now -
+                  lbeacon_table.stronger_since_times[association->index];
+
+        scan_statistics.handoffs++;
+        scan_statistics.total_handoff_latency_in_us += latency;
+        if(latency > scan_statistics.max_handoff_latency_in_us){
+            scan_statistics.max_handoff_latency_in_us = latency;
+        }
+    }
+
+    lbeacon_uuid = lbeacon_table.uuids[association->index];
+    association_time = now;
+    scan_statistics.association_changes++;
+
+    is_lbeacon_changed = true;
+    scan_scheduler.is_association_changed = true;
+
+    /* The evidence is relative to the previous association */
+    reset_lbeacon_handoff_state(&lbeacon_table);
+
+    handoff_policy->change_association(&lbeacon_table, association, now);
+
+    publish_lbeacon_export(now);
+}
+
+
+/* A static function to decide the association on an advertising report
+   from the LBeacon of the report and the strongest candidates of the
+   table. */
+static void decide_association_on_report(int index, int rssi, long long now){
+    HandoffCandidate associated;
+    HandoffCandidate reported;
+    HandoffCandidate strongest;
+    HandoffCandidate *association;
+    int runner_up_index;
+    int runner_up_rssi;
+    int new_index;
+
+    associated.index = lbeacon_table_lookup(&lbeacon_table, &lbeacon_uuid);
+    associated.rssi = 0;
+    if(associated.index != -1){
+        associated.rssi = estimate_lbeacon_rssi(associated.index, now);
+    }
+
+    reported.index = index;
+    reported.rssi = estimate_lbeacon_rssi(index, now);
+
+    /* Record since when the LBeacon is stronger, to measure the latency of
+       the decision */
+    if(associated.index != -1 && associated.index != index){
+        if(reported.rssi > associated.rssi){
+            if(0 == lbeacon_table.stronger_since_times[index]){
+                lbeacon_table.stronger_since_times[index] = now;
+            }
+        }else{
+            lbeacon_table.stronger_since_times[index] = 0;
+        }
+    }
+
+    if(NULL == handoff_policy->decide_on_report){
+        return;
+    }
+
+    /* The heap orders the values aggregated when the LBeacons are last
+       heard, so the top may be a LBeacon gone silent whose value has
+       decayed or lost samples below the one of the runner-up */
+    get_lbeacon_candidates(&lbeacon_table, &strongest.index,
+                           &runner_up_index);
+    strongest.rssi = estimate_lbeacon_rssi(strongest.index, now);
+    if(runner_up_index != -1){
+        runner_up_rssi = estimate_lbeacon_rssi(runner_up_index, now);
+        if(runner_up_rssi > strongest.rssi){
+            strongest.index = runner_up_index;
+            strongest.rssi = runner_up_rssi;
+        }
+    }
+
+    new_index = handoff_policy->decide_on_report(&lbeacon_table, &associated,
+                                                 &reported, rssi, &strongest,
+                                                 now);
+    if(new_index == -1 || new_index == associated.index){
+        return;
+    }
+
+    association = (new_index == reported.index) ? &reported : &strongest;
+    TRACE_DECISION(TRACE_REPORT_ASSOCIATION_CHANGE,
+                   TRACE_UUID_ARGS(&lbeacon_table.uuids[association->index]),
+                   association->rssi,
+                   lbeacon_table.counts[association->index]);
+    change_association(association, now);
+}
+
+
+/* A static function to decide the association at the end of a scan window
+   and to start a new window. */
+static void close_scan_window(long long now){
+    HandoffCandidate associated;
+    HandoffCandidate strongest;
+
+    /* Forget the LBeacons not heard for a while. The slots of the others
+       may move, so the associated LBeacon is looked up afterwards. */
+    lbeacon_table_evict(&lbeacon_table, now,
+                        g_config.lbeacon_stale_timeout_in_ms * 1000LL);
+
+    if(NULL != handoff_policy->decide_on_window &&
+       lbeacon_table.num_lbeacons > 0){
+
+        associated.index = lbeacon_table_lookup(&lbeacon_table,
+                                                &lbeacon_uuid);
+        associated.rssi = 0;
+
+        /* Only the slots in use are estimated. Free slots hold
+           LBEACON_RSSI_NONE, which is never selected. */
+        for(int i = 0 ; i < lbeacon_table.capacity ; i++){
+            if(!lbeacon_table.is_used[i]){
+                continue;
+            }
+
+            lbeacon_table.rssi_values[i] = estimate_lbeacon_rssi(i, now);
+
+            TRACE_REPORT(TRACE_WINDOW_LBEACON, i,
+                         TRACE_UUID_ARGS(&lbeacon_table.uuids[i]),
+                         lbeacon_table.rssi_values[i],
+                         lbeacon_table.counts[i]);
+        }
+
+        if(associated.index != -1){
+            associated.rssi = lbeacon_table.rssi_values[associated.index];
+        }
+
+        strongest.index = find_strongest_lbeacon(&lbeacon_table, -100,
+                                                 &strongest.rssi);
+
+        if(handoff_policy->decide_on_window(&lbeacon_table, &associated,
+                                            &strongest, now)){
+            TRACE_DECISION(TRACE_WINDOW_ASSOCIATION_CHANGE,
+                           TRACE_UUID_ARGS(
+                               &lbeacon_table.uuids[strongest.index]),
+                           strongest.rssi,
+                           lbeacon_table.counts[strongest.index]);
+            change_association(&strongest, now);
+        }else if(associated.index != -1){
+            TRACE_DECISION(TRACE_WINDOW_ASSOCIATION_KEEP,
+                           TRACE_UUID_ARGS(&lbeacon_uuid), associated.rssi);
+        }
+    }
+    schedule_scan_profile(now);
+
+    publish_lbeacon_export(now);
+
+    /* The RSSI estimates persist, only the counts are per window */
+    memset(lbeacon_table.counts, 0,
+           sizeof(int) * lbeacon_table.capacity);
+}
+
+
+static void dump_metrics(long long now){
+    HCICommandQueue *queue = &hci_command_queue;
+    ScanStatistics *statistics = &scan_statistics;
+
+    zlog_info(category_health_report,
+              "Metrics: reads=%llu, HCI events=%llu, reports=%llu, " \
+              "kernel filter=%s, filtered in kernel=%llu, " \
+              "rejected reports=%llu, dropped in ring=%llu, " \
+              "max ring usage=%llu, max processing delay=%lldus, " \
+              "tracked LBeacons=%d, evicted LBeacons=%llu, " \
+              "reports over table capacity=%llu",
+              statistics->read_calls,
+              statistics->events,
+              statistics->reports,
+              statistics->is_kernel_filter_attached ? "on" : "off",
+              statistics->kernel_filtered_events,
+              statistics->rejected_reports,
+              statistics->ring_dropped_events,
+              statistics->max_ring_usage,
+              statistics->max_processing_delay_in_us,
+              lbeacon_table.num_lbeacons,
+              lbeacon_table.evicted_lbeacons,
+              lbeacon_table.overflowed_reports);
+
+    zlog_info(category_health_report,
+              "Metrics: windows=%llu, avg window close latency=%lldus, " \
+              "max window close latency=%lldus, " \
+              "association changes=%llu, handoffs=%llu, " \
+              "avg handoff latency=%lldus, max handoff latency=%lldus, " \
+              "scan profile=%s, profile changes=%llu, " \
+              "windows at alert/normal/idle=%llu/%llu/%llu, " \
+              "commands=%llu, failed commands=%llu, " \
+              "timed out commands=%llu, max pending commands=%d, " \
+              "commands over pool=%llu",
+              statistics->windows,
+              statistics->windows > 0 ?
+              statistics->total_window_close_latency_in_us /
+              (long long)statistics->windows : 0,
+              statistics->max_window_close_latency_in_us,
+              statistics->association_changes,
+              statistics->handoffs,
+              statistics->handoffs > 0 ?
+              statistics->total_handoff_latency_in_us /
+              (long long)statistics->handoffs : 0,
+              statistics->max_handoff_latency_in_us,
+              scan_profiles[scan_scheduler.level].name,
+              scan_scheduler.level_changes,
+              scan_scheduler.windows_at_level[SCAN_PROFILE_ALERT],
+              scan_scheduler.windows_at_level[SCAN_PROFILE_NORMAL],
+              scan_scheduler.windows_at_level[SCAN_PROFILE_IDLE],
+              queue->completed_commands,
+              queue->failed_commands,
+              queue->timed_out_commands,
+              queue->command_pool.max_used_slots,
+              queue->command_pool.exhausted_allocations);
+
+    zlog_info(category_health_report,
+              "Metrics: p50/p90/p99/max in us over %lld ms: " \
+              "command completion=%lld/%lld/%lld/%lld (%llu), " \
+              "sync request time=%lld/%lld/%lld/%lld (%llu), " \
+              "window close time=%lld/%lld/%lld/%lld (%llu), " \
+              "report to decision=%lld/%lld/%lld/%lld (%llu)",
+              (now - statistics->last_metrics_dump_time) / 1000,
+              get_latency_percentile(&queue->latency_histogram, 50),
+              get_latency_percentile(&queue->latency_histogram, 90),
+              get_latency_percentile(&queue->latency_histogram, 99),
+              queue->latency_histogram.max_value,
+              queue->latency_histogram.num_values,
+              get_latency_percentile(
+                  &statistics->sync_request_time_histogram, 50),
+              get_latency_percentile(
+                  &statistics->sync_request_time_histogram, 90),
+              get_latency_percentile(
+                  &statistics->sync_request_time_histogram, 99),
+              statistics->sync_request_time_histogram.max_value,
+              statistics->sync_request_time_histogram.num_values,
+              get_latency_percentile(
+                  &statistics->window_close_time_histogram, 50),
+              get_latency_percentile(
+                  &statistics->window_close_time_histogram, 90),
+              get_latency_percentile(
+                  &statistics->window_close_time_histogram, 99),
+              statistics->window_close_time_histogram.max_value,
+              statistics->window_close_time_histogram.num_values,
+              get_latency_percentile(
+                  &statistics->report_decision_delay_histogram, 50),
+              get_latency_percentile(
+                  &statistics->report_decision_delay_histogram, 90),
+              get_latency_percentile(
+                  &statistics->report_decision_delay_histogram, 99),
+              statistics->report_decision_delay_histogram.max_value,
+              statistics->report_decision_delay_histogram.num_values);
+
+    /* The counters add up over the lifetime of the Tag, the latencies are
+       of the interval */
+    reset_latency_histogram(&queue->latency_histogram);
+    reset_latency_histogram(&statistics->window_close_time_histogram);
+    reset_latency_histogram(&statistics->report_decision_delay_histogram);
+    reset_latency_histogram(&statistics->sync_request_time_histogram);
+    statistics->last_metrics_dump_time = now;
+}
+
+
+/* A static function to pick the level of scan duty cycle for the next
+   scan window. */
+static void schedule_scan_profile(long long now){
+    ScanProfileLevel level;
+    int associated_index;
+    bool is_steady;
+
+    scan_scheduler.windows_at_level[scan_scheduler.level]++;
+
+    associated_index = lbeacon_table_lookup(&lbeacon_table, &lbeacon_uuid);
+
+    is_steady = !scan_scheduler.is_association_changed &&
+                associated_index != -1 &&
+                lbeacon_table.counts[associated_index] > 0 &&
+                get_lbeacon_rssi_variance(
+                    &lbeacon_table, associated_index, now,
+                    g_config.scan_timeout_in_ms * 1000LL) <=
+                SCAN_PROFILE_MAX_RSSI_VARIANCE << RSSI_FRACTION_BITS;
+
+    scan_scheduler.is_association_changed = false;
+
+    if(is_steady){
+        scan_scheduler.steady_windows++;
+    }else{
+        scan_scheduler.steady_windows = 0;
+    }
+
+    level = SCAN_PROFILE_ALERT;
+    if(g_config.is_adaptive_scan){
+        level = scan_scheduler.steady_windows / g_config.scan_steady_windows;
+        if(level > SCAN_PROFILE_IDLE){
+            level = SCAN_PROFILE_IDLE;
+        }
+    }
+
+    if(level != scan_scheduler.level){
+#ifdef Debugging
+        zlog_debug(category_debug,
+                   "Scan profile:  change from [%s] to [%s] after %d " \
+                   "steady windows",
+                   scan_profiles[scan_scheduler.level].name,
+                   scan_profiles[level].name,
+                   scan_scheduler.steady_windows);
+#endif
+        scan_scheduler.level = level;
+        scan_scheduler.is_level_changed = true;
+        scan_scheduler.level_changes++;
+    }
+}
+
+
+/* A static function to write the commands applying the scan profile of
+   the current level. */
+static ErrorCode submit_scan_profile(int socket, bool is_scanning){
+    const ScanProfile *profile = &scan_profiles[scan_scheduler.level];
+    le_set_scan_parameters_cp scan_parameters_cp;
+    le_set_scan_enable_cp scan_disable_cp;
+    le_set_scan_enable_cp scan_enable_cp;
+
+    memset(&scan_parameters_cp, 0, sizeof(scan_parameters_cp));
+    scan_parameters_cp.type = profile->type;
+    scan_parameters_cp.interval = htobs(profile->interval);
+    scan_parameters_cp.window = htobs(profile->window);
+    scan_parameters_cp.own_bdaddr_type = 0x00;
+    scan_parameters_cp.filter = 0x00;
+
+    memset(&scan_disable_cp, 0, sizeof(scan_disable_cp));
+    scan_disable_cp.enable = 0x00;
+    scan_disable_cp.filter_dup = 0x00;
+
+    memset(&scan_enable_cp, 0, sizeof(scan_enable_cp));
+    scan_enable_cp.enable = 0x01;
+    scan_enable_cp.filter_dup = profile->filter_dup;
+
+    scan_scheduler.is_level_changed = false;
+
+    /* The commands complete in the order they are written */
+    if(is_scanning &&
+       WORK_SUCCESSFULLY != submit_hci_command(
+           &hci_command_queue, socket, OGF_LE_CTL,
+           OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE,
+           &scan_disable_cp, HCI_SEND_REQUEST_TIMEOUT_IN_MS,
+           log_hci_command_failure,
+           "Error disabling BLE scanning")){
+        return E_SCAN_SET_ENABLE;
+    }
+
+    if(WORK_SUCCESSFULLY != submit_hci_command(
+           &hci_command_queue, socket, OGF_LE_CTL,
+           OCF_LE_SET_SCAN_PARAMETERS, LE_SET_SCAN_PARAMETERS_CP_SIZE,
+           &scan_parameters_cp, HCI_SEND_REQUEST_TIMEOUT_IN_MS,
+           log_hci_command_failure,
+           "Error setting parameters of BLE scanning")){
+        return E_SET_BLE_PARAMETER;
+    }
+
+    if(WORK_SUCCESSFULLY != submit_hci_command(
+           &hci_command_queue, socket, OGF_LE_CTL,
+           OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE,
+           &scan_enable_cp, HCI_SEND_REQUEST_TIMEOUT_IN_MS,
+           log_hci_command_failure,
+           "Error enabling BLE scanning")){
+        return E_SCAN_SET_ENABLE;
+    }
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+/* A static function to export the LBeacon table and the association to
+   the readers of the shared memory segment. */
+static void publish_lbeacon_export(long long now){
+    ExportedLBeacon *exported;
+    int associated_index;
+    int index;
+    int i;
+
+    if(NULL == lbeacon_export){
+        return;
+    }
+
+    associated_index = lbeacon_table_lookup(&lbeacon_table, &lbeacon_uuid);
+
+    begin_lbeacon_export_update(lbeacon_export);
+
+    lbeacon_export->update_time = now;
+    lbeacon_export->association = lbeacon_uuid;
+    lbeacon_export->is_associated =
+        (scan_statistics.association_changes > 0);
+    lbeacon_export->associated_rssi =
+        (associated_index != -1) ?
+        estimate_lbeacon_rssi(associated_index, now) : LBEACON_RSSI_NONE;
+    lbeacon_export->association_time = association_time;
+    lbeacon_export->association_changes =
+        scan_statistics.association_changes;
+    lbeacon_export->scan_profile_level = scan_scheduler.level;
+
+    /* The strongest LBeacon is at the top of the heap */
+    lbeacon_export->num_lbeacons = lbeacon_table.heap_size;
+    if(lbeacon_export->num_lbeacons > MAX_EXPORTED_LBEACONS){
+        lbeacon_export->num_lbeacons = MAX_EXPORTED_LBEACONS;
     }
 
-failed:
-    snprintf(buf, buf_len, NULL);
+    for(i = 0 ; i < lbeacon_export->num_lbeacons ; i++){
+        index = lbeacon_table.heap[i];
+        exported = &lbeacon_export->lbeacons[i];
 
-    return E_PARSE_UUID;
+        exported->uuid = lbeacon_table.uuids[index];
+        exported->rssi = estimate_lbeacon_rssi(index, now);
+        exported->count = lbeacon_table.counts[index];
+        exported->last_seen_time = lbeacon_table.last_seen_times[index];
+    }
+
+    end_lbeacon_export_update(lbeacon_export);
 }
 
 
-ErrorCode *start_ble_scanning(void *param){
-    /* A buffer for the callback event */
-    uint8_t ble_buffer[HCI_MAX_EVENT_SIZE];
-    int socket = 0; /* socket number */
-    int dongle_device_id = 0; /* dongle id */
-    int ret, status;
+/* A static function to advertise the coordinates of a new association
+   without stopping scanning. */
+static void advertise_changed_association(){
+
+    if(g_config.is_live_advertising_update &&
+       WORK_SUCCESSFULLY == enable_advertising(
+           g_config.advertise_dongle_id,
+           INTERVAL_ADVERTISING_IN_MS,
+           &lbeacon_uuid,
+           MAJOR_VER,
+           MINOR_VER,
+           g_config.advertise_rssi_value)){
+
+        is_lbeacon_changed = false;
+    }
+}
+
+
+/* A static function to open a scanning dongle and enable scanning on
+   it. */
+static ErrorCode open_scanner(Scanner *scanner){
     struct hci_filter new_filter; /* Filter for controlling the events*/
-    evt_le_meta_event *meta;
-    le_advertising_info *info;
     le_set_event_mask_cp event_mask_cp;
+    bool is_kernel_filter_attached;
     int retry_time = 0;
-    struct hci_request scan_params_rq;
-    struct hci_request set_mask_rq;
-    /* Time interval is 0.625ms */
-    uint16_t interval = htobs(0x01E0); /* 480*0.625ms = 300ms */
-    uint16_t window = htobs(0x01E0); /* 480*0.625ms = 300ms */
-    int i=0;
-    char address[LENGTH_OF_MAC_ADDRESS];
-    char name[LENGTH_OF_DEVICE_NAME];
-    int rssi;
-    char uuid[LENGTH_OF_UUID];
-    int time_start = get_system_time();
-    int lbeacon_index;
-    int best_index;
-    int best_rssi;
-    int num_LBeacons = -1;
-    int associated_index = -1;
+    int i;
 
-    memset(LBeacon, 0, sizeof(LBeacon));
+    retry_time = SOCKET_OPEN_RETRY;
+    while(retry_time--){
+        scanner->socket = hci_transport->open_dev(scanner->dongle_device_id);
 
+        if(scanner->socket >= 0){
+            break;
+        }
+    }
+    if (scanner->socket < 0) {
+        zlog_error(category_health_report,
+                   "Error openning socket of dongle [%d]",
+                   scanner->dongle_device_id);
 #ifdef Debugging
-    zlog_debug(category_debug, ">> start_ble_scanning... ");
+        zlog_error(category_debug,
+                   "Error openning socket of dongle [%d]",
+                   scanner->dongle_device_id);
 #endif
+         return E_OPEN_SOCKET;
+    }
 
-    while(true == ready_to_work){
-        retry_time = DONGLE_GET_RETRY;
-        while(retry_time--){
-            dongle_device_id = hci_get_route(NULL);
+    /* Pass the completion of the commands of the socket besides the
+       advertising reports */
+    hci_filter_clear(&new_filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &new_filter);
+    hci_filter_set_event(EVT_LE_META_EVENT, &new_filter);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &new_filter);
+    hci_filter_set_event(EVT_CMD_STATUS, &new_filter);
 
-            if(dongle_device_id >= 0){
-                break;
-            }
-        }
+    if (0 > hci_transport->set_filter(scanner->socket, &new_filter) ) {
+        hci_transport->close_dev(scanner->socket);
+        scanner->socket = -1;
 
-        if (dongle_device_id < 0) {
-            zlog_error(category_health_report,
-                       "Error openning the device");
+        zlog_error(category_health_report,
+                   "Error setting HCI filter");
 #ifdef Debugging
-            zlog_error(category_debug,
-                       "Error openning the device");
+        zlog_error(category_debug,
+                   "Error setting HCI filter");
 #endif
-            return E_OPEN_DEVICE;
-        }
+        return E_SCAN_SET_HCI_FILTER;
+    }
 
-        retry_time = SOCKET_OPEN_RETRY;
-        while(retry_time--){
-            socket = hci_open_dev(dongle_device_id);
+    /* Drop advertisements of other devices in the kernel. If the filter
+       cannot be attached, they are still rejected when the reports are
+       parsed. */
+    is_kernel_filter_attached =
+        (WORK_SUCCESSFULLY == attach_lbeacon_filter(scanner->socket));
 
-            if(socket >= 0){
-                break;
-            }
-        }
-        if (socket < 0) {
-            zlog_error(category_health_report,
-                       "Error openning socket");
+    if(false == is_kernel_filter_attached){
+        scan_statistics.is_kernel_filter_attached = false;
+
+        zlog_warn(category_health_report,
+                  "Unable to attach socket filter: %s",
+                  strerror(errno));
 #ifdef Debugging
-            zlog_error(category_debug,
-                       "Error openning socket");
+        zlog_warn(category_debug,
+                  "Unable to attach socket filter: %s",
+                  strerror(errno));
 #endif
-             return E_OPEN_SOCKET;
-        }
-
-        if( 0> hci_le_set_scan_parameters(socket, 0x01, interval,
-                                          window, 0x00, 0x00,
-                                          HCI_SEND_REQUEST_TIMEOUT_IN_MS)){
+    }
 
-            zlog_error(category_health_report,
-                       "Error setting parameters of BLE scanning");
+    scanner->controller_events = 0;
+    hci_transport->get_event_count(scanner->dongle_device_id,
+                                   scanner->socket,
+                                   &scanner->controller_events);
+    scanner->delivered_events =
+        get_hci_reader_counter(&scanner->reader.received_events);
+
+    /* Drain the socket on the reader thread, which wakes the event loop
+       up through its notification file descriptor */
+    if(WORK_SUCCESSFULLY != start_hci_reader(&scanner->reader,
+                                             scanner->socket)){
+        zlog_error(category_health_report,
+                   "Error starting HCI reader: %s", strerror(errno));
 #ifdef Debugging
-            zlog_error(category_debug,
-                       "Error setting parameters of BLE scanning");
+        zlog_error(category_debug,
+                   "Error starting HCI reader: %s", strerror(errno));
 #endif
+        hci_transport->close_dev(scanner->socket);
+        scanner->socket = -1;
+        return E_START_THREAD;
+    }
 
-        }
+    /* Configure and enable scanning with the profile of the current level
+       without waiting for the controller. The completions are read by the
+       event loop. */
+    memset(&event_mask_cp, 0, sizeof(le_set_event_mask_cp));
+
+    for (i = 0 ; i < 8 ; i++ ){
+        event_mask_cp.mask[i] = 0xFF;
+    }
 
-        if( 0> hci_le_set_scan_enable(socket, 1, 0,
-                                      HCI_SEND_REQUEST_TIMEOUT_IN_MS)){
+    if(WORK_SUCCESSFULLY != submit_scan_profile(scanner->socket, false) ||
+       WORK_SUCCESSFULLY != submit_hci_command(
+           &hci_command_queue, scanner->socket, OGF_LE_CTL,
+           OCF_LE_SET_EVENT_MASK, LE_SET_EVENT_MASK_CP_SIZE,
+           &event_mask_cp, HCI_SEND_REQUEST_TIMEOUT_IN_MS,
+           log_hci_command_failure,
+           "Error setting event mask of BLE scanning")){
+
+        stop_hci_reader(&scanner->reader);
+        cancel_hci_commands(&hci_command_queue, scanner->socket);
+        hci_transport->close_dev(scanner->socket);
+        scanner->socket = -1;
+        return E_SCAN_SET_EVENT_MASK;
+    }
 
-            zlog_error(category_health_report,
-                       "Error enabling BLE scanning");
+    zlog_info(category_health_report,
+              "Scanning on dongle [%d]", scanner->dongle_device_id);
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+/* A static function to stop scanning on a dongle and close it. */
+static void close_scanner(Scanner *scanner){
+    long long request_time;
+    int return_value;
+
+    /* The reader thread stops before the completion of disabling scanning
+       is read by the synchronous request below */
+    stop_hci_reader(&scanner->reader);
+
+    request_time = get_clock_time_in_us();
+    return_value = hci_transport->le_set_scan_enable(
+                       scanner->socket, 0, 0, HCI_SEND_REQUEST_TIMEOUT_IN_MS);
+    record_latency(&scan_statistics.sync_request_time_histogram,
+                   get_clock_time_in_us() - request_time);
+
+    if( 0> return_value){
+
+        zlog_error(category_health_report,
+                   "Error disabling BLE scanning");
 #ifdef Debugging
-            zlog_error(category_debug,
-                       "Error enabling BLE scanning");
+        zlog_error(category_debug,
+                   "Error disabling BLE scanning");
 #endif
+    }
+
+    cancel_hci_commands(&hci_command_queue, scanner->socket);
+    hci_transport->close_dev(scanner->socket);
+    scanner->socket = -1;
+}
+
+
+/* A static function to process the events a scanner has read. */
+static bool handle_scanner_events(Scanner *scanner){
+    /* A batch of events in the ring of the HCI reader */
+    uint8_t (*events)[HCI_MAX_EVENT_SIZE];
+    int *event_lengths;
+    long long *receive_times;
+    long long processing_delay;
+    long long decision_time;
+    uint64_t notifications;
+    int num_events;
+    int batch;
+    int i;
+
+    if(sizeof(notifications) !=
+       read(scanner->reader.notify_fd, &notifications,
+            sizeof(notifications))){
+        return true;
+    }
+
+    /* Process the events in the ring, but hand the loop back to the timer
+       and signals after a bounded number of batches. */
+    for(batch = 0 ; batch < MAX_BATCHES_PER_WAKEUP ; batch++){
+
+        num_events = peek_hci_events(&scanner->reader, HCI_EVENT_BATCH_SIZE,
+                                     &events, &event_lengths,
+                                     &receive_times);
+        if(0 == num_events){
+            break;
+        }
+
+        processing_delay = get_clock_time_in_us() - receive_times[0];
+        if(processing_delay > scan_statistics.max_processing_delay_in_us){
+            scan_statistics.max_processing_delay_in_us = processing_delay;
         }
 
-        memset(&event_mask_cp, 0, sizeof(le_set_event_mask_cp));
+        handle_advertising_events(scanner->socket, events, event_lengths,
+                                  num_events, receive_times[0]);
 
-        for (i = 0 ; i < 8 ; i++ ){
-            event_mask_cp.mask[i] = 0xFF;
+        decision_time = get_clock_time_in_us();
+        for(i = 0 ; i < num_events ; i++){
+            record_latency(&scan_statistics.report_decision_delay_histogram,
+                           decision_time - receive_times[i]);
         }
 
-        set_mask_rq = ble_hci_request(OCF_LE_SET_EVENT_MASK,
-                                      LE_SET_EVENT_MASK_CP_SIZE,
-                                      &status, &event_mask_cp);
+        release_hci_events(&scanner->reader, num_events);
+    }
+
+    /* Wake up again for the events left in the ring */
+    notifications = 1;
+    if(MAX_BATCHES_PER_WAKEUP == batch &&
+       sizeof(notifications) !=
+       write(scanner->reader.notify_fd, &notifications,
+             sizeof(notifications))){
+        return false;
+    }
+
+    return false == is_hci_reader_broken(&scanner->reader);
+}
+
+
+/* A static function to collect the event counters of a scanner at the
+   end of a scan window. */
+static void count_scanner_events(Scanner *scanner){
+    unsigned long long previous_controller_events;
+    uint32_t read_calls;
+    uint32_t received_events;
+    uint32_t dropped_events;
+    uint32_t max_used_slots;
+    uint32_t delivered_events;
+
+    read_calls = get_hci_reader_counter(&scanner->reader.read_calls);
+    received_events =
+        get_hci_reader_counter(&scanner->reader.received_events);
+    dropped_events = get_hci_reader_counter(&scanner->reader.dropped_events);
+    max_used_slots = get_hci_reader_counter(&scanner->reader.max_used_slots);
+
+    /* The counters of the reader wrap around, so their differences since
+       the previous scan window are added up */
+    scan_statistics.read_calls +=
+        (uint32_t)(read_calls - scanner->counted_read_calls);
+    scan_statistics.events +=
+        (uint32_t)(received_events - scanner->counted_events);
+    scan_statistics.ring_dropped_events +=
+        (uint32_t)(dropped_events - scanner->counted_dropped_events);
+    if(max_used_slots > scan_statistics.max_ring_usage){
+        scan_statistics.max_ring_usage = max_used_slots;
+    }
+
+    scanner->counted_read_calls = read_calls;
+    scanner->counted_events = received_events;
+    scanner->counted_dropped_events = dropped_events;
+
+    /* Events delivered by the controller but not read from the socket
+       were dropped by the socket filter */
+    delivered_events = received_events - scanner->delivered_events;
+    previous_controller_events = scanner->controller_events;
+    if(0 == hci_transport->get_event_count(scanner->dongle_device_id,
+                                           scanner->socket,
+                                           &scanner->controller_events) &&
+       scanner->controller_events - previous_controller_events >
+       delivered_events){
+
+        scan_statistics.kernel_filtered_events +=
+            (scanner->controller_events - previous_controller_events) -
+            delivered_events;
+    }
+    scanner->delivered_events = received_events;
+}
+
+
+/* A static function to start the timer closing scan windows of the
+   current length, and to return the time the first window starts. */
+static long long arm_scan_window_timer(){
+    struct itimerspec window_timer;
+
+    memset(&window_timer, 0, sizeof(window_timer));
+    window_timer.it_value.tv_sec = g_config.scan_timeout_in_ms / 1000;
+    window_timer.it_value.tv_nsec =
+        (g_config.scan_timeout_in_ms % 1000) * 1000000L;
+    window_timer.it_interval = window_timer.it_value;
+    timerfd_settime(timer_fd, 0, &window_timer, NULL);
+
+    return get_clock_time_in_us();
+}
+
+
+static bool handle_config_watch_events(){
+    char buffer[CONFIG_WATCH_BUFFER_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    ssize_t length;
+    char *position;
+    bool is_config_changed = false;
+
+    while(0 < (length = read(config_watch_fd, buffer, sizeof(buffer)))){
+        for(position = buffer ; position < buffer + length ;
+            position += sizeof(struct inotify_event) + event->len){
 
-        ret = hci_send_req(socket, &set_mask_rq,
-                           HCI_SEND_REQUEST_TIMEOUT_IN_MS);
+            event = (struct inotify_event *)position;
 
-        if ( ret < 0 ) {
-            hci_close_dev(socket);
-            return E_SCAN_SET_EVENT_MASK;
+            /* Other files in the directory are of no interest */
+            if(event->len > 0 && 0 == strcmp(event->name, CONFIG_BASE_NAME)){
+                is_config_changed = true;
+            }
         }
+    }
+
+    /* Editors may write the file several times, which is read once */
+    if(false == is_config_changed){
+        return false;
+    }
 
-        hci_filter_clear(&new_filter);
-        hci_filter_set_ptype(HCI_EVENT_PKT, &new_filter);
-        hci_filter_set_event(EVT_LE_META_EVENT, &new_filter);
+    return reload_config();
+}
 
-        if (0 > setsockopt(socket, SOL_HCI, HCI_FILTER, &new_filter,
-                           sizeof(new_filter)) ) {
-            hci_close_dev(socket);
 
-            zlog_error(category_health_report,
-                       "Error setting HCI filter");
+ErrorCode *start_ble_scanning(void *param){
+    int dongle_device_id = 0; /* dongle id */
+    int retry_time = 0;
+    int i=0;
+    int j;
+    struct epoll_event ready_events[MAX_EPOLL_EVENTS];
+    int num_ready;
+    struct itimerspec window_timer;
+    uint64_t expirations;
+    long long window_in_us;
+    long long window_deadline;
+    long long window_close_latency;
+    long long window_close_time;
+    struct signalfd_siginfo signal_info;
+    bool is_session_broken;
+
 #ifdef Debugging
-            zlog_error(category_debug,
-                       "Error setting HCI filter");
+    zlog_debug(category_debug, ">> start_ble_scanning... ");
+#endif
+
+    /* The scan window is closed by a periodic timer, so that the window
+       ends on time even if no advertisement arrives. */
+    window_in_us = g_config.scan_timeout_in_ms * 1000LL;
+    window_deadline = arm_scan_window_timer();
+
+    while(true == ready_to_work){
+
+        scan_statistics.is_kernel_filter_attached = true;
+
+        for(j = 0 ; j < num_scanners ; j++){
+
+            dongle_device_id = g_config.scan_dongle_ids[j];
+
+            if(DEFAULT_SCAN_DONGLE_ID == dongle_device_id){
+                retry_time = DONGLE_GET_RETRY;
+                while(retry_time--){
+                    dongle_device_id = hci_transport->get_route();
+
+                    if(dongle_device_id >= 0){
+                        break;
+                    }
+                }
+            }
+
+            if (dongle_device_id < 0) {
+                zlog_error(category_health_report,
+                           "Error openning the device");
+#ifdef Debugging
+                zlog_error(category_debug,
+                           "Error openning the device");
 #endif
+                while(j-- > 0){
+                    close_scanner(&scanners[j]);
+                }
+                return E_OPEN_DEVICE;
+            }
+
+            /* Both roles on one radio compete for airtime */
+            if(dongle_device_id == g_config.advertise_dongle_id){
+                zlog_warn(category_health_report,
+                          "Scanning and advertising share dongle [%d]",
+                          dongle_device_id);
+            }
+
+            scanners[j].dongle_device_id = dongle_device_id;
+
+            /* The reason is logged by open_scanner */
+            if(WORK_SUCCESSFULLY != open_scanner(&scanners[j])){
+                while(j-- > 0){
+                    close_scanner(&scanners[j]);
+                }
+                return E_OPEN_SOCKET;
+            }
         }
 
+        is_session_broken = false;
+
         while(true == ready_to_work &&
-              HCI_EVENT_HDR_SIZE <=
-              read(socket, ble_buffer, sizeof(ble_buffer))){
+              false == is_lbeacon_changed &&
+              false == is_session_broken){
+
+            /* Wake up when the earliest pending command times out */
+            num_ready = epoll_wait(epoll_fd, ready_events,
+                                   MAX_EPOLL_EVENTS,
+                                   get_hci_command_timeout_in_ms(
+                                       &hci_command_queue,
+                                       get_clock_time_in_us()));
+
+            if(num_ready < 0){
+                if(EINTR == errno){
+                    continue;
+                }
+                break;
+            }
 
-            meta = (evt_le_meta_event*)
-                (ble_buffer + HCI_EVENT_HDR_SIZE + 1);
+            for(i = 0 ; i < num_ready ; i++){
 
-            if(EVT_LE_ADVERTISING_REPORT != meta->subevent){
-                continue;
-            }
+                for(j = 0 ; j < num_scanners ; j++){
+                    if(scanners[j].reader.notify_fd ==
+                       ready_events[i].data.fd){
+                        break;
+                    }
+                }
+
+                if(j < num_scanners){
 
-            info = (le_advertising_info *)(meta->data + 1);
+                    if(false == handle_scanner_events(&scanners[j])){
+                        is_session_broken = true;
+                    }
 
-            rssi = (signed char)info->data[info->length];
+                }else if(advertiser.device_handle ==
+                         ready_events[i].data.fd){
 
-            if(rssi > g_config.scan_rssi_coverage){
-                ba2str(&info->bdaddr, address);
-                strcat(address, "\0");
+                    handle_advertiser_events();
 
-                memset(uuid, 0, sizeof(uuid));
+                }else if(timer_fd == ready_events[i].data.fd){
 
-                if(WORK_SUCCESSFULLY == eir_parse_uuid(info->data,
-                                                       info->length,
-                                                       uuid,
-                                                       sizeof(uuid) - 1)){
+                    if(sizeof(expirations) !=
+                       read(timer_fd, &expirations, sizeof(expirations))){
+                        continue;
+                    }
 
-                    if(0 == strncmp(uuid, "000000", 6)){
-#ifdef Debugging
-                        zlog_debug(category_debug,
-                                   "Detected LBeacon  %s, uuid=[%s], rssi=%d",
-                                   address, uuid, rssi);
-#endif
-                        lbeacon_index = -1;
-                        for(int i = 0 ; i <= num_LBeacons ; i++){
-                            if(0 == strncmp(LBeacon[i].uuid, uuid,
-                                            LENGTH_OF_UUID)){
-                                lbeacon_index = i;
-                                LBeacon[i].avg_rssi =
-                                    (LBeacon[i].avg_rssi *
-                                     LBeacon[i].count + rssi) /
-                                    (LBeacon[i].count + 1);
-                                LBeacon[i].count++;
-                                break;
+                    /* Measure how late the window is closed against the
+                       latest timer expiration */
+                    window_deadline += expirations * window_in_us;
+                    window_close_latency = get_clock_time_in_us() -
+                                           window_deadline;
+
+                    scan_statistics.windows++;
+                    scan_statistics.total_window_close_latency_in_us +=
+                        window_close_latency;
+                    if(window_close_latency >
+                       scan_statistics.max_window_close_latency_in_us){
+                        scan_statistics.max_window_close_latency_in_us =
+                            window_close_latency;
+                    }
+
+                    /* The counters of the readers are summed up over all
+                       the scanners */
+                    for(j = 0 ; j < num_scanners ; j++){
+                        count_scanner_events(&scanners[j]);
+                    }
+
+                    window_close_time = get_clock_time_in_us();
+                    close_scan_window(window_close_time);
+                    record_latency(
+                        &scan_statistics.window_close_time_histogram,
+                        get_clock_time_in_us() - window_close_time);
+
+                    /* Set advertising up again, on the scanning session
+                       if advertising is updated live and in between
+                       sessions otherwise */
+                    if(is_advertising_failed){
+                        is_advertising_failed = false;
+                        is_lbeacon_changed = true;
+                    }
+
+                    if(g_config.metrics_interval_in_ms > 0 &&
+                       window_close_time -
+                       scan_statistics.last_metrics_dump_time >=
+                       g_config.metrics_interval_in_ms * 1000LL){
+                        dump_metrics(window_close_time);
+                    }
+
+                    /* Apply the new duty cycle. If the commands cannot be
+                       written, the session starts over with it. */
+                    if(scan_scheduler.is_level_changed){
+                        for(j = 0 ; j < num_scanners ; j++){
+                            if(WORK_SUCCESSFULLY != submit_scan_profile(
+                                   scanners[j].socket, true)){
+                                is_session_broken = true;
                             }
                         }
+                    }
 
-                        if(lbeacon_index == -1 &&
-                           num_LBeacons++ < MAX_INDEX_OF_LBEACON_STRUCT){
+                }else if(config_watch_fd == ready_events[i].data.fd){
 
-                            lbeacon_index = num_LBeacons;
-                            memcpy(LBeacon[lbeacon_index].uuid, uuid,
-                                   LENGTH_OF_UUID);
-                            LBeacon[lbeacon_index].avg_rssi = rssi;
-                            LBeacon[lbeacon_index].count = 1;
-                        }
+                    /* The scanners keep running, and a new scan window
+                       starts with the new length */
+                    if(handle_config_watch_events()){
+                        window_in_us = g_config.scan_timeout_in_ms * 1000LL;
+                        window_deadline = arm_scan_window_timer();
+                    }
 
-                        if(associated_index == -1 &&
-                            0 == strncmp(LBeacon[lbeacon_index].uuid,
-                                         lbeacon_uuid, LENGTH_OF_UUID)){
+                }else if(signal_fd == ready_events[i].data.fd){
 
-                            associated_index = lbeacon_index;
-                        }
-                    } // end of if lbeacon
-                } // end of if "C1" prefix
-            } // end of if rssi is higher than threshold
-
-            if(get_system_time() - time_start >= g_config.scan_timeout){
-                if(num_LBeacons != -1){
-                    best_index = -1;
-                    best_rssi = -100;
-
-                    if(associated_index != -1 &&
-                       LBeacon[associated_index].avg_rssi <=
-                       previous_associated_avg_rssi){
-                       previous_associated_avg_rssi =
-                            LBeacon[associated_index].avg_rssi;
-#ifdef Debugging
-                        zlog_debug(category_debug,
-                                   "Scan timeout:  keep association=[%s] rssi=%d",
-                                   lbeacon_uuid, LBeacon[associated_index].avg_rssi);
-#endif
-                    }else{
-                        for(int i = 0 ; i <= num_LBeacons ; i++){
-                            if(LBeacon[i].avg_rssi > best_rssi){
-                                best_rssi = LBeacon[i].avg_rssi;
-                                best_index = i;
-                            }
+                    if(sizeof(signal_info) ==
+                       read(signal_fd, &signal_info, sizeof(signal_info))){
+
+                        shutdown_request_time = get_clock_time_in_us();
 
+                        zlog_info(category_health_report,
+                                  "Received signal [%d], stop working",
+                                  signal_info.ssi_signo);
 #ifdef Debugging
-                            zlog_debug(category_debug,
-                                       "Scan timeout:  index=[%d], " \
-                                       "lbeacon_uuid=[%s], avg_rssi=%d, "\
-                                       "count=%d",
-                                       i, LBeacon[i].uuid,
-                                       LBeacon[i].avg_rssi,
-                                       LBeacon[i].count);
+                        zlog_info(category_debug,
+                                  "Received signal [%d], stop working",
+                                  signal_info.ssi_signo);
 #endif
-                        }
+                        ready_to_work = false;
+                    }
+                }
+            }
 
-                        if(associated_index == -1 ||
-                           (associated_index != -1 &&
-                            best_index != associated_index &&
-                            LBeacon[best_index].avg_rssi -
-                            LBeacon[associated_index].avg_rssi >
-                            g_config.change_lbeacon_rssi_criteria)){
-#ifdef Debugging
-                            zlog_debug(category_debug,
-                                       "Scan timeout:  change " \
-                                       "best uuid=[%s], " \
-                                       "avg_rssi=%d, count=%d",
-                                       LBeacon[best_index].uuid,
-                                       LBeacon[best_index].avg_rssi,
-                                       LBeacon[best_index].count);
-#endif
-                            memcpy(lbeacon_uuid, LBeacon[best_index].uuid,
-                                   LENGTH_OF_UUID);
-
-                            is_lbeacon_changed = true;
-                            previous_associated_avg_rssi =
-                                LBeacon[best_index].avg_rssi;
-
-                            break;
-                        }
-                    } // end of else
-                } // end of if
-                time_start = get_system_time();
-                memset(LBeacon, 0, sizeof(LBeacon));
-                num_LBeacons = -1;
-                associated_index = -1;
+            /* The association changes at the end of a scan window, or on
+               an advertising report if decided on every report */
+            if(is_lbeacon_changed){
+                advertise_changed_association();
             }
 
-        } // end while (HCI_EVENT_HDR_SIZE)
+            if(hci_command_queue.num_pending > 0){
+                expire_hci_commands(&hci_command_queue,
+                                    get_clock_time_in_us());
+            }
 
-        if( 0> hci_le_set_scan_enable(socket, 0, 0,
-                                      HCI_SEND_REQUEST_TIMEOUT_IN_MS)){
+        } // end while (ready_to_work)
 
-            zlog_error(category_health_report,
-                       "Error disabling BLE scanning");
-#ifdef Debugging
-            zlog_error(category_debug,
-                       "Error disabling BLE scanning");
-#endif
+        for(j = 0 ; j < num_scanners ; j++){
+            close_scanner(&scanners[j]);
         }
 
-        hci_close_dev(socket);
-
         if(is_lbeacon_changed){
             break;
         }
     }
 
+    /* Disarm the timer of the scan window */
+    memset(&window_timer, 0, sizeof(window_timer));
+    timerfd_settime(timer_fd, 0, &window_timer, NULL);
+
 #ifdef Debugging
     zlog_debug(category_debug, "<< start_ble_scanning... ");
 #endif
@@ -906,12 +2327,15 @@ ErrorCode *start_ble_scanning(void *param){
 
 int main(int argc, char **argv) {
     ErrorCode return_value = WORK_SUCCESSFULLY;
-    struct sigaction sigint_handler;
+    sigset_t signal_mask;
+    struct epoll_event epoll_event;
+    int i;
 
     /*Initialize the global flag */
     ready_to_work = true;
-    memset(lbeacon_uuid, 0, sizeof(lbeacon_uuid));
-    previous_associated_avg_rssi = -100;
+    advertiser.device_handle = -1;
+    advertiser.dongle_device_id = -1;
+    memset(&lbeacon_uuid, 0, sizeof(lbeacon_uuid));
 
     /* Initialize the application log */
     if (zlog_init("../config/zlog.conf") == 0) {
@@ -964,18 +2388,190 @@ int main(int argc, char **argv) {
         return E_OPEN_FILE;
     }
 
-    /* Register handler function for SIGINT signal */
-    sigint_handler.sa_handler = ctrlc_handler;
-    sigemptyset(&sigint_handler.sa_mask);
-    sigint_handler.sa_flags = 0;
+    /* Select the transport to the bluetooth controller */
+    hci_transport = get_hci_transport(g_config.hci_transport,
+                                      &g_config.simulated_controller);
+    if(NULL == hci_transport){
+        zlog_error(category_health_report,
+                   "Unknown HCI transport [%d]", g_config.hci_transport);
+#ifdef Debugging
+        zlog_error(category_debug,
+                   "Unknown HCI transport [%d]", g_config.hci_transport);
+#endif
+        return E_INITIALIZATION_FAIL;
+    }
+
+    zlog_info(category_health_report,
+              "Using HCI transport [%s]", hci_transport->name);
+
+    return_value = init_hci_command_queue(&hci_command_queue, hci_transport);
+    if(WORK_SUCCESSFULLY != return_value){
+        zlog_error(category_health_report,
+                   "Error initializing HCI command queue");
+#ifdef Debugging
+        zlog_error(category_debug,
+                   "Error initializing HCI command queue");
+#endif
+        return E_INITIALIZATION_FAIL;
+    }
+
+    num_scanners = g_config.num_scan_dongles;
+    for(i = 0 ; i < num_scanners ; i++){
+        scanners[i].socket = -1;
+
+        return_value = init_hci_reader(&scanners[i].reader, hci_transport);
+        if(WORK_SUCCESSFULLY != return_value){
+            zlog_error(category_health_report,
+                       "Error initializing HCI reader: %s", strerror(errno));
+#ifdef Debugging
+            zlog_error(category_debug,
+                       "Error initializing HCI reader: %s", strerror(errno));
+#endif
+            return E_INITIALIZATION_FAIL;
+        }
+    }
+
+    /* Select the policy deciding when the association changes */
+    g_config.handoff_policy_config.change_criteria =
+        g_config.change_lbeacon_rssi_criteria;
+    g_config.handoff_policy_config.variance_window_in_us =
+        g_config.scan_timeout_in_ms * 1000LL;
+
+    handoff_policy = get_handoff_policy(g_config.handoff_policy,
+                                        &g_config.handoff_policy_config);
+    if(NULL == handoff_policy){
+        zlog_error(category_health_report,
+                   "Unknown or invalid handoff policy [%d]",
+                   g_config.handoff_policy);
+#ifdef Debugging
+        zlog_error(category_debug,
+                   "Unknown or invalid handoff policy [%d]",
+                   g_config.handoff_policy);
+#endif
+        return E_INITIALIZATION_FAIL;
+    }
+
+    zlog_info(category_health_report,
+              "Using handoff policy [%s]", handoff_policy->name);
+
+    /* Build the advertising payload once; only the coordinates and the
+       button state are patched when advertising starts */
+    init_advertising_data_template();
+
+    /* Allocate the table of LBeacons heard in a scan window once */
+    return_value = init_lbeacon_table(&lbeacon_table, g_config.max_lbeacons);
+    if(WORK_SUCCESSFULLY != return_value){
+        zlog_error(category_health_report,
+                   "Error initializing LBeacon table of [%d] LBeacons",
+                   g_config.max_lbeacons);
+#ifdef Debugging
+        zlog_error(category_debug,
+                   "Error initializing LBeacon table of [%d] LBeacons",
+                   g_config.max_lbeacons);
+#endif
+        return E_INITIALIZATION_FAIL;
+    }
+    set_lbeacon_aggregation(&lbeacon_table, g_config.rssi_aggregation,
+                            g_config.scan_timeout_in_ms * 1000LL,
+                            get_clock_time_in_us());
+
+    /* The first metrics cover the interval from the start */
+    scan_statistics.last_metrics_dump_time = get_clock_time_in_us();
+
+    /* The trace records of the event loop are formatted in the
+       background */
+    if(WORK_SUCCESSFULLY != init_trace_ring(&trace_ring) ||
+       WORK_SUCCESSFULLY != start_trace_flusher(&trace_ring)){
+        zlog_error(category_health_report,
+                   "Error starting trace: %s", strerror(errno));
+#ifdef Debugging
+        zlog_error(category_debug,
+                   "Error starting trace: %s", strerror(errno));
+#endif
+        return E_INITIALIZATION_FAIL;
+    }
+
+    /* The export is optional, so the Tag keeps working without it */
+    lbeacon_export = NULL;
+    if(g_config.is_lbeacon_export &&
+       WORK_SUCCESSFULLY != open_lbeacon_export(&lbeacon_export)){
+        lbeacon_export = NULL;
+
+        zlog_warn(category_health_report,
+                  "Unable to export LBeacon table: %s", strerror(errno));
+#ifdef Debugging
+        zlog_warn(category_debug,
+                  "Unable to export LBeacon table: %s", strerror(errno));
+#endif
+    }
+
+    /* Receive SIGINT and SIGTERM through a file descriptor watched by the
+       event loop of BLE scanning instead of a signal handler */
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
 
-    if (-1 == sigaction(SIGINT, &sigint_handler, NULL)) {
+    if (-1 == sigprocmask(SIG_BLOCK, &signal_mask, NULL) ||
+        -1 == (signal_fd = signalfd(-1, &signal_mask, SFD_CLOEXEC))) {
         zlog_error(category_health_report,
                    "Error registering signal handler for SIGINT");
 #ifdef Debugging
         zlog_error(category_debug,
                    "Error registering signal handler for SIGINT");
 #endif
+        return E_REG_SIG_HANDLER;
+    }
+
+    /* Create the event loop of BLE scanning, which watches the HCI reader,
+       the timer of scan windows and the signals */
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if(0 > epoll_fd || 0 > timer_fd){
+        zlog_error(category_health_report,
+                   "Error creating event loop: %s", strerror(errno));
+#ifdef Debugging
+        zlog_error(category_debug,
+                   "Error creating event loop: %s", strerror(errno));
+#endif
+        return E_INITIALIZATION_FAIL;
+    }
+
+    memset(&epoll_event, 0, sizeof(epoll_event));
+    epoll_event.events = EPOLLIN;
+    epoll_event.data.fd = timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &epoll_event);
+
+    memset(&epoll_event, 0, sizeof(epoll_event));
+    epoll_event.events = EPOLLIN;
+    epoll_event.data.fd = signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &epoll_event);
+
+    /* Reload the config file when it is written. The Tag works on without
+       reloading if the directory cannot be watched. */
+    config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(0 > config_watch_fd ||
+       0 > inotify_add_watch(config_watch_fd, CONFIG_DIRECTORY_NAME,
+                             IN_CLOSE_WRITE | IN_MOVED_TO)){
+        zlog_warn(category_health_report,
+                  "Unable to watch config file: %s", strerror(errno));
+#ifdef Debugging
+        zlog_warn(category_debug,
+                  "Unable to watch config file: %s", strerror(errno));
+#endif
+    }else{
+        memset(&epoll_event, 0, sizeof(epoll_event));
+        epoll_event.events = EPOLLIN;
+        epoll_event.data.fd = config_watch_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, config_watch_fd, &epoll_event);
+    }
+
+    for(i = 0 ; i < num_scanners ; i++){
+        memset(&epoll_event, 0, sizeof(epoll_event));
+        epoll_event.events = EPOLLIN;
+        epoll_event.data.fd = scanners[i].reader.notify_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, scanners[i].reader.notify_fd,
+                  &epoll_event);
     }
 
     while(true == ready_to_work){
@@ -983,15 +2579,51 @@ int main(int argc, char **argv) {
 
         return_value = enable_advertising(g_config.advertise_dongle_id,
                                           INTERVAL_ADVERTISING_IN_MS,
-                                          lbeacon_uuid,
+                                          &lbeacon_uuid,
                                           MAJOR_VER,
                                           MINOR_VER,
                                           g_config.advertise_rssi_value);
-        void *param;
-        start_ble_scanning(param);
+        start_ble_scanning(NULL);
+    }
+
+    /* Closing the device cancels the commands not completed yet, so the
+       controller is given the time to stop advertising first */
+    if(WORK_SUCCESSFULLY ==
+       disable_advertising(g_config.advertise_dongle_id)){
+        wait_advertiser_commands(HCI_SEND_REQUEST_TIMEOUT_IN_MS);
+    }
+    close_advertiser();
+
+    if(shutdown_request_time > 0){
+        zlog_info(category_health_report,
+                  "Tag process is stopped in %lld us",
+                  get_clock_time_in_us() - shutdown_request_time);
+#ifdef Debugging
+        zlog_info(category_debug,
+                  "Tag process is stopped in %lld us",
+                  get_clock_time_in_us() - shutdown_request_time);
+#endif
+    }
+
+    close(timer_fd);
+    close(epoll_fd);
+    close(signal_fd);
+    if(0 <= config_watch_fd){
+        close(config_watch_fd);
+    }
+
+    for(i = 0 ; i < num_scanners ; i++){
+        release_hci_reader(&scanners[i].reader);
+    }
+    release_hci_command_queue(&hci_command_queue);
 
-        disable_advertising(g_config.advertise_dongle_id);
+    if(NULL != lbeacon_export){
+        close_lbeacon_export(lbeacon_export);
     }
+    release_lbeacon_table(&lbeacon_table);
+
+    stop_trace_flusher(&trace_ring);
+    release_trace_ring(&trace_ring);
 
     return WORK_SUCCESSFULLY;
 }
@@ -43,8 +43,20 @@ Authors:
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <netinet/in.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <obexftp/client.h>
 #include "BeDIS.h"
+#include "HCI_Transport.h"
+#include "HCI_Command.h"
+#include "HCI_Reader.h"
+#include "LBeacon_Table.h"
+#include "Handoff_Policy.h"
+#include "LBeacon_Export.h"
+#include "Trace.h"
 #include "Version.h"
 
 /*
@@ -57,8 +69,19 @@ Authors:
 */
 //#define cmd_opcode_pack(ogf, ocf) (uint16_t)((ocf &amp; 0x03ff) | \
 //                                                        (ogf &lt;&lt; 10))
+/* The directory of the config file, watched for changes of the file, and
+   the name of the file in the directory */
+#define CONFIG_DIRECTORY_NAME "/home/pi/Tag/config"
+#define CONFIG_BASE_NAME "config.conf"
+
 /* File path of the config file of the Tag */
-#define CONFIG_FILE_NAME "/home/pi/Tag/config/config.conf"
+#define CONFIG_FILE_NAME CONFIG_DIRECTORY_NAME "/" CONFIG_BASE_NAME
+
+/* Marker of the lines of comment in the config file */
+#define CONFIG_COMMENT "#"
+
+/* Size of the buffer of events of the watched config directory */
+#define CONFIG_WATCH_BUFFER_SIZE 4096
 
 /* File path of the logging file*/
 #define LOG_FILE_NAME "/home/pi/Tag/config/zlog.conf"
@@ -72,23 +95,6 @@ Authors:
 /* The lock file for Tag  */
 #define TAG_LOCK_FILE "/home/pi/Tag/bin/Tag.pid"
 
-/* For following EIR_ constants, please refer to Bluetooth specifications for
-the defined values.
-https://www.bluetooth.com/specifications/assigned-numbers/generic-access-profile
-*/
-/* BlueZ bluetooth extended inquiry response protocol: flags */
-#define EIR_FLAGS 0X01
-
-/* BlueZ bluetooth extended inquiry response protocol: short local name */
-#define EIR_NAME_SHORT 0x08
-
-/* BlueZ bluetooth extended inquiry response protocol: complete local name */
-#define EIR_NAME_COMPLETE 0x09
-
-/* BlueZ bluetooth extended inquiry response protocol: Manufacturer Specific
-   Data */
-#define EIR_MANUFACTURE_SPECIFIC_DATA 0xFF
-
 /* Timeout in milliseconds of hci_send_req funtion */
 #define HCI_SEND_REQUEST_TIMEOUT_IN_MS 1000
 
@@ -98,43 +104,346 @@ https://www.bluetooth.com/specifications/assigned-numbers/generic-access-profile
 /* Number of characters in the name of a Bluetooth device */
 #define LENGTH_OF_DEVICE_NAME 30
 
-/* Number of characters in the uuid of a Bluetooth device */
-#define LENGTH_OF_UUID 33
-
 /* Number of characters in a Bluetooth MAC address */
 #define LENGTH_OF_MAC_ADDRESS 18
 
-/* The maximum index of LBeacon struct for comparison signal strength */
-#define MAX_INDEX_OF_LBEACON_STRUCT 50
+/* Maximum number of ready file descriptors returned by one epoll_wait */
+#define MAX_EPOLL_EVENTS 8
+
+/* Maximum number of dongles scanning at once */
+#define MAX_SCAN_DONGLES 4
+
+/* The dongle id in the config file standing for the default dongle found
+   by the HCI library */
+#define DEFAULT_SCAN_DONGLE_ID -1
+
+/* Delimiter of the dongle ids in the config file */
+#define DONGLE_ID_DELIMITER ","
+
+/* Maximum number of event batches taken from the ring of the HCI reader
+   before the event loop checks the scan window timer and signals again */
+#define MAX_BATCHES_PER_WAKEUP 8
+
+/* Maximum number of AD structures the socket filter walks in a report
+   while looking for the manufacturer specific data. Reports with more AD
+   structures are passed to the userspace check. */
+#define MAX_AD_STRUCTURES_IN_FILTER 4
+
+/* Offset of the 8 coordinate bytes in the advertising payload, which
+   follow the flags AD structure and the header of the manufacturer specific
+   data AD structure */
+#define ADVERTISING_DATA_COORDINATES_OFFSET 7
+
+/* Offset of the push-button byte in the advertising payload */
+#define ADVERTISING_DATA_BUTTON_OFFSET 15
+
+/* Number of instructions of the socket filter program */
+#define LBEACON_FILTER_LENGTH (20 + 6 * MAX_AD_STRUCTURES_IN_FILTER)
+
+/* The highest variance in dB squared of the RSSI samples of the associated
+   LBeacon in a scan window for the window to count as steady */
+#define SCAN_PROFILE_MAX_RSSI_VARIANCE 16
 
 /*
   TYPEDEF STRUCTS
 */
-typedef struct LBeacon_data {
-   char uuid[LENGTH_OF_UUID];
-   int avg_rssi;
-   int count;
-} LBeacon_data;
 
-LBeacon_data LBeacon[MAX_INDEX_OF_LBEACON_STRUCT];
-int index_LBeacon = -1;
+/* Counters of the ingestion path of the BLE scanning */
+typedef struct ScanStatistics {
+
+    /* Number of read system calls on the HCI socket */
+    unsigned long long read_calls;
+
+    /* Number of HCI events returned by the read system calls */
+    unsigned long long events;
+
+    /* Number of HCI events dropped because the ring of the HCI reader is
+       full, and the highest number of events waiting in the ring */
+    unsigned long long ring_dropped_events;
+    unsigned long long max_ring_usage;
+
+    /* Delay between reading events from the socket and processing them */
+    long long max_processing_delay_in_us;
+
+    /* Number of advertising reports carried by the HCI events */
+    unsigned long long reports;
+
+    /* Number of advertising reports rejected by the userspace check of
+       the LBeacon signature */
+    unsigned long long rejected_reports;
+
+    /* Whether the socket filter dropping advertisements of other devices
+       is attached in the kernel */
+    bool is_kernel_filter_attached;
+
+    /* Number of events dropped by the socket filter, estimated from the
+       event counter of the controller */
+    unsigned long long kernel_filtered_events;
+
+    /* Number of scan windows closed */
+    unsigned long long windows;
+
+    /* Delay between the end of scan windows and closing them */
+    long long total_window_close_latency_in_us;
+    long long max_window_close_latency_in_us;
+
+    /* Number of association changes */
+    unsigned long long association_changes;
+
+    /* Number of association changes to a LBeacon which has become
+       stronger than the associated LBeacon */
+    unsigned long long handoffs;
+
+    /* Delay between the estimate of the new LBeacon rising above the one
+       of the associated LBeacon and the association change */
+    long long total_handoff_latency_in_us;
+    long long max_handoff_latency_in_us;
+
+    /* Time spent closing scan windows, and delay between reading events
+       from the socket and the end of the association decisions on their
+       reports, since the last dump of the metrics */
+    LatencyHistogram window_close_time_histogram;
+    LatencyHistogram report_decision_delay_histogram;
+
+    /* Time spent in the synchronous requests of the scanners, which wait
+       for their completion unlike the commands of the command queue, since
+       the last dump of the metrics */
+    LatencyHistogram sync_request_time_histogram;
+
+    /* Time in micro seconds on the monotonic clock of the last dump of the
+       metrics */
+    long long last_metrics_dump_time;
+
+} ScanStatistics;
+
+/* The levels of scan duty cycle, from the highest to the lowest */
+typedef enum ScanProfileLevel {
+
+    /* Active scanning all the time, used while the association is new or
+       contested */
+    SCAN_PROFILE_ALERT = 0,
+
+    /* Passive scanning half of the time */
+    SCAN_PROFILE_NORMAL = 1,
+
+    /* Passive scanning an eighth of the time, used while the association
+       stays steady */
+    SCAN_PROFILE_IDLE = 2,
+
+    max_scan_profile_level = 3
+
+} ScanProfileLevel;
+
+/* The scan settings applied to the controller at a level of duty cycle */
+typedef struct ScanProfile {
+
+    /* Name of the profile used in log messages */
+    char *name;
+
+    /* 0x00 for passive scanning, 0x01 for active scanning */
+    uint8_t type;
+
+    /* The scan interval and scan window in units of 0.625 ms */
+    uint16_t interval;
+    uint16_t window;
+
+    /* Whether the controller reports each advertiser only once until
+       scanning is enabled again */
+    uint8_t filter_dup;
+
+} ScanProfile;
+
+/* The state of the scheduler lowering the scan duty cycle while the
+   association is steady and raising it as soon as it is not */
+typedef struct ScanScheduler {
+
+    /* The level of the profile applied to the controller */
+    ScanProfileLevel level;
+
+    /* Whether the level has changed and the profile is to be applied */
+    bool is_level_changed;
+
+    /* Whether the association has changed in the current scan window */
+    bool is_association_changed;
+
+    /* Number of consecutive steady scan windows */
+    int steady_windows;
+
+    /* Number of level changes, and number of scan windows spent at each
+       level */
+    unsigned long long level_changes;
+    unsigned long long windows_at_level[max_scan_profile_level];
+
+} ScanScheduler;
+
+/* A dongle scanning for LBeacons. The reports of all the scanners are
+   merged into one LBeacon table. */
+typedef struct Scanner {
+
+    /* The dongle the socket is opened on */
+    int dongle_device_id;
+
+    /* The HCI socket, or -1 if the socket is not open */
+    int socket;
+
+    /* The thread reading the HCI events of the socket */
+    HCIReader reader;
+
+    /* Number of events the controller has delivered, and number of events
+       read from the socket, at the end of the previous scan window */
+    unsigned long long controller_events;
+    uint32_t delivered_events;
+
+    /* The counters of the reader at the end of the previous scan window,
+       which the scan statistics are counted from */
+    uint32_t counted_read_calls;
+    uint32_t counted_events;
+    uint32_t counted_dropped_events;
+
+} Scanner;
+
+/* The advertiser of a dongle, which keeps the device open across
+   handoffs and caches what has been written to the controller, so that
+   only the HCI commands whose content changed are sent */
+typedef struct Advertiser {
+
+    /* The dongle the device handle is opened on */
+    int dongle_device_id;
+
+    /* The cached device handle, or -1 if the device is not open */
+    int device_handle;
+
+    /* The advertising parameters last written to the controller, and
+       whether they are applied, which is when their command completes */
+    bool is_parameters_written;
+    bool is_parameters_applied;
+    le_set_advertising_parameters_cp parameters;
+
+    /* The advertising data last written to the controller, and whether
+       they are applied */
+    bool is_data_written;
+    bool is_data_applied;
+    le_set_advertising_data_cp data;
+
+    /* Whether advertising is enabled by the commands last written to the
+       controller, and whether it is enabled on the controller */
+    bool is_enable_written;
+    bool is_enabled;
+
+} Advertiser;
+
+/* Type of value of a setting in the config file */
+typedef enum ConfigItemType {
+
+    /* An integer */
+    CONFIG_ITEM_INT = 0,
+
+    /* 0 or 1 */
+    CONFIG_ITEM_BOOL = 1,
+
+    /* A time parsed by parse_time_in_ms */
+    CONFIG_ITEM_TIME = 2,
+
+    /* A list of dongle ids separated by DONGLE_ID_DELIMITER */
+    CONFIG_ITEM_DONGLE_IDS = 3
+
+} ConfigItemType;
+
+/* A setting in the config file, stored into the Config struct */
+typedef struct ConfigItem {
+
+    /* The key of the setting in the config file */
+    char *key;
+
+    ConfigItemType type;
+
+    /* The offset of the field in the Config struct */
+    size_t offset;
+
+    /* The value used if the setting is missing from the config file */
+    char *default_value;
+
+    /* The range of valid values of integers and times, and of each dongle
+       id in a list */
+    int min_value;
+    int max_value;
+
+    /* Whether a changed value is applied to the running Tag when the
+       config file is reloaded, rather than after the Tag restarts */
+    bool is_reloadable;
+
+} ConfigItem;
 
 /* The configuration file structure */
 
 typedef struct Config {
     int advertise_dongle_id;
 
+    /* The dongles scanning at once, or DEFAULT_SCAN_DONGLE_ID alone for
+       the default dongle */
+    int scan_dongle_ids[MAX_SCAN_DONGLES];
+    int num_scan_dongles;
+
+    /* Whether the LBeacon table and the association are exported into
+       shared memory */
+    bool is_lbeacon_export;
+
     /* The rssi value used to advertise */
     int advertise_rssi_value;
 
     /* The required signal strength */
     int scan_rssi_coverage;
 
-    /* The time window */
-    int scan_timeout;
+    /* The time window in milliseconds */
+    int scan_timeout_in_ms;
     
     /* The criteria of changing associated lbeacon to another one */
     int change_lbeacon_rssi_criteria;
+
+    /* Maximum number of LBeacons tracked in a scan window */
+    int max_lbeacons;
+
+    /* Whether the advertising data is updated while scanning keeps
+       running, instead of restarting scanning on association changes */
+    bool is_live_advertising_update;
+
+    /* The time constant in milliseconds of the RSSI estimates */
+    int rssi_time_constant_in_ms;
+
+    /* The time in milliseconds after which a LBeacon not heard is
+       forgotten */
+    int lbeacon_stale_timeout_in_ms;
+
+    /* The way the RSSI values of each LBeacon are aggregated before the
+       association is decided */
+    RSSIAggregation rssi_aggregation;
+
+    /* The policy deciding when the Tag changes its association */
+    HandoffPolicyType handoff_policy;
+
+    /* The settings of the handoff policies. The change criteria and the
+       variance window are taken from change_lbeacon_rssi_criteria and
+       scan_timeout. */
+    HandoffPolicyConfig handoff_policy_config;
+
+    /* Whether the scan duty cycle is lowered while the association is
+       steady */
+    bool is_adaptive_scan;
+
+    /* Number of steady scan windows after which the scan duty cycle is
+       lowered by one level */
+    int scan_steady_windows;
+
+    /* Time in milliseconds between two dumps of the metrics to the health
+       report, or 0 if the metrics are not dumped */
+    int metrics_interval_in_ms;
+
+    /* The transport used to reach the bluetooth controller */
+    HCITransportType hci_transport;
+
+    /* The settings of the simulated controller used by the simulated
+       transport */
+    SimulatedControllerConfig simulated_controller;
     
 } Config;
 
@@ -163,15 +472,71 @@ extern int errno;
 /* Struct for storing config information from the input file */
 Config g_config;
 
+/* Counters of the ingestion path of the BLE scanning */
+ScanStatistics scan_statistics;
+
+/* File descriptor receiving SIGINT and SIGTERM */
+int signal_fd;
+
+/* File descriptor of the epoll instance of the BLE scanning event loop */
+int epoll_fd;
+
+/* File descriptor of the timer closing scan windows */
+int timer_fd;
+
+/* File descriptor of the inotify instance watching the config file, or -1
+   if it is not watched */
+int config_watch_fd;
+
+/* Time in micro seconds on the monotonic clock when the process is asked
+   to stop, or 0 if not yet asked */
+long long shutdown_request_time;
+
+/* The transport used for all HCI operations */
+HCITransport *hci_transport;
+
+/* The commands written to the devices and waiting for completion */
+HCICommandQueue hci_command_queue;
+
+/* The scanning dongles */
+Scanner scanners[MAX_SCAN_DONGLES];
+int num_scanners;
+
+/* The shared memory segment the LBeacon table is exported into, or NULL
+   if the export is disabled */
+LBeaconExport *lbeacon_export;
+
+/* The trace of the BLE scanning, written by the event loop */
+TraceRing trace_ring;
+
+/* The LBeacons heard in the current scan window */
+LBeaconTable lbeacon_table;
+
+/* The advertiser of the advertising dongle */
+Advertiser advertiser;
+
+/* The advertising payload built by init_advertising_data_template */
+le_set_advertising_data_cp advertising_data_template;
+
 /* UUID of LBeacon inside payload of advertising packet */
-char lbeacon_uuid[LENGTH_OF_UUID];
+LBeaconUUID lbeacon_uuid;
 
 /* Global flag to specify if UUID of LBeacon is changed */
 bool is_lbeacon_changed;
 
-/* Global variable to record the running average of RSSI values in previous
-scan window */
-int previous_associated_avg_rssi;
+/* Global flag to specify if a command of the advertiser failed, so that
+   advertising is set up again at the end of the scan window */
+bool is_advertising_failed;
+
+/* Time in micro seconds on the monotonic clock when the association
+   changed */
+long long association_time;
+
+/* The policy deciding when the Tag changes its association */
+HandoffPolicy *handoff_policy;
+
+/* The scheduler of the scan duty cycle */
+ScanScheduler scan_scheduler;
 
 /*
   FUNCTIONS
@@ -217,7 +582,10 @@ ErrorCode generate_uuid(Config *config);
 
       This function reads the specified config file line by line until the
       end of file and copies the data in the lines into the Config struct
-      global variable.
+      global variable. Each line is a setting of the form key=value, in any
+      order. Empty lines and lines starting with CONFIG_COMMENT are
+      skipped, unknown keys are warned about, and a setting missing from
+      the file takes its default value.
 
   Parameters:
       config - Pointer to config struct including file path, coordinates, etc.
@@ -226,16 +594,61 @@ ErrorCode generate_uuid(Config *config);
   Return value:
 
       ErrorCode - indicate the result of execution, the expected return code
-                  is WORK_SUCCESSFULLY
+                  is WORK_SUCCESSFULLY, or E_INPUT_PARAMETER if a value is
+                  invalid
 */
 
 ErrorCode get_config(Config *config, char *file_name);
 
+/*
+  reload_config:
+
+      This function reads the config file again and applies it to the
+      running Tag without closing the HCI sessions. Nothing is changed if
+      the file or the handoff policy is invalid. Settings which are not
+      reloadable keep their current values until the Tag restarts. A new
+      handoff policy starts from cleared scores, and a new scan duty
+      cycle is scheduled at the end of the current scan window.
+
+  Parameters:
+
+      None
+
+  Return value:
+
+      bool - true if the length of scan windows is changed, false
+             otherwise
+*/
+
+static bool reload_config();
+
+/*
+  init_advertising_data_template:
+
+      This function builds the advertising payload of the Tag, which is the
+      flags AD structure followed by the manufacturer specific data AD
+      structure. The coordinate bytes and the push-button byte are left
+      zero and are patched by enable_advertising.
+
+  Parameters:
+
+      None
+
+  Return value:
+
+      None
+*/
+
+void init_advertising_data_template();
+
 /*
   enable_advertising:
 
       This function enables the LBeacon to start advertising, sets the time
-      interval for advertising, and calibrates the RSSI value.
+      interval for advertising, and calibrates the RSSI value. Only the
+      HCI commands whose content differs from what the advertiser last
+      wrote are sent, so changing the advertised UUID while advertising
+      costs one LE Set Advertising Data command.
 
   Parameters:
 
@@ -243,7 +656,8 @@ ErrorCode get_config(Config *config, char *file_name);
                          to advertise
       advertising_interval - the time interval during which the LBeacon can
                          advertise
-      advertising_uuid - universally unique identifier of advertiser
+      advertising_uuid - universally unique identifier of the associated
+                         LBeacon, whose coordinates are advertised
       major_number - major version number of LBeacon
       minor_number - minor version number of LBeacon
       rssi_value - RSSI value of the bluetooth device
@@ -256,7 +670,7 @@ ErrorCode get_config(Config *config, char *file_name);
 
 ErrorCode enable_advertising(int dongle_device_id,
                              int advertising_interval,
-                             char *advertising_uuid,
+                             LBeaconUUID *advertising_uuid,
                              int major_number,
                              int minor_number,
                              int rssi_value);
@@ -264,7 +678,8 @@ ErrorCode enable_advertising(int dongle_device_id,
 /*
   disable_advertising:
 
-      This function disables advertising of the beacon.
+      This function disables advertising of the beacon. The device handle
+      stays cached by the advertiser.
 
   Parameters:
 
@@ -279,6 +694,150 @@ ErrorCode enable_advertising(int dongle_device_id,
 
 ErrorCode disable_advertising(int dongle_device_id);
 
+/*
+  log_hci_command_failure:
+
+      This function is the callback of the commands of the scanner, which
+      logs commands not completed successfully.
+
+  Parameters:
+
+      opcode - the opcode of the command
+      status - the status returned by the controller, or
+               HCI_COMMAND_TIMED_OUT
+      context - the message to be logged
+
+  Return value:
+
+      None
+*/
+
+static void log_hci_command_failure(uint16_t opcode,
+                                    int status,
+                                    void *context);
+
+/*
+  complete_advertiser_command:
+
+      This function is the callback of the commands of the advertiser. A
+      command completed successfully applies the setting last written
+      with its opcode, which is the setting of the command itself once
+      the commands written before complete in order. If a command is not
+      completed successfully, the device handle is closed, so that every
+      setting is written again, and advertising is set up again at the
+      end of the scan window.
+
+  Parameters:
+
+      opcode - the opcode of the command
+      status - the status returned by the controller, or
+               HCI_COMMAND_TIMED_OUT
+      context - not used
+
+  Return value:
+
+      None
+*/
+
+static void complete_advertiser_command(uint16_t opcode,
+                                        int status,
+                                        void *context);
+
+/*
+  send_advertiser_command:
+
+      This function writes one LE controller command through the device
+      handle cached by the advertiser without waiting for its completion,
+      and closes the handle if the command cannot be written.
+
+  Parameters:
+
+      ocf - the opcode command field of the command
+      clen - the length in number of bytes of the command parameters
+      cparam - the command parameters
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+static ErrorCode send_advertiser_command(uint16_t ocf,
+                                         int clen,
+                                         void *cparam);
+
+/*
+  handle_advertiser_events:
+
+      This function reads the events queued on the device of the
+      advertiser, which are the completions of its commands.
+
+  Parameters:
+
+      None
+
+  Return value:
+
+      None
+*/
+
+static void handle_advertiser_events();
+
+/*
+  wait_advertiser_commands:
+
+      This function reads the completions of the commands of the
+      advertiser outside of the event loop, until no command is pending or
+      the timeout passes.
+
+  Parameters:
+
+      timeout_in_ms - the longest time to wait
+
+  Return value:
+
+      None
+*/
+
+static void wait_advertiser_commands(int timeout_in_ms);
+
+/*
+  open_advertiser:
+
+      This function opens the device of the advertiser, or reuses the
+      cached handle if the device is already open. A newly opened device is
+      added to the epoll set of the BLE scanning event loop.
+
+  Parameters:
+
+      dongle_device_id - the bluetooth dongle device used to advertise
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+static ErrorCode open_advertiser(int dongle_device_id);
+
+/*
+  close_advertiser:
+
+      This function closes the device handle cached by the advertiser and
+      forgets the settings applied to the controller. It does not disable
+      advertising.
+
+  Parameters:
+
+      None
+
+  Return value:
+
+      None
+*/
+
+void close_advertiser();
+
 /*
   ble_hci_request:
 
@@ -306,15 +865,15 @@ const struct hci_request ble_hci_request(uint16_t ocf,
 /*
   eir_parse_uuid:
 
-      This function parses the uuid from bluetooth BLE device
+      This function parses the uuid from bluetooth BLE device, if the
+      device is a LBeacon
 
   Parameters:
 
       eir - the data member of the advertising information result
             from bluetooth BLE scan result
       eir_len - the length in number of bytes of the eir argument
-      buf - the output buffer to receive the parsing result
-      buf_len - the length in number of bytes of the buf argument
+      uuid - the output buffer to receive the UUID in binary form
 
   Return value:
 
@@ -324,20 +883,363 @@ const struct hci_request ble_hci_request(uint16_t ocf,
 
 static ErrorCode eir_parse_uuid(uint8_t *eir,
                                 size_t eir_len,
-                                char *buf,
-                                size_t buf_len);
+                                LBeaconUUID *uuid);
+
+/*
+  attach_lbeacon_filter:
+
+      This function attaches a classic BPF socket filter to the HCI socket
+      which drops, in the kernel, LE advertising report events that do not
+      carry the LBeacon signature. Other events and events packing several
+      reports are passed to the userspace check.
+
+  Parameters:
+
+      socket - the HCI socket used for BLE scanning
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+static ErrorCode attach_lbeacon_filter(int socket);
+
+/*
+  track_advertising_report:
+
+      This function checks whether the advertising report comes from a
+      LBeacon with strong enough signal, and if so, updates the RSSI
+      estimate of the LBeacon.
+
+  Parameters:
+
+      info - one advertising report from an LE Meta event
+      now - the time in micro seconds on the monotonic clock when the
+            report is read
+
+  Return value:
+
+      None
+*/
+
+static void track_advertising_report(le_advertising_info *info,
+                                     long long now);
+
+/*
+  handle_advertising_events:
+
+      This function processes a batch of HCI events read from the socket,
+      completes the commands of the socket, and tracks every advertising
+      report carried by the LE Meta events.
+
+  Parameters:
+
+      socket - the HCI socket the events are read from
+      buffers - the HCI events
+      lengths - the length in number of bytes of each event
+      num_events - the number of events in the batch
+      now - the time in micro seconds on the monotonic clock when the
+            batch is read
+
+  Return value:
+
+      None
+*/
+
+static void handle_advertising_events(
+    int socket,
+    uint8_t buffers[][HCI_MAX_EVENT_SIZE],
+    int *lengths,
+    int num_events,
+    long long now);
+
+/*
+  estimate_lbeacon_rssi:
+
+      This function returns the RSSI value of the LBeacon the association is
+      decided on, aggregated in the way specified in the config file. The
+      sliding window of the median and the trimmed mean spans one scan
+      window.
+
+  Parameters:
+
+      index - the index of the slot of the LBeacon in the table
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      int - the RSSI value in dBm
+*/
+
+static int estimate_lbeacon_rssi(int index, long long now);
+
+/*
+  change_association:
+
+      This function associates the Tag with another LBeacon, records the
+      decision latency, and clears the handoff evidence collected against
+      the previous association.
+
+  Parameters:
+
+      association - the new LBeacon and its RSSI value the decision is
+                    made on
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      None
+*/
+
+static void change_association(HandoffCandidate *association, long long now);
+
+/*
+  decide_association_on_report:
+
+      This function compares the LBeacon of an advertising report with the
+      associated LBeacon, records since when the LBeacon is stronger, and
+      lets the handoff policy decide whether the association changes, if
+      the policy decides on advertising reports. The strongest LBeacon is
+      taken from the best and runner-up candidates kept by the table, so
+      the cost does not depend on the number of LBeacons.
+
+  Parameters:
+
+      index - the index of the slot of the LBeacon in the table
+      rssi - the RSSI value of the advertising report
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      None
+*/
+
+static void decide_association_on_report(int index, int rssi, long long now);
+
+/*
+  close_scan_window:
+
+      This function is called when the scan window timer expires. It
+      forgets the LBeacons not heard for a while, and then lets the handoff
+      policy decide whether the association changes to the LBeacon with
+      the best RSSI estimate, if the policy decides at the end of scan
+      windows. The estimates carry over to the next window.
+
+  Parameters:
+
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      None
+*/
+
+static void close_scan_window(long long now);
+
+/*
+  schedule_scan_profile:
+
+      This function is called at the end of each scan window. A window is
+      steady if the association has not changed, and the associated
+      LBeacon is heard with a low RSSI variance. After scan_steady_windows
+      steady windows, the scan duty cycle is lowered by one level, and at
+      the first window which is not steady, it goes back to the highest
+      level.
+
+  Parameters:
+
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      None
+*/
+
+static void schedule_scan_profile(long long now);
+
+/*
+  submit_scan_profile:
+
+      This function writes the commands applying the scan profile of the
+      current level to the scanning socket, without waiting for their
+      completion. Scanning is disabled first if it is running, because the
+      controller rejects new scan parameters while scanning.
+
+  Parameters:
+
+      socket - the HCI socket used for scanning
+      is_scanning - whether scanning is enabled on the socket
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+static ErrorCode submit_scan_profile(int socket, bool is_scanning);
+
+/*
+  open_scanner:
+
+      This function opens the HCI socket of a scanning dongle, starts the
+      thread reading its events, and writes the commands enabling scanning
+      with the profile of the current level.
+
+  Parameters:
+
+      scanner - the scanner, whose dongle_device_id is set
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+static ErrorCode open_scanner(Scanner *scanner);
+
+/*
+  close_scanner:
+
+      This function stops the thread reading the events of a scanner,
+      disables scanning and closes the HCI socket.
+
+  Parameters:
+
+      scanner - the scanner opened by open_scanner
+
+  Return value:
+
+      None
+*/
+
+static void close_scanner(Scanner *scanner);
+
+/*
+  handle_scanner_events:
+
+      This function processes the events in the ring of a scanner, up to a
+      bounded number of batches, and wakes the event loop up again for the
+      events left.
+
+  Parameters:
+
+      scanner - the scanner whose reader has notified the event loop
+
+  Return value:
+
+      bool - false if the socket of the scanner has failed, true otherwise
+*/
+
+static bool handle_scanner_events(Scanner *scanner);
+
+/*
+  count_scanner_events:
+
+      This function adds the counters of the reader of a scanner to the
+      scan statistics, and estimates the events dropped by the socket
+      filter since the previous scan window from the event counter of the
+      dongle.
+
+  Parameters:
+
+      scanner - the scanner
+
+  Return value:
+
+      None
+*/
+
+static void count_scanner_events(Scanner *scanner);
+
+/*
+  publish_lbeacon_export:
+
+      This function writes the LBeacons in the table and the association
+      into the shared memory segment, if the export is enabled.
+
+  Parameters:
+
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      None
+*/
+
+static void publish_lbeacon_export(long long now);
+
+/*
+  dump_metrics:
+
+      This function writes the counters of the BLE scanning and the
+      percentiles of its latencies to the health report, and clears the
+      latencies for the next interval.
+
+  Parameters:
+
+      now - the current time in micro seconds on the monotonic clock
+
+  Return value:
+
+      None
+*/
+
+static void dump_metrics(long long now);
+
+/*
+  handle_config_watch_events:
+
+      This function reads the events of the inotify instance watching the
+      directory of the config file, and reloads the config file once if it
+      has been written or replaced.
+
+  Parameters:
+
+      None
+
+  Return value:
+
+      bool - true if the length of scan windows is changed by the reload,
+             false otherwise
+*/
+
+static bool handle_config_watch_events();
+
+/*
+  advertise_changed_association:
+
+      This function swaps the advertised coordinates for the ones of the
+      newly associated LBeacon while scanning and advertising both stay
+      enabled, if the live advertising update is enabled. Otherwise, or if
+      the update fails, the scanning session ends and the main loop
+      re-applies the advertising from scratch.
+
+  Parameters:
+
+      None
+
+  Return value:
+
+      None
+*/
+
+static void advertise_changed_association();
 
 /*
   start_ble_scanning:
 
-      This function scans continuously for BLE bluetooth devices under the
-      coverage of the beacon until scanning is cancelled. To reduce the
-      traffic among BeDIS system, this function only tracks the tags with
-      our specific name. When a tag with specific name is found, this
-      function calls send_to_push_dongle to either add a new ScannedDevice
-      struct of the device to ble_object_list or update the final scan time
-      of a struct in the list.
-      [N.B. This function is executed by the main thread. ]
+      This function opens a scanner on each scanning dongle and runs the
+      event loop of BLE scanning until the association changes or the Tag
+      is asked to stop. The loop waits on epoll for the events read by the
+      HCI reader threads, the completions of the advertiser commands, the
+      timer closing scan windows, the config file watch and the signals.
+      The advertising reports of LBeacons update the LBeacon table, and the
+      association is decided by the handoff policy on every report or at
+      the end of each scan window. The scanners are reopened if a session
+      breaks, and closed before returning.
+      [N.B. This function is executed by the main thread, which processes
+      the events read from the sockets by the HCI reader threads. ]
 
   Parameters:
 
@@ -0,0 +1,117 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the unit tests of the helper functions shared by
+      the BeDIS programs: the parsing of times in the config file and the
+      memory pool. It is built and run by make check.
+
+ File Name:
+
+      Test_BeDIS.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include <assert.h>
+#include "BeDIS.h"
+
+
+/* Number of slots of the pool in the tests */
+#define TEST_NUM_SLOTS 4
+
+
+/* A static function to test the times accepted in the config file. */
+static void test_parse_time_in_ms(){
+
+    /* Seconds, as the config files before the millisecond suffix */
+    assert(2000 == parse_time_in_ms("2"));
+    assert(0 == parse_time_in_ms("0"));
+
+    /* Fractions of a second, of which only milliseconds are kept */
+    assert(750 == parse_time_in_ms("0.75"));
+    assert(1500 == parse_time_in_ms("1.5"));
+    assert(1234 == parse_time_in_ms("1.2345"));
+    assert(3000 == parse_time_in_ms("3."));
+
+    /* Milliseconds */
+    assert(250 == parse_time_in_ms("250ms"));
+    assert(0 == parse_time_in_ms("0ms"));
+
+    /* Values which are not times */
+    assert(-1 == parse_time_in_ms(""));
+    assert(-1 == parse_time_in_ms("ms"));
+    assert(-1 == parse_time_in_ms("abc"));
+    assert(-1 == parse_time_in_ms("-1"));
+    assert(-1 == parse_time_in_ms("2s"));
+    assert(-1 == parse_time_in_ms("1.5ms"));
+    assert(-1 == parse_time_in_ms("250ms5"));
+    assert(-1 == parse_time_in_ms("99999999999"));
+}
+
+
+/* A static function to test that the slots of a pool are distinct, run
+   out, and are taken again once returned. */
+static void test_mem_pool(){
+    MemoryPool pool;
+    void *slots[TEST_NUM_SLOTS];
+    int i;
+    int j;
+
+    assert(E_INPUT_PARAMETER == init_mem_pool(&pool, 0, TEST_NUM_SLOTS));
+    assert(WORK_SUCCESSFULLY == init_mem_pool(&pool, 24, TEST_NUM_SLOTS));
+
+    for(i = 0 ; i < TEST_NUM_SLOTS ; i++){
+        slots[i] = mem_pool_alloc(&pool);
+        assert(NULL != slots[i]);
+        memset(slots[i], i, 24);
+        for(j = 0 ; j < i ; j++){
+            assert(slots[i] != slots[j]);
+        }
+    }
+
+    assert(NULL == mem_pool_alloc(&pool));
+    assert(1 == pool.exhausted_allocations);
+    assert(TEST_NUM_SLOTS == pool.max_used_slots);
+
+    mem_pool_free(&pool, slots[1]);
+    assert(slots[1] == mem_pool_alloc(&pool));
+
+    for(i = 0 ; i < TEST_NUM_SLOTS ; i++){
+        mem_pool_free(&pool, slots[i]);
+    }
+    assert(0 == pool.used_slots);
+
+    release_mem_pool(&pool);
+}
+
+
+int main(){
+
+    test_parse_time_in_ms();
+    test_mem_pool();
+
+    printf("Test_BeDIS: passed\n");
+
+    return 0;
+}
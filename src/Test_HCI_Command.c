@@ -0,0 +1,393 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the unit tests of the queue of HCI commands
+      waiting for their completion: the commands are written to devices of
+      the simulated controller, the completions read from each device
+      complete the commands of that device with the same opcode, the
+      commands not completed in time expire, and the callbacks may cancel
+      the commands of a device. It is built and run by make check.
+
+ File Name:
+
+      Test_HCI_Command.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include <assert.h>
+#include "HCI_Command.h"
+
+
+/* The longest time in milliseconds the tests wait for a completion */
+#define TEST_TIMEOUT_IN_MS 5000
+
+/* The time the commands of the tests have to complete in */
+#define TEST_COMMAND_TIMEOUT_IN_MS 100
+
+
+/* A callback made by the queue */
+typedef struct TestCallback {
+
+    uint16_t opcode;
+    int status;
+    int context;
+
+} TestCallback;
+
+
+/* The queue and the devices of the tests */
+static HCICommandQueue test_queue;
+static int test_dd;
+static int other_dd;
+
+/* The callbacks made since the start of a test */
+static TestCallback callbacks[MAX_PENDING_HCI_COMMANDS];
+static int num_callbacks;
+
+/* The contexts passed to the callbacks */
+static int contexts[] = {0, 1, 2, 3, 4};
+
+
+/* A static function recording the callbacks of the commands. */
+static void record_callback(uint16_t opcode, int status, void *context){
+
+    assert(num_callbacks < MAX_PENDING_HCI_COMMANDS);
+
+    callbacks[num_callbacks].opcode = opcode;
+    callbacks[num_callbacks].status = status;
+    callbacks[num_callbacks].context = *(int *)context;
+    num_callbacks++;
+}
+
+
+/* A static function recording the callback of a command, which then
+   cancels the other commands of the device, as is done before the device
+   is closed. */
+static void cancel_on_callback(uint16_t opcode, int status, void *context){
+
+    record_callback(opcode, status, context);
+    cancel_hci_commands(&test_queue, test_dd);
+}
+
+
+/* A static function to write the command of an opcode field to a device
+   of the tests. */
+static ErrorCode submit_command(int dd,
+                                uint16_t ocf,
+                                int timeout_in_ms,
+                                HCICommandCallback callback,
+                                int context){
+    le_set_scan_enable_cp scan_enable_cp;
+
+    /* The parameters of any command are ignored by the simulated
+       controller other than those of the scan enable, which is kept
+       disabled */
+    memset(&scan_enable_cp, 0, sizeof(scan_enable_cp));
+
+    return submit_hci_command(&test_queue, dd, OGF_LE_CTL, ocf,
+                              sizeof(scan_enable_cp), &scan_enable_cp,
+                              timeout_in_ms, callback, &contexts[context]);
+}
+
+
+/* A static function to wait for the next event of a device and to read
+   it. */
+static int read_event(int dd, uint8_t event[HCI_MAX_EVENT_SIZE]){
+    struct pollfd device;
+    int length;
+
+    device.fd = dd;
+    device.events = POLLIN;
+
+    assert(1 == poll(&device, 1, TEST_TIMEOUT_IN_MS));
+    assert(1 == test_queue.transport->read_events(
+                    dd, (uint8_t (*)[HCI_MAX_EVENT_SIZE])event, &length, 1));
+
+    return length;
+}
+
+
+/* A static function to read the completions of the commands written to
+   a device, and to pass them to the queue as read from the device. */
+static void handle_completions(int dd, int num_completions){
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    int length;
+    int i;
+
+    for(i = 0 ; i < num_completions ; i++){
+        length = read_event(dd, event);
+        assert(EVT_CMD_COMPLETE == event[1]);
+        assert(handle_hci_command_event(&test_queue, dd, event, length));
+    }
+}
+
+
+/* A static function to start a test with an empty queue. */
+static void start_test(){
+
+    assert(0 == test_queue.num_pending);
+
+    test_queue.completed_commands = 0;
+    test_queue.failed_commands = 0;
+    test_queue.timed_out_commands = 0;
+    num_callbacks = 0;
+}
+
+
+/* A static function to test that the completions read from a device
+   complete the oldest commands of that device with the opcode only. */
+static void test_completion_matching(){
+    uint16_t parameters_opcode = cmd_opcode_pack(OGF_LE_CTL,
+                                                 OCF_LE_SET_SCAN_PARAMETERS);
+    uint16_t enable_opcode = cmd_opcode_pack(OGF_LE_CTL,
+                                             OCF_LE_SET_SCAN_ENABLE);
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    evt_cmd_status *command_status;
+    int length;
+
+    start_test();
+
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(test_dd, OCF_LE_SET_SCAN_PARAMETERS,
+                          TEST_TIMEOUT_IN_MS, record_callback, 1));
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(test_dd, OCF_LE_SET_SCAN_ENABLE,
+                          TEST_TIMEOUT_IN_MS, record_callback, 2));
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(other_dd, OCF_LE_SET_SCAN_PARAMETERS,
+                          TEST_TIMEOUT_IN_MS, record_callback, 3));
+    assert(2 == count_hci_commands(&test_queue, test_dd));
+    assert(1 == count_hci_commands(&test_queue, other_dd));
+
+    /* The completion of the other device leaves the command of the same
+       opcode of the device pending */
+    length = read_event(other_dd, event);
+    assert(handle_hci_command_event(&test_queue, other_dd, event, length));
+    assert(1 == num_callbacks);
+    assert(parameters_opcode == callbacks[0].opcode);
+    assert(0 == callbacks[0].status && 3 == callbacks[0].context);
+    assert(2 == count_hci_commands(&test_queue, test_dd));
+    assert(0 == count_hci_commands(&test_queue, other_dd));
+
+    /* A completion of no pending command is taken without a callback */
+    assert(handle_hci_command_event(&test_queue, other_dd, event, length));
+    assert(1 == num_callbacks);
+
+    handle_completions(test_dd, 2);
+    assert(3 == num_callbacks);
+    assert(parameters_opcode == callbacks[1].opcode &&
+           1 == callbacks[1].context);
+    assert(enable_opcode == callbacks[2].opcode &&
+           2 == callbacks[2].context);
+    assert(0 == count_hci_commands(&test_queue, test_dd));
+    assert(3 == test_queue.completed_commands);
+
+    /* A Command Status event carries the status of the command, and the
+       Command Complete event following it finds no pending command */
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(test_dd, OCF_LE_SET_SCAN_ENABLE,
+                          TEST_TIMEOUT_IN_MS, record_callback, 4));
+
+    event[0] = HCI_EVENT_PKT;
+    event[1] = EVT_CMD_STATUS;
+    event[2] = EVT_CMD_STATUS_SIZE;
+    command_status = (evt_cmd_status *)(event + 1 + HCI_EVENT_HDR_SIZE);
+    command_status->status = 0x0C;
+    command_status->ncmd = 1;
+    command_status->opcode = htobs(enable_opcode);
+    assert(handle_hci_command_event(&test_queue, test_dd, event,
+                                    1 + HCI_EVENT_HDR_SIZE +
+                                    EVT_CMD_STATUS_SIZE));
+    assert(4 == num_callbacks);
+    assert(0x0C == callbacks[3].status && 4 == callbacks[3].context);
+    assert(1 == test_queue.failed_commands);
+
+    handle_completions(test_dd, 1);
+    assert(4 == num_callbacks);
+
+    /* Other events are left to the caller */
+    event[1] = EVT_LE_META_EVENT;
+    assert(!handle_hci_command_event(&test_queue, test_dd, event,
+                                     1 + HCI_EVENT_HDR_SIZE +
+                                     EVT_CMD_STATUS_SIZE));
+}
+
+
+/* A static function to test that the commands expire at their deadline,
+   and that their late completions are ignored. */
+static void test_expiry(){
+    long long now;
+
+    start_test();
+
+    assert(-1 == get_hci_command_timeout_in_ms(&test_queue,
+                                               get_clock_time_in_us()));
+
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(test_dd, OCF_LE_SET_SCAN_PARAMETERS,
+                          3 * TEST_COMMAND_TIMEOUT_IN_MS, record_callback,
+                          1));
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(test_dd, OCF_LE_SET_SCAN_ENABLE,
+                          TEST_COMMAND_TIMEOUT_IN_MS, record_callback, 2));
+    now = get_clock_time_in_us();
+
+    /* The earliest deadline is the one of the second command */
+    assert(TEST_COMMAND_TIMEOUT_IN_MS >=
+           get_hci_command_timeout_in_ms(&test_queue, now));
+    assert(0 < get_hci_command_timeout_in_ms(&test_queue, now));
+
+    expire_hci_commands(&test_queue, now);
+    assert(0 == num_callbacks);
+
+    now += 2 * TEST_COMMAND_TIMEOUT_IN_MS * 1000LL;
+    assert(0 == get_hci_command_timeout_in_ms(&test_queue, now));
+    expire_hci_commands(&test_queue, now);
+    assert(1 == num_callbacks);
+    assert(HCI_COMMAND_TIMED_OUT == callbacks[0].status &&
+           2 == callbacks[0].context);
+    assert(1 == count_hci_commands(&test_queue, test_dd));
+
+    now += 2 * TEST_COMMAND_TIMEOUT_IN_MS * 1000LL;
+    expire_hci_commands(&test_queue, now);
+    assert(2 == num_callbacks);
+    assert(HCI_COMMAND_TIMED_OUT == callbacks[1].status &&
+           1 == callbacks[1].context);
+    assert(2 == test_queue.timed_out_commands);
+
+    handle_completions(test_dd, 2);
+    assert(2 == num_callbacks);
+    assert(0 == test_queue.completed_commands);
+}
+
+
+/* A static function to test that a callback may cancel the commands of
+   its device while the commands are expiring, and that the commands of
+   other devices expire afterwards. */
+static void test_cancel_in_callback(){
+    long long now;
+
+    start_test();
+
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(test_dd, OCF_LE_SET_SCAN_PARAMETERS,
+                          TEST_COMMAND_TIMEOUT_IN_MS, cancel_on_callback,
+                          1));
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(other_dd, OCF_LE_SET_SCAN_PARAMETERS,
+                          TEST_COMMAND_TIMEOUT_IN_MS, record_callback, 2));
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(test_dd, OCF_LE_SET_SCAN_ENABLE,
+                          TEST_COMMAND_TIMEOUT_IN_MS, record_callback, 3));
+    assert(2 == count_hci_commands(&test_queue, test_dd));
+
+    now = get_clock_time_in_us() + 2 * TEST_COMMAND_TIMEOUT_IN_MS * 1000LL;
+    expire_hci_commands(&test_queue, now);
+
+    /* The command cancelled by the first callback is never called back */
+    assert(2 == num_callbacks);
+    assert(1 == callbacks[0].context && 2 == callbacks[1].context);
+    assert(0 == count_hci_commands(&test_queue, test_dd));
+    assert(0 == count_hci_commands(&test_queue, other_dd));
+    assert(2 == test_queue.timed_out_commands);
+
+    handle_completions(test_dd, 2);
+    handle_completions(other_dd, 1);
+    assert(2 == num_callbacks);
+}
+
+
+/* A static function to test that the commands beyond the descriptors are
+   refused, and that cancelling the commands of a device frees their
+   descriptors. */
+static void test_count_and_cancel(){
+    int i;
+
+    start_test();
+
+    for(i = 0 ; i < MAX_PENDING_HCI_COMMANDS ; i++){
+        assert(WORK_SUCCESSFULLY ==
+               submit_command((i % 2) ? other_dd : test_dd,
+                              OCF_LE_SET_SCAN_PARAMETERS,
+                              TEST_TIMEOUT_IN_MS, record_callback, 0));
+    }
+    assert(E_SEND_REQUEST_TIMEOUT ==
+           submit_command(test_dd, OCF_LE_SET_SCAN_PARAMETERS,
+                          TEST_TIMEOUT_IN_MS, record_callback, 0));
+    assert(MAX_PENDING_HCI_COMMANDS / 2 ==
+           count_hci_commands(&test_queue, test_dd));
+    assert(MAX_PENDING_HCI_COMMANDS / 2 ==
+           count_hci_commands(&test_queue, other_dd));
+
+    cancel_hci_commands(&test_queue, test_dd);
+    assert(0 == count_hci_commands(&test_queue, test_dd));
+    assert(MAX_PENDING_HCI_COMMANDS / 2 ==
+           count_hci_commands(&test_queue, other_dd));
+
+    /* The descriptors are taken again */
+    assert(WORK_SUCCESSFULLY ==
+           submit_command(test_dd, OCF_LE_SET_SCAN_PARAMETERS,
+                          TEST_TIMEOUT_IN_MS, record_callback, 0));
+    assert(1 == count_hci_commands(&test_queue, test_dd));
+
+    handle_completions(test_dd, MAX_PENDING_HCI_COMMANDS / 2 + 1);
+    handle_completions(other_dd, MAX_PENDING_HCI_COMMANDS / 2);
+    assert(MAX_PENDING_HCI_COMMANDS / 2 + 1 == num_callbacks);
+    assert(0 == test_queue.num_pending);
+}
+
+
+int main(){
+    SimulatedControllerConfig config;
+    HCITransport *transport;
+
+    /* The simulated controller completes every command, and never emits
+       advertising reports since scanning is never enabled */
+    config.report_rate = 100;
+    config.num_lbeacons = 1;
+    config.reports_per_event = 1;
+    config.foreign_percentage = 0;
+    transport = get_hci_transport(HCI_TRANSPORT_SIMULATED, &config);
+
+    test_dd = transport->open_dev(SIMULATED_DONGLE_ID);
+    other_dd = transport->open_dev(SIMULATED_DONGLE_ID + 1);
+    assert(test_dd >= 0 && other_dd >= 0);
+
+    assert(WORK_SUCCESSFULLY == init_hci_command_queue(&test_queue,
+                                                       transport));
+
+    test_completion_matching();
+    test_expiry();
+    test_cancel_in_callback();
+    test_count_and_cancel();
+
+    release_hci_command_queue(&test_queue);
+    transport->close_dev(test_dd);
+    transport->close_dev(other_dd);
+
+    printf("Test_HCI_Command: passed\n");
+
+    return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the unit tests of the HCI reader: the events
+      written to one end of a socket pair are read by the reader thread
+      into the ring, the advertising reports beyond the ring are dropped
+      while the other events are forwarded into the reserved slots, and
+      the thread stops on request or on a broken device. It is built and
+      run by make check.
+
+ File Name:
+
+      Test_HCI_Reader.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include <assert.h>
+#include "HCI_Reader.h"
+
+
+/* The longest time in milliseconds the tests wait for the reader thread */
+#define TEST_TIMEOUT_IN_MS 5000
+
+/* Number of advertising reports beyond the ring in the tests */
+#define TEST_EXTRA_REPORTS 100
+
+/* Number of command completions sent while the ring is full */
+#define TEST_COMPLETIONS 4
+
+
+/* The reader of the tests, which is too large for the stack */
+static HCIReader test_reader;
+
+
+/* A static function to write an LE Meta event carrying a sequence number
+   to the controller end of the socket pair. */
+static void write_report_event(int fd, int sequence){
+    uint8_t event[6] = {HCI_EVENT_PKT, EVT_LE_META_EVENT, 3,
+                        EVT_LE_ADVERTISING_REPORT};
+
+    event[4] = (uint8_t)sequence;
+    event[5] = (uint8_t)(sequence >> 8);
+
+    assert(sizeof(event) == write(fd, event, sizeof(event)));
+}
+
+
+/* A static function to write a Command Complete event of an opcode to the
+   controller end of the socket pair. */
+static void write_command_complete(int fd, uint16_t opcode){
+    uint8_t event[7] = {HCI_EVENT_PKT, EVT_CMD_COMPLETE, 4, 1};
+
+    event[4] = (uint8_t)opcode;
+    event[5] = (uint8_t)(opcode >> 8);
+    event[6] = 0;
+
+    assert(sizeof(event) == write(fd, event, sizeof(event)));
+}
+
+
+/* A static function to wait until the reader thread has read the number
+   of events in total. */
+static void wait_for_events(HCIReader *reader, uint32_t num_events){
+    struct pollfd notify;
+    uint64_t value;
+    int waited_in_ms = 0;
+
+    notify.fd = reader->notify_fd;
+    notify.events = POLLIN;
+
+    while(get_hci_reader_counter(&reader->received_events) < num_events){
+        assert(waited_in_ms < TEST_TIMEOUT_IN_MS);
+        if(0 == poll(&notify, 1, 10)){
+            waited_in_ms += 10;
+        }
+        while(sizeof(value) ==
+              read(reader->notify_fd, &value, sizeof(value))){
+        }
+    }
+}
+
+
+/* A static function to take the events waiting in the ring, checking
+   that they are the events of the sequence numbers given, and that the
+   events of the opcodes given follow them. */
+static void check_ring(HCIReader *reader,
+                       int first_sequence,
+                       int num_reports,
+                       uint16_t first_opcode,
+                       int num_completions){
+    uint8_t (*events)[HCI_MAX_EVENT_SIZE];
+    int *lengths;
+    long long *receive_times;
+    int num_events;
+    int num_checked = 0;
+    int sequence;
+    int i;
+
+    while(0 < (num_events = peek_hci_events(reader, HCI_READER_RING_SIZE,
+                                            &events, &lengths,
+                                            &receive_times))){
+        for(i = 0 ; i < num_events ; i++, num_checked++){
+            assert(receive_times[i] > 0);
+
+            if(num_checked < num_reports){
+                sequence = events[i][4] | (events[i][5] << 8);
+                assert(6 == lengths[i]);
+                assert(EVT_LE_META_EVENT == events[i][1]);
+                assert(first_sequence + num_checked == sequence);
+            }else{
+                assert(7 == lengths[i]);
+                assert(EVT_CMD_COMPLETE == events[i][1]);
+                assert(first_opcode + num_checked - num_reports ==
+                       (events[i][4] | (events[i][5] << 8)));
+            }
+        }
+        release_hci_events(reader, num_events);
+    }
+
+    assert(num_reports + num_completions == num_checked);
+}
+
+
+/* A static function to test that the events are read in order into the
+   ring and counted. */
+static void test_read_events(HCITransport *transport){
+    HCIReader *reader = &test_reader;
+    int fds[2];
+    int i;
+
+    assert(0 == socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+    assert(WORK_SUCCESSFULLY == init_hci_reader(reader, transport));
+    assert(WORK_SUCCESSFULLY == start_hci_reader(reader, fds[0]));
+
+    /* More events than the ring holds, taken out of the ring as they
+       arrive */
+    for(i = 0 ; i < 3 * HCI_READER_RING_SIZE ; i++){
+        write_report_event(fds[1], i);
+        if(HCI_READER_RING_SIZE / 2 - 1 == i % (HCI_READER_RING_SIZE / 2)){
+            wait_for_events(reader, i + 1);
+            check_ring(reader, i + 1 - HCI_READER_RING_SIZE / 2,
+                       HCI_READER_RING_SIZE / 2, 0, 0);
+        }
+    }
+
+    assert(3 * HCI_READER_RING_SIZE ==
+           get_hci_reader_counter(&reader->received_events));
+    assert(0 == get_hci_reader_counter(&reader->dropped_events));
+    assert(0 < get_hci_reader_counter(&reader->read_calls));
+    assert(HCI_READER_RING_SIZE / 2 >=
+           get_hci_reader_counter(&reader->max_used_slots));
+
+    stop_hci_reader(reader);
+    assert(!is_hci_reader_broken(reader));
+
+    release_hci_reader(reader);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+/* A static function to test that the advertising reports beyond the
+   ring are dropped, and that the command completions read with them are
+   forwarded into the reserved slots. */
+static void test_full_ring(HCITransport *transport){
+    HCIReader *reader = &test_reader;
+    int num_reports = HCI_READER_RING_SIZE - HCI_READER_RESERVED_SLOTS;
+    int fds[2];
+    int i;
+
+    assert(0 == socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+    assert(WORK_SUCCESSFULLY == init_hci_reader(reader, transport));
+    assert(WORK_SUCCESSFULLY == start_hci_reader(reader, fds[0]));
+
+    /* The reports fill the ring up to the reserved slots */
+    for(i = 0 ; i < num_reports ; i++){
+        write_report_event(fds[1], i);
+    }
+    wait_for_events(reader, num_reports);
+
+    /* The completions are mixed with reports which no longer fit */
+    for(i = 0 ; i < TEST_EXTRA_REPORTS ; i++){
+        write_report_event(fds[1], num_reports + i);
+        if(0 == i % (TEST_EXTRA_REPORTS / TEST_COMPLETIONS)){
+            write_command_complete(fds[1],
+                                   i / (TEST_EXTRA_REPORTS /
+                                        TEST_COMPLETIONS));
+        }
+    }
+    wait_for_events(reader, num_reports + TEST_EXTRA_REPORTS +
+                            TEST_COMPLETIONS);
+
+    assert(TEST_EXTRA_REPORTS ==
+           get_hci_reader_counter(&reader->dropped_events));
+    assert(num_reports + TEST_COMPLETIONS ==
+           get_hci_reader_counter(&reader->max_used_slots));
+
+    check_ring(reader, 0, num_reports, 0, TEST_COMPLETIONS);
+
+    /* The slots released are filled again */
+    write_report_event(fds[1], 0);
+    wait_for_events(reader, num_reports + TEST_EXTRA_REPORTS +
+                            TEST_COMPLETIONS + 1);
+    check_ring(reader, 0, 1, 0, 0);
+
+    stop_hci_reader(reader);
+    release_hci_reader(reader);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+/* A static function to test that the reader thread is joined whether it
+   is asked to stop or the device breaks, and that the counters are kept
+   across restarts. */
+static void test_stop(HCITransport *transport){
+    HCIReader *reader = &test_reader;
+    uint8_t (*events)[HCI_MAX_EVENT_SIZE];
+    int *lengths;
+    long long *receive_times;
+    int fds[2];
+    int waited_in_ms = 0;
+
+    assert(0 == socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+    assert(WORK_SUCCESSFULLY == init_hci_reader(reader, transport));
+
+    /* A thread blocked on an idle device is stopped */
+    assert(WORK_SUCCESSFULLY == start_hci_reader(reader, fds[0]));
+    stop_hci_reader(reader);
+    assert(-1 == reader->dd);
+
+    /* The events left in the ring by the stopped thread are discarded */
+    write_report_event(fds[1], 0);
+    assert(WORK_SUCCESSFULLY == start_hci_reader(reader, fds[0]));
+    wait_for_events(reader, 1);
+    stop_hci_reader(reader);
+
+    assert(WORK_SUCCESSFULLY == start_hci_reader(reader, fds[0]));
+    assert(0 == peek_hci_events(reader, HCI_READER_RING_SIZE, &events,
+                                &lengths, &receive_times));
+    write_report_event(fds[1], 1);
+    wait_for_events(reader, 2);
+    assert(1 == peek_hci_events(reader, HCI_READER_RING_SIZE, &events,
+                                &lengths, &receive_times));
+
+    /* The thread stops by itself once the controller end is closed */
+    close(fds[1]);
+    while(!is_hci_reader_broken(reader)){
+        assert(waited_in_ms < TEST_TIMEOUT_IN_MS);
+        usleep(10000);
+        waited_in_ms += 10;
+    }
+    stop_hci_reader(reader);
+
+    assert(2 == get_hci_reader_counter(&reader->received_events));
+
+    release_hci_reader(reader);
+    close(fds[0]);
+}
+
+
+int main(){
+
+    /* The events of the socket pairs are read with the read function of
+       the transports, which takes any socket of sequenced packets */
+    HCITransport *transport = get_hci_transport(HCI_TRANSPORT_BLUEZ, NULL);
+
+    test_read_events(transport);
+    test_full_ring(transport);
+    test_stop(transport);
+
+    printf("Test_HCI_Reader: passed\n");
+
+    return 0;
+}
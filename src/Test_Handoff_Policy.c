@@ -0,0 +1,402 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the unit tests of the handoff policies: each
+      policy is fed a sequence of scan windows and advertising reports, and
+      the association it leads to is checked after every step. The
+      association is changed the way the tag changes it. It is built and
+      run by make check.
+
+ File Name:
+
+      Test_Handoff_Policy.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include <assert.h>
+#include "Handoff_Policy.h"
+
+
+/* Number of LBeacons the tests are run with */
+#define TEST_NUM_LBEACONS 3
+
+/* Number of slots of the table of the tests */
+#define TEST_MAX_LBEACONS 8
+
+/* Time constant of the estimator in the tests */
+#define TEST_TIME_CONSTANT_IN_US 1000000LL
+
+/* Numbers of the LBeacons in the steps of the tests */
+#define NONE -1
+#define A 0
+#define B 1
+#define C 2
+
+
+/* A step of a test, which is either the end of a scan window or an
+   advertising report */
+typedef struct HandoffStep {
+
+    /* Time in milliseconds since the start of the sequence */
+    int time_in_ms;
+
+    /* Whether the step is the end of a scan window */
+    bool is_window;
+
+    /* The RSSI value of the associated LBeacon */
+    int associated_rssi;
+
+    /* The LBeacon of the report and the RSSI value of the report, which
+       are not used at the end of a scan window */
+    int reported;
+    int report_rssi;
+
+    /* The strongest LBeacon and its RSSI value */
+    int strongest;
+    int strongest_rssi;
+
+    /* The LBeacon associated after the step */
+    int expected;
+
+} HandoffStep;
+
+
+/* The table of the tests, and the slots of the LBeacons in it */
+static LBeaconTable test_table;
+static int test_indexes[TEST_NUM_LBEACONS];
+
+/* The LBeacon associated by the steps run so far */
+static int associated_lbeacon;
+
+
+/* The settings of the tests */
+static HandoffPolicyConfig test_config = {
+    .change_criteria = 5,
+    .is_per_report_decision = true,
+    .cusum_drift = 2,
+    .cusum_threshold = 10,
+    .min_dwell_time_in_ms = 1000,
+    .variance_margin_factor = 2,
+    .variance_window_in_us = 2000000LL
+};
+
+
+/* The strongest LBeacon is taken when it is stronger by the change
+   criteria, but the window keeps the association while the associated
+   LBeacon does not get stronger */
+static const HandoffStep threshold_steps[] = {
+    {   0, true,    0, NONE,   0, A, -60, A},
+    { 100, true,  -62, NONE,   0, B, -50, A},
+    { 200, true,  -58, NONE,   0, B, -50, B},
+    { 300, false, -50, C,    -47, C, -47, B},
+    { 400, false, -50, C,    -44, C, -44, C},
+    { 500, false, -44, C,    -40, C, -40, C},
+    { 600, false, -44, A,    -39, A, -39, C},
+};
+
+/* The evidence of B accumulates by the difference less the drift, and is
+   floored at zero by a weak report, so the handoff happens only at the
+   last report of B. Without the floor the evidence would still be below
+   the threshold there. */
+static const HandoffStep cusum_steps[] = {
+    {   0, false,   0, A,    -60, A, -60, A},
+    { 100, false, -60, B,    -57, B, -57, A},
+    { 200, false, -60, B,    -55, B, -55, A},
+    { 300, false, -60, B,    -70, A, -60, A},
+    { 400, false, -60, B,    -54, B, -54, A},
+    { 500, false, -60, B,    -53, B, -53, A},
+    { 600, false, -60, A,    -60, B, -53, A},
+    { 700, false, -60, B,    -55, B, -55, B},
+    { 800, false, -55, A,    -58, B, -55, B},
+    { 900, false, -55, A,    -48, A, -48, B},
+};
+
+/* The strongest LBeacon is not taken before the association has lasted
+   for the minimum dwell time, however much stronger it is */
+static const HandoffStep dwell_steps[] = {
+    {   0, true,    0, NONE,   0, A, -60, A},
+    { 500, true,  -60, NONE,   0, B, -50, A},
+    { 999, false, -60, B,    -50, B, -50, A},
+    {1000, true,  -60, NONE,   0, B, -50, B},
+    {1500, false, -50, A,    -40, A, -40, B},
+    {2100, false, -50, A,    -47, A, -47, B},
+    {2200, false, -50, A,    -44, A, -44, A},
+};
+
+/* B varies by 4 dB around its mean and A does not at all, so B has to
+   exceed the change criteria by more than twice the square root of their
+   mean variance of 8 dB squared, i.e. by 6 dB */
+static const HandoffStep variance_steps[] = {
+    {   0, true,    0, NONE,   0, A, -60, A},
+    { 100, true,  -60, NONE,   0, B, -50, A},
+    { 200, false, -60, B,    -50, B, -50, A},
+    { 300, true,  -60, NONE,   0, B, -49, B},
+};
+
+/* The association made before a reload of the settings */
+static const HandoffStep reload_first_steps[] = {
+    {   0, true,    0, NONE,   0, A, -60, A},
+};
+
+/* The window still keeps the association weaker than before the reload */
+static const HandoffStep threshold_reload_steps[] = {
+    { 100, true,  -62, NONE,   0, B, -50, A},
+};
+
+/* The dwell time still runs from the association before the reload */
+static const HandoffStep dwell_reload_steps[] = {
+    { 500, true,  -60, NONE,   0, B, -50, A},
+    {1000, true,  -60, NONE,   0, B, -50, B},
+};
+
+
+/* A static function to make a candidate of one of the LBeacons of the
+   tests. */
+static HandoffCandidate make_candidate(int lbeacon, int rssi){
+    HandoffCandidate candidate;
+
+    candidate.index = (lbeacon == NONE) ? -1 : test_indexes[lbeacon];
+    candidate.rssi = rssi;
+
+    return candidate;
+}
+
+
+/* A static function to start a sequence of steps without association. */
+static void start_sequence(){
+
+    associated_lbeacon = NONE;
+    reset_lbeacon_handoff_state(&test_table);
+}
+
+
+/* A static function to run a sequence of steps, which starts at the
+   specified time, and to check the association after each step. */
+static void run_steps(HandoffPolicy *policy,
+                      const HandoffStep *steps,
+                      int num_steps,
+                      long long start_time){
+    HandoffCandidate associated;
+    HandoffCandidate reported;
+    HandoffCandidate strongest;
+    HandoffCandidate *association;
+    long long now;
+    int new_index;
+    int i;
+
+    for(i = 0 ; i < num_steps ; i++){
+        now = start_time + steps[i].time_in_ms * 1000LL;
+
+        associated = make_candidate(associated_lbeacon,
+                                    steps[i].associated_rssi);
+        reported = make_candidate(steps[i].reported, steps[i].report_rssi);
+        strongest = make_candidate(steps[i].strongest,
+                                   steps[i].strongest_rssi);
+        association = NULL;
+
+        if(steps[i].is_window){
+            assert(NULL != policy->decide_on_window);
+            if(policy->decide_on_window(&test_table, &associated,
+                                        &strongest, now)){
+                association = &strongest;
+            }
+        }else{
+            assert(NULL != policy->decide_on_report);
+            new_index = policy->decide_on_report(&test_table, &associated,
+                                                 &reported,
+                                                 steps[i].report_rssi,
+                                                 &strongest, now);
+            if(new_index != -1 && new_index != associated.index){
+                association = (new_index == reported.index) ?
+                              &reported : &strongest;
+            }
+        }
+
+        /* The association changes the way the tag changes it */
+        if(NULL != association){
+            associated_lbeacon = (association == &reported) ?
+                                 steps[i].reported : steps[i].strongest;
+            reset_lbeacon_handoff_state(&test_table);
+            policy->change_association(&test_table, association, now);
+        }
+
+        assert(steps[i].expected == associated_lbeacon);
+    }
+}
+
+
+/* A static function to test the sequences of steps of every policy. */
+static void test_sequences(){
+    HandoffPolicy *policy;
+    long long now = 10000000LL;
+    int i;
+
+    policy = get_handoff_policy(HANDOFF_POLICY_THRESHOLD, &test_config);
+    assert(NULL != policy);
+    start_sequence();
+    run_steps(policy, threshold_steps,
+              sizeof(threshold_steps) / sizeof(threshold_steps[0]), now);
+
+    policy = get_handoff_policy(HANDOFF_POLICY_CUSUM, &test_config);
+    assert(NULL != policy);
+    start_sequence();
+    run_steps(policy, cusum_steps,
+              sizeof(cusum_steps) / sizeof(cusum_steps[0]), now);
+
+    policy = get_handoff_policy(HANDOFF_POLICY_DWELL, &test_config);
+    assert(NULL != policy);
+    start_sequence();
+    run_steps(policy, dwell_steps,
+              sizeof(dwell_steps) / sizeof(dwell_steps[0]), now);
+
+    /* The samples heard before the sequence, within the window of the
+       variance at every step */
+    for(i = RSSI_SAMPLES_PER_LBEACON - 1 ; i >= 0 ; i--){
+        update_lbeacon_rssi(&test_table, test_indexes[A], -60,
+                            now - i * 100000LL, TEST_TIME_CONSTANT_IN_US);
+        update_lbeacon_rssi(&test_table, test_indexes[B],
+                            (i % 2) ? -46 : -54,
+                            now - i * 100000LL, TEST_TIME_CONSTANT_IN_US);
+    }
+    assert(0 == get_lbeacon_rssi_variance(&test_table, test_indexes[A], now,
+                                          test_config.variance_window_in_us));
+    assert((16 << RSSI_FRACTION_BITS) ==
+           get_lbeacon_rssi_variance(&test_table, test_indexes[B], now,
+                                     test_config.variance_window_in_us));
+
+    policy = get_handoff_policy(HANDOFF_POLICY_VARIANCE_MARGIN,
+                                &test_config);
+    assert(NULL != policy);
+    start_sequence();
+    run_steps(policy, variance_steps,
+              sizeof(variance_steps) / sizeof(variance_steps[0]), now);
+}
+
+
+/* A static function to test that selecting a policy again keeps the RSSI
+   value and the time of the association. */
+static void test_reload(){
+    HandoffPolicy *policy;
+    HandoffPolicyConfig config = test_config;
+    long long now = 20000000LL;
+
+    policy = get_handoff_policy(HANDOFF_POLICY_THRESHOLD, &config);
+    start_sequence();
+    run_steps(policy, reload_first_steps, 1, now);
+
+    config.change_criteria = 4;
+    policy = get_handoff_policy(HANDOFF_POLICY_THRESHOLD, &config);
+    assert(NULL != policy);
+    run_steps(policy, threshold_reload_steps, 1, now);
+
+    now = 30000000LL;
+    policy = get_handoff_policy(HANDOFF_POLICY_DWELL, &config);
+    start_sequence();
+    run_steps(policy, reload_first_steps, 1, now);
+
+    config.change_criteria = 5;
+    policy = get_handoff_policy(HANDOFF_POLICY_DWELL, &config);
+    assert(NULL != policy);
+    run_steps(policy, dwell_reload_steps, 2, now);
+}
+
+
+/* A static function to test the settings rejected, and the decisions
+   each policy makes. */
+static void test_get_policy(){
+    HandoffPolicy *policy;
+    HandoffPolicyConfig config;
+
+    assert(NULL == get_handoff_policy(HANDOFF_POLICY_THRESHOLD, NULL));
+    assert(NULL == get_handoff_policy(max_handoff_policy, &test_config));
+
+    config = test_config;
+    config.cusum_drift = -1;
+    assert(NULL == get_handoff_policy(HANDOFF_POLICY_CUSUM, &config));
+
+    config = test_config;
+    config.cusum_threshold = 0;
+    assert(NULL == get_handoff_policy(HANDOFF_POLICY_CUSUM, &config));
+
+    config = test_config;
+    config.min_dwell_time_in_ms = -1;
+    assert(NULL == get_handoff_policy(HANDOFF_POLICY_DWELL, &config));
+
+    config = test_config;
+    config.variance_margin_factor = -1;
+    assert(NULL == get_handoff_policy(HANDOFF_POLICY_VARIANCE_MARGIN,
+                                      &config));
+
+    config = test_config;
+    config.variance_window_in_us = 0;
+    assert(NULL == get_handoff_policy(HANDOFF_POLICY_VARIANCE_MARGIN,
+                                      &config));
+
+    /* The policies deciding at the end of scan windows decide on reports
+       only if asked to, while the CUSUM decides on reports only */
+    config = test_config;
+    config.is_per_report_decision = false;
+
+    policy = get_handoff_policy(HANDOFF_POLICY_THRESHOLD, &config);
+    assert(NULL != policy->decide_on_window);
+    assert(NULL == policy->decide_on_report);
+
+    policy = get_handoff_policy(HANDOFF_POLICY_CUSUM, &config);
+    assert(NULL == policy->decide_on_window);
+    assert(NULL != policy->decide_on_report);
+
+    policy = get_handoff_policy(HANDOFF_POLICY_VARIANCE_MARGIN,
+                                &test_config);
+    assert(NULL != policy->decide_on_window);
+    assert(NULL != policy->decide_on_report);
+}
+
+
+int main(){
+    LBeaconUUID uuid;
+    bool is_inserted;
+    int i;
+
+    assert(WORK_SUCCESSFULLY ==
+           init_lbeacon_table(&test_table, TEST_MAX_LBEACONS));
+
+    for(i = 0 ; i < TEST_NUM_LBEACONS ; i++){
+        memset(&uuid, 0, sizeof(uuid));
+        uuid.bytes[7] = (uint8_t)(i + 1);
+        test_indexes[i] = lbeacon_table_insert(&test_table, &uuid,
+                                               &is_inserted);
+        assert(test_indexes[i] >= 0 && is_inserted);
+    }
+
+    test_get_policy();
+    test_sequences();
+    test_reload();
+
+    release_lbeacon_table(&test_table);
+
+    printf("Test_Handoff_Policy: passed\n");
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the unit tests of the export of the LBeacon table:
+      a reader copying the segment while the writer updates it only gets
+      snapshots of complete updates. It is built and run by make check.
+
+ File Name:
+
+      Test_LBeacon_Export.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include <assert.h>
+#include "LBeacon_Export.h"
+
+
+/* Number of updates the writer thread of the test makes */
+#define TEST_NUM_UPDATES 100000
+
+
+/* The segment of the tests, which is not shared with other processes */
+static LBeaconExport test_export;
+
+
+/* A static function to write an update in which every field derived from
+   the value is consistent with the others. */
+static void write_update(LBeaconExport *export, int value){
+    int i;
+
+    begin_lbeacon_export_update(export);
+
+    export->update_time = value;
+    export->association_changes = value;
+    export->num_lbeacons = MAX_EXPORTED_LBEACONS;
+    for(i = 0 ; i < MAX_EXPORTED_LBEACONS ; i++){
+        export->lbeacons[i].rssi = value;
+        export->lbeacons[i].count = value;
+    }
+
+    end_lbeacon_export_update(export);
+}
+
+
+/* A static function to check that a snapshot holds one complete
+   update. */
+static void check_snapshot(LBeaconExport *snapshot){
+    int i;
+
+    assert(0 == snapshot->sequence % 2);
+    assert((uint64_t)snapshot->update_time ==
+           snapshot->association_changes);
+    for(i = 0 ; i < snapshot->num_lbeacons ; i++){
+        assert(snapshot->lbeacons[i].rssi == snapshot->update_time);
+        assert(snapshot->lbeacons[i].count == snapshot->update_time);
+    }
+}
+
+
+/* A static function run by the writer thread of the test. */
+static void *writer_routine(void *param){
+    int value;
+
+    for(value = 1 ; value <= TEST_NUM_UPDATES ; value++){
+        write_update(&test_export, value);
+    }
+
+    return NULL;
+}
+
+
+/* A static function to test the snapshots of a segment not initialized,
+   updated and being updated. */
+static void test_snapshots(){
+    static LBeaconExport snapshot;
+
+    memset(&test_export, 0, sizeof(test_export));
+    assert(!read_lbeacon_export(&test_export, &snapshot));
+
+    test_export.version = LBEACON_EXPORT_VERSION;
+    write_update(&test_export, 7);
+    assert(read_lbeacon_export(&test_export, &snapshot));
+    assert(7 == snapshot.update_time);
+    check_snapshot(&snapshot);
+
+    /* An update in progress is never copied */
+    begin_lbeacon_export_update(&test_export);
+    assert(!read_lbeacon_export(&test_export, &snapshot));
+    end_lbeacon_export_update(&test_export);
+    assert(read_lbeacon_export(&test_export, &snapshot));
+}
+
+
+/* A static function to test the snapshots read while another thread
+   updates the segment. */
+static void test_concurrent_updates(){
+    static LBeaconExport snapshot;
+    pthread_t writer;
+    int64_t last_update_time = 0;
+    int num_snapshots = 0;
+
+    memset(&test_export, 0, sizeof(test_export));
+    test_export.version = LBEACON_EXPORT_VERSION;
+
+    assert(0 == pthread_create(&writer, NULL, writer_routine, NULL));
+
+    while(last_update_time < TEST_NUM_UPDATES){
+        if(!read_lbeacon_export(&test_export, &snapshot)){
+            continue;
+        }
+
+        check_snapshot(&snapshot);
+
+        /* The updates are seen in order */
+        assert(snapshot.update_time >= last_update_time);
+        last_update_time = snapshot.update_time;
+        num_snapshots++;
+    }
+
+    pthread_join(writer, NULL);
+
+    assert(num_snapshots > 0);
+}
+
+
+int main(){
+
+    test_snapshots();
+    test_concurrent_updates();
+
+    printf("Test_LBeacon_Export: passed\n");
+
+    return 0;
+}
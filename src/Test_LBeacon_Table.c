@@ -0,0 +1,436 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the unit tests of the table of LBeacons: the hash
+      table with backward-shift deletion and eviction, the indexed heap,
+      the aggregations of the RSSI samples and the selection of the
+      strongest LBeacon. It is built and run by make check.
+
+ File Name:
+
+      Test_LBeacon_Table.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include <assert.h>
+#include "LBeacon_Table.h"
+
+
+/* Number of LBeacons the tables of the tests track */
+#define TEST_MAX_LBEACONS 48
+
+/* Time constant of the estimator in the tests */
+#define TEST_TIME_CONSTANT_IN_US 1000000LL
+
+/* Time after which the LBeacons not heard are evicted in the tests */
+#define TEST_STALE_TIMEOUT_IN_US 3000000LL
+
+/* Length of the sliding window in the tests */
+#define TEST_WINDOW_IN_US 2000000LL
+
+
+/* A static function to make the UUID of the i-th LBeacon of a test, laid
+   out like the UUIDs of LBeacons with the coordinates in the last bytes of
+   both halves. */
+static LBeaconUUID make_uuid(int i){
+    LBeaconUUID uuid;
+
+    memset(&uuid, 0, sizeof(uuid));
+    uuid.bytes[6] = (uint8_t)(i >> 8);
+    uuid.bytes[7] = (uint8_t)i;
+    uuid.bytes[14] = (uint8_t)(i * 7 >> 8);
+    uuid.bytes[15] = (uint8_t)(i * 7);
+
+    return uuid;
+}
+
+
+/* A static function to check that the heap is a max-heap of its keys, and
+   that the positions of the LBeacons match their places in the heap. */
+static void check_heap(LBeaconTable *table){
+    int position;
+    int index;
+    int num_in_heap = 0;
+
+    for(position = 0 ; position < table->heap_size ; position++){
+        index = table->heap[position];
+
+        assert(table->is_used[index]);
+        assert(table->heap_positions[index] == position);
+        if(position > 0){
+            assert(table->heap_keys[table->heap[(position - 1) / 2]] >=
+                   table->heap_keys[index]);
+        }
+    }
+
+    for(index = 0 ; index < table->capacity ; index++){
+        if(-1 != table->heap_positions[index]){
+            num_in_heap++;
+        }
+    }
+    assert(num_in_heap == table->heap_size);
+}
+
+
+/* A static function to test that the LBeacons stay reachable when others
+   are removed from the middle of their probe sequences. */
+static void test_insert_lookup_remove(){
+    LBeaconTable table;
+    LBeaconUUID uuid;
+    bool is_inserted;
+    int index;
+    int i;
+
+    assert(WORK_SUCCESSFULLY == init_lbeacon_table(&table,
+                                                   TEST_MAX_LBEACONS));
+
+    for(i = 0 ; i < TEST_MAX_LBEACONS ; i++){
+        uuid = make_uuid(i);
+        index = lbeacon_table_insert(&table, &uuid, &is_inserted);
+        assert(index >= 0 && is_inserted);
+        assert(index == lbeacon_table_insert(&table, &uuid, &is_inserted));
+        assert(!is_inserted);
+    }
+    assert(TEST_MAX_LBEACONS == table.num_lbeacons);
+
+    /* The table is full */
+    uuid = make_uuid(TEST_MAX_LBEACONS);
+    assert(-1 == lbeacon_table_insert(&table, &uuid, &is_inserted));
+    assert(1 == table.overflowed_reports);
+
+    /* Every other LBeacon is removed, which shifts the LBeacons following
+       them in their probe sequences */
+    for(i = 0 ; i < TEST_MAX_LBEACONS ; i += 2){
+        uuid = make_uuid(i);
+        index = lbeacon_table_lookup(&table, &uuid);
+        assert(index >= 0);
+        lbeacon_table_remove(&table, index);
+    }
+    assert(TEST_MAX_LBEACONS / 2 == table.num_lbeacons);
+
+    for(i = 0 ; i < TEST_MAX_LBEACONS ; i++){
+        uuid = make_uuid(i);
+        index = lbeacon_table_lookup(&table, &uuid);
+        if(i % 2){
+            assert(index >= 0 && is_same_uuid(&table.uuids[index], &uuid));
+        }else{
+            assert(-1 == index);
+        }
+    }
+
+    /* The slots freed are claimed again */
+    for(i = 0 ; i < TEST_MAX_LBEACONS ; i += 2){
+        uuid = make_uuid(i);
+        assert(0 <= lbeacon_table_insert(&table, &uuid, &is_inserted));
+        assert(is_inserted);
+    }
+    assert(TEST_MAX_LBEACONS == table.num_lbeacons);
+
+    lbeacon_table_clear(&table);
+    assert(0 == table.num_lbeacons && 0 == table.heap_size);
+    uuid = make_uuid(1);
+    assert(-1 == lbeacon_table_lookup(&table, &uuid));
+
+    release_lbeacon_table(&table);
+}
+
+
+/* A static function to test that the LBeacons not heard for longer than
+   the timeout are evicted, and that the others stay reachable. */
+static void test_evict(){
+    LBeaconTable table;
+    LBeaconUUID uuid;
+    bool is_inserted;
+    long long now = 1000000;
+    int index;
+    int i;
+
+    assert(WORK_SUCCESSFULLY == init_lbeacon_table(&table,
+                                                   TEST_MAX_LBEACONS));
+
+    /* The LBeacons of even numbers are last heard a timeout earlier */
+    for(i = 0 ; i < TEST_MAX_LBEACONS ; i++){
+        uuid = make_uuid(i);
+        index = lbeacon_table_insert(&table, &uuid, &is_inserted);
+        update_lbeacon_rssi(&table, index, -60,
+                            (i % 2) ? now + TEST_STALE_TIMEOUT_IN_US : now,
+                            TEST_TIME_CONSTANT_IN_US);
+    }
+
+    assert(0 == lbeacon_table_evict(&table, now + TEST_STALE_TIMEOUT_IN_US,
+                                    TEST_STALE_TIMEOUT_IN_US));
+    assert(TEST_MAX_LBEACONS / 2 ==
+           lbeacon_table_evict(&table, now + TEST_STALE_TIMEOUT_IN_US + 1,
+                               TEST_STALE_TIMEOUT_IN_US));
+    assert(TEST_MAX_LBEACONS / 2 == table.num_lbeacons);
+    assert(TEST_MAX_LBEACONS / 2 == table.evicted_lbeacons);
+
+    for(i = 0 ; i < TEST_MAX_LBEACONS ; i++){
+        uuid = make_uuid(i);
+        index = lbeacon_table_lookup(&table, &uuid);
+        if(i % 2){
+            assert(index >= 0 && is_same_uuid(&table.uuids[index], &uuid));
+        }else{
+            assert(-1 == index);
+        }
+    }
+
+    release_lbeacon_table(&table);
+}
+
+
+/* A static function to test that the heap keeps its order while the
+   LBeacons are updated, moved by removals and evicted. */
+static void test_heap(){
+    LBeaconTable table;
+    LBeaconUUID uuid;
+    bool is_inserted;
+    long long now = 1000000;
+    int best_index;
+    int runner_up_index;
+    int best_key;
+    int runner_up_key;
+    int index;
+    int i;
+    int j;
+
+    assert(WORK_SUCCESSFULLY == init_lbeacon_table(&table,
+                                                   TEST_MAX_LBEACONS));
+
+    get_lbeacon_candidates(&table, &best_index, &runner_up_index);
+    assert(-1 == best_index && -1 == runner_up_index);
+
+    srand(1);
+    for(j = 0 ; j < 20 ; j++){
+        now += 10000;
+        for(i = 0 ; i < TEST_MAX_LBEACONS ; i++){
+            uuid = make_uuid(i);
+            index = lbeacon_table_insert(&table, &uuid, &is_inserted);
+            update_lbeacon_rssi(&table, index, -40 - rand() % 60, now,
+                                TEST_TIME_CONSTANT_IN_US);
+        }
+        check_heap(&table);
+    }
+
+    /* The candidates are the two highest keys */
+    get_lbeacon_candidates(&table, &best_index, &runner_up_index);
+    best_key = INT32_MIN;
+    runner_up_key = INT32_MIN;
+    for(i = 0 ; i < table.capacity ; i++){
+        if(!table.is_used[i]){
+            continue;
+        }
+        if(table.heap_keys[i] > best_key){
+            runner_up_key = best_key;
+            best_key = table.heap_keys[i];
+        }else if(table.heap_keys[i] > runner_up_key){
+            runner_up_key = table.heap_keys[i];
+        }
+    }
+    assert(table.heap_keys[best_index] == best_key);
+    assert(table.heap_keys[runner_up_index] == runner_up_key);
+
+    /* The heap follows the LBeacons moved by the removals */
+    for(i = 0 ; i < TEST_MAX_LBEACONS ; i += 3){
+        uuid = make_uuid(i);
+        lbeacon_table_remove(&table, lbeacon_table_lookup(&table, &uuid));
+        check_heap(&table);
+    }
+    assert(table.heap_size == table.num_lbeacons);
+
+    /* The heap is ordered again by another aggregation */
+    set_lbeacon_aggregation(&table, RSSI_AGGREGATION_MEDIAN,
+                            TEST_WINDOW_IN_US, now);
+    check_heap(&table);
+
+    i = table.num_lbeacons;
+    assert(i == lbeacon_table_evict(&table, now + TEST_WINDOW_IN_US + 1,
+                                    TEST_WINDOW_IN_US));
+    assert(0 == table.num_lbeacons && 0 == table.heap_size);
+
+    release_lbeacon_table(&table);
+}
+
+
+/* A static function to compare two RSSI values for qsort. */
+static int compare_rssi(const void *first, const void *second){
+
+    return *(const int *)first - *(const int *)second;
+}
+
+
+/* A static function to divide rounding halves upward, as the table
+   does. */
+static int divide_rounded_up(int dividend, int divisor){
+    int quotient = dividend / divisor;
+
+    if(dividend % divisor < 0){
+        quotient--;
+    }
+
+    return (2 * (dividend - quotient * divisor) >= divisor) ?
+           quotient + 1 : quotient;
+}
+
+
+/* A static function to test the median and the trimmed mean of the
+   samples in the sliding window against a sort of the same samples. */
+static void test_aggregations(){
+    LBeaconTable table;
+    LBeaconUUID uuid = make_uuid(0);
+    bool is_inserted;
+    int samples[RSSI_SAMPLES_PER_LBEACON];
+    long long now = 1000000;
+    int num_samples;
+    int trim;
+    int sum;
+    int index;
+    int i;
+    int j;
+
+    assert(WORK_SUCCESSFULLY == init_lbeacon_table(&table,
+                                                   TEST_MAX_LBEACONS));
+    index = lbeacon_table_insert(&table, &uuid, &is_inserted);
+
+    /* No sample is in the window */
+    assert(-100 == get_lbeacon_rssi_in_window(&table, index,
+                                              RSSI_AGGREGATION_MEDIAN, now,
+                                              TEST_WINDOW_IN_US, -100));
+
+    /* An outlier moves neither the median nor the trimmed mean */
+    for(i = 0 ; i < 7 ; i++){
+        now += 1000;
+        update_lbeacon_rssi(&table, index, -60, now,
+                            TEST_TIME_CONSTANT_IN_US);
+    }
+    now += 1000;
+    update_lbeacon_rssi(&table, index, -10, now, TEST_TIME_CONSTANT_IN_US);
+    assert(-60 == get_lbeacon_rssi_in_window(&table, index,
+                                             RSSI_AGGREGATION_MEDIAN, now,
+                                             TEST_WINDOW_IN_US, -100));
+    assert(-60 == get_lbeacon_rssi_in_window(&table, index,
+                                             RSSI_AGGREGATION_TRIMMED_MEAN,
+                                             now, TEST_WINDOW_IN_US, -100));
+
+    /* Random samples of every count, of which the older ones leave the
+       window */
+    srand(2);
+    for(j = 0 ; j < 1000 ; j++){
+        lbeacon_table_clear(&table);
+        index = lbeacon_table_insert(&table, &uuid, &is_inserted);
+
+        num_samples = 1 + rand() % RSSI_SAMPLES_PER_LBEACON;
+        for(i = 0 ; i < RSSI_SAMPLES_PER_LBEACON ; i++){
+            now += 1000;
+            samples[i] = -30 - rand() % 70;
+            update_lbeacon_rssi(&table, index, samples[i], now,
+                                TEST_TIME_CONSTANT_IN_US);
+        }
+
+        /* The last num_samples samples are within the window */
+        qsort(&samples[RSSI_SAMPLES_PER_LBEACON - num_samples], num_samples,
+              sizeof(int), compare_rssi);
+        memmove(samples, &samples[RSSI_SAMPLES_PER_LBEACON - num_samples],
+                num_samples * sizeof(int));
+
+        assert(divide_rounded_up(samples[(num_samples - 1) / 2] +
+                                 samples[num_samples / 2], 2) ==
+               get_lbeacon_rssi_in_window(&table, index,
+                                          RSSI_AGGREGATION_MEDIAN, now,
+                                          (num_samples - 1) * 1000LL, -100));
+
+        trim = num_samples / 4;
+        sum = 0;
+        for(i = trim ; i < num_samples - trim ; i++){
+            sum += samples[i];
+        }
+        assert(divide_rounded_up(sum, num_samples - 2 * trim) ==
+               get_lbeacon_rssi_in_window(&table, index,
+                                          RSSI_AGGREGATION_TRIMMED_MEAN, now,
+                                          (num_samples - 1) * 1000LL, -100));
+    }
+
+    release_lbeacon_table(&table);
+}
+
+
+/* A static function to test the selection of the strongest LBeacon
+   against a scalar scan of the same values. */
+static void test_find_strongest(){
+    LBeaconTable table;
+    int best_rssi;
+    int expected_index;
+    int expected_rssi;
+    int threshold;
+    int i;
+    int j;
+
+    assert(WORK_SUCCESSFULLY == init_lbeacon_table(&table,
+                                                   TEST_MAX_LBEACONS));
+
+    assert(-1 == find_strongest_lbeacon(&table, -100, &best_rssi));
+
+    srand(3);
+    for(j = 0 ; j < 1000 ; j++){
+        for(i = 0 ; i < table.capacity ; i++){
+            table.rssi_values[i] = (rand() % 4) ? -30 - rand() % 70 :
+                                                  LBEACON_RSSI_NONE;
+        }
+        threshold = -30 - rand() % 80;
+
+        /* The lowest index among equal values */
+        expected_index = -1;
+        expected_rssi = threshold;
+        for(i = 0 ; i < table.capacity ; i++){
+            if(table.rssi_values[i] > expected_rssi){
+                expected_index = i;
+                expected_rssi = table.rssi_values[i];
+            }
+        }
+
+        best_rssi = 0;
+        assert(expected_index ==
+               find_strongest_lbeacon(&table, threshold, &best_rssi));
+        if(-1 != expected_index){
+            assert(expected_rssi == best_rssi);
+        }
+    }
+
+    release_lbeacon_table(&table);
+}
+
+
+int main(){
+
+    test_insert_lookup_remove();
+    test_evict();
+    test_heap();
+    test_aggregations();
+    test_find_strongest();
+
+    printf("Test_LBeacon_Table: passed\n");
+
+    return 0;
+}
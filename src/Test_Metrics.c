@@ -0,0 +1,128 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the unit tests of the latency histograms of the
+      runtime metrics. It is built and run by make check.
+
+ File Name:
+
+      Test_Metrics.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include <assert.h>
+#include "Metrics.h"
+
+
+/* A static function to check that a percentile is at or above the exact
+   value and within the relative error of the buckets. */
+static void check_percentile(LatencyHistogram *histogram,
+                             double percentile,
+                             long long exact_value){
+    long long value = get_latency_percentile(histogram, percentile);
+
+    assert(value >= exact_value);
+    assert(value - exact_value <= exact_value / HISTOGRAM_SUB_BUCKETS);
+}
+
+
+/* A static function to test that small values are counted exactly. */
+static void test_small_values(){
+    LatencyHistogram histogram;
+    int i;
+
+    reset_latency_histogram(&histogram);
+    assert(0 == get_latency_percentile(&histogram, 50));
+
+    for(i = 0 ; i < HISTOGRAM_SUB_BUCKETS ; i++){
+        record_latency(&histogram, i);
+    }
+
+    assert(HISTOGRAM_SUB_BUCKETS == histogram.num_values);
+    assert(HISTOGRAM_SUB_BUCKETS / 2 - 1 ==
+           get_latency_percentile(&histogram, 50));
+    assert(HISTOGRAM_SUB_BUCKETS - 1 ==
+           get_latency_percentile(&histogram, 100));
+
+    /* Negative latencies are counted as 0 */
+    record_latency(&histogram, -5);
+    assert(0 == get_latency_percentile(&histogram, 0));
+}
+
+
+/* A static function to test the percentiles of values spread over several
+   powers of 2. */
+static void test_percentiles(){
+    LatencyHistogram histogram;
+    int i;
+
+    reset_latency_histogram(&histogram);
+
+    for(i = 1 ; i <= 10000 ; i++){
+        record_latency(&histogram, i);
+    }
+
+    check_percentile(&histogram, 50, 5000);
+    check_percentile(&histogram, 90, 9000);
+    check_percentile(&histogram, 99, 9900);
+    assert(10000 == histogram.max_value);
+    assert(10000 == get_latency_percentile(&histogram, 100));
+
+    /* Each bucket of a power of 2 holds the values of one sub-bucket */
+    reset_latency_histogram(&histogram);
+    record_latency(&histogram, 1000);
+    record_latency(&histogram, 1000 + 1000 / HISTOGRAM_SUB_BUCKETS);
+    assert(get_latency_percentile(&histogram, 50) <
+           1000 + 1000 / HISTOGRAM_SUB_BUCKETS);
+}
+
+
+/* A static function to test that values beyond the range are counted in
+   the last bucket, whose upper end is the largest value counted exactly,
+   and that the largest value is still kept. */
+static void test_large_values(){
+    LatencyHistogram histogram;
+    long long large_value = 1LL << (HISTOGRAM_VALUE_BITS + 3);
+
+    reset_latency_histogram(&histogram);
+    record_latency(&histogram, large_value);
+
+    assert(1 == histogram.counts[HISTOGRAM_BUCKETS - 1]);
+    assert(large_value == histogram.max_value);
+    assert((1LL << HISTOGRAM_VALUE_BITS) - 1 ==
+           get_latency_percentile(&histogram, 50));
+}
+
+
+int main(){
+
+    test_small_values();
+    test_percentiles();
+    test_large_values();
+
+    printf("Test_Metrics: passed\n");
+
+    return 0;
+}
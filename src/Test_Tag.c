@@ -0,0 +1,338 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the unit tests of the handling of advertising data
+      by the Tag: the socket filter attached to a socket pair passes the
+      advertising reports of LBeacons wherever their manufacturer specific
+      data lies and drops the others, the UUID is parsed only out of AD
+      structures lying within the data, and the advertising payload of the
+      Tag is laid out as patched when advertising. The static functions
+      are tested by including the source file of the Tag. It is built and
+      run by make check.
+
+ File Name:
+
+      Test_Tag.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include <assert.h>
+
+/* The main function of the Tag is not run by the tests */
+#define main tag_main
+#include "Tag.c"
+#undef main
+
+
+/* Length in number of bytes of the manufacturer specific data of a
+   LBeacon: company identifier, beacon type and length, and UUID */
+#define TEST_LBEACON_DATA_LENGTH (4 + UUID_DATA_LENGTH)
+
+
+/* The UUID of the LBeacon of the tests, with the leading zeros of the
+   LBeacon UUIDs */
+static const uint8_t test_uuid[UUID_DATA_LENGTH] = {
+    0x00, 0x00, 0x00, 0x12, 0x34, 0x56, 0x78, 0x9A,
+    0x00, 0x00, 0x00, 0x0B, 0xCD, 0xEF, 0x01, 0x23
+};
+
+
+/* A static function to append an AD structure to advertising data, and
+   to return the new length of the data. */
+static int append_ad_structure(uint8_t *data,
+                               int data_length,
+                               uint8_t type,
+                               const uint8_t *payload,
+                               int payload_length){
+
+    data[data_length] = (uint8_t)(payload_length + 1);
+    data[data_length + 1] = type;
+    memcpy(&data[data_length + 2], payload, payload_length);
+
+    return data_length + 2 + payload_length;
+}
+
+
+/* A static function to append the manufacturer specific data of a beacon
+   of the company with the UUID, and to return the new length of the
+   data. */
+static int append_beacon_data(uint8_t *data,
+                              int data_length,
+                              uint16_t company,
+                              const uint8_t *uuid){
+    uint8_t payload[TEST_LBEACON_DATA_LENGTH];
+
+    payload[0] = (uint8_t)company;
+    payload[1] = (uint8_t)(company >> 8);
+    payload[2] = 0x02;
+    payload[3] = 0x15;
+    memcpy(&payload[4], uuid, UUID_DATA_LENGTH);
+
+    return append_ad_structure(data, data_length,
+                               EIR_MANUFACTURE_SPECIFIC_DATA, payload,
+                               sizeof(payload));
+}
+
+
+/* A static function to append AD structures other than manufacturer
+   specific data, and to return the new length of the data. */
+static int append_other_data(uint8_t *data,
+                             int data_length,
+                             int num_structures){
+    const uint8_t name[] = {'T'};
+    int i;
+
+    for(i = 0 ; i < num_structures ; i++){
+        data_length = append_ad_structure(data, data_length, EIR_NAME_SHORT,
+                                          name, sizeof(name));
+    }
+
+    return data_length;
+}
+
+
+/* A static function to lay out an LE Meta event carrying one advertising
+   report of the data, as read from a HCI socket, and to return the length
+   of the event. */
+static int build_report_event(uint8_t *event,
+                              const uint8_t *data,
+                              int data_length){
+    le_advertising_info *info;
+    int length = 1 + HCI_EVENT_HDR_SIZE;
+
+    event[0] = HCI_EVENT_PKT;
+    event[1] = EVT_LE_META_EVENT;
+    event[length++] = EVT_LE_ADVERTISING_REPORT;
+    event[length++] = 1;
+
+    info = (le_advertising_info *)&event[length];
+    memset(info, 0, LE_ADVERTISING_INFO_SIZE);
+    info->length = (uint8_t)data_length;
+    memcpy(info->data, data, data_length);
+    length += LE_ADVERTISING_INFO_SIZE + data_length;
+
+    /* RSSI */
+    event[length++] = (uint8_t)-60;
+
+    event[2] = (uint8_t)(length - 1 - HCI_EVENT_HDR_SIZE);
+
+    return length;
+}
+
+
+/* A static function to send an event to the socket the filter is attached
+   to, and to check whether the filter passes it. */
+static bool is_event_passed(int fds[2], const uint8_t *event, int length){
+    uint8_t received[HCI_MAX_EVENT_SIZE + 1];
+    ssize_t received_length;
+
+    assert(length == send(fds[1], event, length, 0));
+
+    received_length = recv(fds[0], received, sizeof(received),
+                           MSG_DONTWAIT);
+    if(0 > received_length){
+        assert(EAGAIN == errno || EWOULDBLOCK == errno);
+        return false;
+    }
+
+    assert(length == received_length);
+    assert(0 == memcmp(event, received, length));
+
+    return true;
+}
+
+
+/* A static function to check whether the filter passes an advertising
+   report of the data, and whether the UUID of a LBeacon is parsed out of
+   it. */
+static void check_report(int fds[2],
+                         const uint8_t *data,
+                         int data_length,
+                         bool is_passed,
+                         bool is_lbeacon){
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    LBeaconUUID uuid;
+    int length;
+
+    length = build_report_event(event, data, data_length);
+    assert(is_passed == is_event_passed(fds, event, length));
+
+    if(is_lbeacon){
+        assert(WORK_SUCCESSFULLY ==
+               eir_parse_uuid((uint8_t *)data, data_length, &uuid));
+        assert(0 == memcmp(uuid.bytes, test_uuid, UUID_DATA_LENGTH));
+    }else{
+        assert(E_PARSE_UUID ==
+               eir_parse_uuid((uint8_t *)data, data_length, &uuid));
+    }
+}
+
+
+/* A static function to test the advertising reports the socket filter
+   passes and drops. */
+static void test_lbeacon_filter(){
+    uint8_t data[HCI_MAX_EVENT_SIZE];
+    uint8_t event[HCI_MAX_EVENT_SIZE];
+    uint8_t foreign_uuid[UUID_DATA_LENGTH];
+    evt_cmd_complete *complete;
+    int data_length;
+    int length;
+    int fds[2];
+
+    hci_transport = get_hci_transport(HCI_TRANSPORT_BLUEZ, NULL);
+
+    assert(0 == socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+    assert(WORK_SUCCESSFULLY == attach_lbeacon_filter(fds[0]));
+
+    /* A LBeacon as the first AD structure, as the last AD structure the
+       filter walks, and beyond the AD structures the filter walks */
+    data_length = append_beacon_data(data, 0, 0x000F, test_uuid);
+    check_report(fds, data, data_length, true, true);
+
+    data_length = append_other_data(data, 0,
+                                    MAX_AD_STRUCTURES_IN_FILTER - 1);
+    data_length = append_beacon_data(data, data_length, 0x000F, test_uuid);
+    check_report(fds, data, data_length, true, true);
+
+    data_length = append_other_data(data, 0, 5);
+    data_length = append_beacon_data(data, data_length, 0x000F, test_uuid);
+    check_report(fds, data, data_length, true, true);
+
+    /* Beacons of other companies, and of Broadcom without the leading
+       zeros of the LBeacon UUIDs */
+    data_length = append_other_data(data, 0, 1);
+    data_length = append_beacon_data(data, data_length, 0x004C, test_uuid);
+    check_report(fds, data, data_length, false, false);
+
+    memcpy(foreign_uuid, test_uuid, UUID_DATA_LENGTH);
+    foreign_uuid[2] = 0x01;
+    data_length = append_beacon_data(data, 0, 0x000F, foreign_uuid);
+    check_report(fds, data, data_length, false, false);
+
+    /* Reports without manufacturer specific data */
+    data_length = append_other_data(data, 0, 2);
+    check_report(fds, data, data_length, false, false);
+
+    check_report(fds, data, 0, false, false);
+
+    /* The LBeacon data cut before the leading zeros of the UUID, which
+       the filter cannot load */
+    data_length = append_other_data(data, 0, 1);
+    data_length = append_beacon_data(data, data_length, 0x000F, test_uuid);
+    check_report(fds, data, data_length - UUID_DATA_LENGTH, false, false);
+
+    /* Events packing several reports are left to the userspace check */
+    data_length = append_other_data(data, 0, 2);
+    length = build_report_event(event, data, data_length);
+    event[1 + HCI_EVENT_HDR_SIZE + 1] = 2;
+    assert(is_event_passed(fds, event, length));
+
+    /* Events other than advertising reports pass */
+    event[0] = HCI_EVENT_PKT;
+    event[1] = EVT_CMD_COMPLETE;
+    event[2] = EVT_CMD_COMPLETE_SIZE + 1;
+    complete = (evt_cmd_complete *)&event[1 + HCI_EVENT_HDR_SIZE];
+    complete->ncmd = 1;
+    complete->opcode = htobs(cmd_opcode_pack(OGF_LE_CTL,
+                                             OCF_LE_SET_SCAN_ENABLE));
+    event[1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE] = 0;
+    assert(is_event_passed(fds, event,
+                           1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE +
+                           1));
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+/* A static function to test that the UUID is parsed only out of AD
+   structures lying within the data. */
+static void test_parse_uuid(){
+    uint8_t data[HCI_MAX_EVENT_SIZE];
+    LBeaconUUID uuid;
+    int data_length;
+
+    /* The last byte of the LBeacon data is the last byte of the data */
+    data_length = append_other_data(data, 0, 1);
+    data_length = append_beacon_data(data, data_length, 0x000F, test_uuid);
+    assert(WORK_SUCCESSFULLY == eir_parse_uuid(data, data_length, &uuid));
+
+    /* The last byte of the LBeacon data lies beyond the data */
+    assert(E_PARSE_UUID == eir_parse_uuid(data, data_length - 1, &uuid));
+
+    /* The length of the LBeacon data is too short for the UUID */
+    data[3]--;
+    assert(E_PARSE_UUID == eir_parse_uuid(data, data_length - 1, &uuid));
+
+    /* The end of the AD structures */
+    data[0] = 0;
+    assert(E_PARSE_UUID == eir_parse_uuid(data, data_length, &uuid));
+}
+
+
+/* A static function to test that the advertising payload of the Tag is
+   laid out as patched by enable_advertising, and that it is not taken for
+   a LBeacon. */
+static void test_advertising_data_template(){
+    uint8_t *data = advertising_data_template.data;
+    int length;
+    int fds[2];
+
+    init_advertising_data_template();
+    length = advertising_data_template.length;
+
+    /* The flags, and the manufacturer specific data of Broadcom carrying
+       the coordinates and the push-button byte */
+    assert(2 == data[0] && EIR_FLAGS == data[1] && 0x04 == data[2]);
+    assert(length == 3 + 1 + data[3]);
+    assert(EIR_MANUFACTURE_SPECIFIC_DATA == data[4]);
+    assert(0x0F == data[5] && 0x00 == data[6]);
+    assert(7 == ADVERTISING_DATA_COORDINATES_OFFSET);
+    assert(ADVERTISING_DATA_COORDINATES_OFFSET + 8 ==
+           ADVERTISING_DATA_BUTTON_OFFSET);
+    assert(ADVERTISING_DATA_BUTTON_OFFSET + 1 == length);
+
+    /* The payload of a Tag is dropped by the filter of the other Tags */
+    hci_transport = get_hci_transport(HCI_TRANSPORT_BLUEZ, NULL);
+    assert(0 == socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+    assert(WORK_SUCCESSFULLY == attach_lbeacon_filter(fds[0]));
+
+    check_report(fds, data, length, false, false);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+int main(){
+
+    test_lbeacon_filter();
+    test_parse_uuid();
+    test_advertising_data_template();
+
+    printf("Test_Tag: passed\n");
+
+    return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the unit tests of the trace ring: the records
+      written while the ring is full are dropped and counted, the flusher
+      thread takes the records periodically, and the records left in the
+      ring are flushed when the thread is stopped. It is built and run by
+      make check.
+
+ File Name:
+
+      Test_Trace.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include <assert.h>
+#include "Trace.h"
+
+
+/* The longest time in milliseconds the tests wait for the flusher */
+#define TEST_TIMEOUT_IN_MS 5000
+
+/* Number of records dropped in the tests */
+#define TEST_DROPPED_RECORDS 10
+
+
+/* The ring of the tests, which is too large for the stack */
+static TraceRing test_ring;
+
+
+/* A static function to write a record whose arguments are derived from
+   its number. */
+static void write_record(TraceRing *ring, int number){
+    int32_t args[2];
+
+    args[0] = number;
+    args[1] = -number;
+
+    trace_event(ring, TRACE_WINDOW_ASSOCIATION_KEEP, 2, args);
+}
+
+
+/* A static function to test that the records beyond the ring are dropped
+   and counted, and that the records kept are left intact. */
+static void test_ring_full(){
+    TraceRing *ring = &test_ring;
+    TraceRecord *record;
+    int i;
+
+    assert(WORK_SUCCESSFULLY == init_trace_ring(ring));
+
+    for(i = 0 ; i < TRACE_RING_SIZE + TEST_DROPPED_RECORDS ; i++){
+        write_record(ring, i);
+    }
+
+    assert(TRACE_RING_SIZE == ring->head - ring->tail);
+    assert(TEST_DROPPED_RECORDS == ring->dropped_records);
+
+    for(i = 0 ; i < TRACE_RING_SIZE ; i++){
+        record = &ring->records[i];
+        assert(TRACE_WINDOW_ASSOCIATION_KEEP == record->event);
+        assert(i == record->args[0] && -i == record->args[1]);
+        assert(0 == record->args[TRACE_MAX_ARGS - 1]);
+    }
+
+    /* The drops are reported once the records are flushed, after which
+       the ring takes records again */
+    assert(WORK_SUCCESSFULLY == start_trace_flusher(ring));
+    stop_trace_flusher(ring);
+
+    assert(ring->head == ring->tail);
+    assert(TEST_DROPPED_RECORDS == ring->reported_dropped_records);
+
+    write_record(ring, 0);
+    assert(TRACE_RING_SIZE + 1 == ring->head);
+    assert(TEST_DROPPED_RECORDS == ring->dropped_records);
+
+    release_trace_ring(ring);
+}
+
+
+/* A static function to test that the drops are reported across the wrap
+   around of the counter. */
+static void test_dropped_wraparound(){
+    TraceRing *ring = &test_ring;
+    int i;
+
+    assert(WORK_SUCCESSFULLY == init_trace_ring(ring));
+
+    ring->dropped_records = UINT32_MAX - 1;
+    ring->reported_dropped_records = UINT32_MAX - 1;
+
+    for(i = 0 ; i < TRACE_RING_SIZE + 3 ; i++){
+        write_record(ring, i);
+    }
+    assert(1 == ring->dropped_records);
+
+    assert(WORK_SUCCESSFULLY == start_trace_flusher(ring));
+    stop_trace_flusher(ring);
+
+    assert(1 == ring->reported_dropped_records);
+
+    release_trace_ring(ring);
+}
+
+
+/* A static function to test that the flusher takes the records while it
+   runs, and the records left in the ring when it is stopped. */
+static void test_flush(){
+    TraceRing *ring = &test_ring;
+    int waited_in_ms = 0;
+    int i;
+
+    assert(WORK_SUCCESSFULLY == init_trace_ring(ring));
+    assert(WORK_SUCCESSFULLY == start_trace_flusher(ring));
+
+    /* A batch is taken by the periodic flush */
+    for(i = 0 ; i < TRACE_RING_SIZE / 2 ; i++){
+        write_record(ring, i);
+    }
+    while(ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)){
+        assert(waited_in_ms < TEST_TIMEOUT_IN_MS);
+        usleep(10000);
+        waited_in_ms += 10;
+    }
+
+    /* The records written just before the stop are not lost */
+    for(i = 0 ; i < TRACE_RING_SIZE ; i++){
+        write_record(ring, i);
+    }
+    stop_trace_flusher(ring);
+
+    assert(TRACE_RING_SIZE / 2 + TRACE_RING_SIZE == ring->head);
+    assert(ring->head == ring->tail);
+    assert(0 == ring->dropped_records);
+
+    release_trace_ring(ring);
+}
+
+
+int main(){
+
+    test_ring_full();
+    test_dropped_wraparound();
+    test_flush();
+
+    printf("Test_Trace: passed\n");
+
+    return 0;
+}
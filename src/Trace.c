@@ -0,0 +1,224 @@
+/*
+ Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+ License:
+
+      GPL 3.0 : The content of this file is subject to the terms and
+      conditions defined in file 'COPYING.txt', which is part of this source
+      code package.
+
+ Project Name:
+
+      BeDIS
+
+ File Description:
+
+      This file contains the implementation of the trace ring and of the
+      flusher thread formatting its records.
+
+ File Name:
+
+      Trace.c
+
+ Version:
+
+       1.0,  20190429
+
+ Abstract:
+
+ Authors:
+
+      Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#include "Trace.h"
+
+
+/* The formats of the arguments of the events, in the order of TraceEvent.
+   Every format takes TRACE_MAX_ARGS arguments at most. */
+static const char *trace_formats[max_trace_event] = {
+
+    /* TRACE_DETECTED_LBEACON */
+    "Detected LBeacon  uuid=[" TRACE_UUID_FORMAT "], rssi=%d, " \
+    "address=" TRACE_ADDRESS_FORMAT,
+
+    /* TRACE_REPORT_ASSOCIATION_CHANGE */
+    "Advertising report:  change best uuid=[" TRACE_UUID_FORMAT "], " \
+    "avg_rssi=%d, count=%d",
+
+    /* TRACE_WINDOW_LBEACON */
+    "Scan timeout:  index=[%d], lbeacon_uuid=[" TRACE_UUID_FORMAT "], " \
+    "avg_rssi=%d, count=%d",
+
+    /* TRACE_WINDOW_ASSOCIATION_CHANGE */
+    "Scan timeout:  change best uuid=[" TRACE_UUID_FORMAT "], " \
+    "avg_rssi=%d, count=%d",
+
+    /* TRACE_WINDOW_ASSOCIATION_KEEP */
+    "Scan timeout:  keep association=[" TRACE_UUID_FORMAT "] rssi=%d"
+};
+
+
+/* A static function to format the records written since the last flush
+   into the debug log, and to report the records dropped meanwhile. */
+static void flush_trace_records(TraceRing *ring){
+
+    char text[TRACE_TEXT_LENGTH];
+    TraceRecord *record;
+    unsigned int head;
+    unsigned int tail;
+    uint32_t dropped_records;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    for(tail = ring->tail ; tail != head ; tail++){
+
+        record = &ring->records[tail & (TRACE_RING_SIZE - 1)];
+
+        if(record->event >= max_trace_event){
+            continue;
+        }
+
+        snprintf(text, sizeof(text), trace_formats[record->event],
+                 record->args[0], record->args[1], record->args[2],
+                 record->args[3], record->args[4], record->args[5],
+                 record->args[6]);
+
+        /* The log is written later than the event, so the time of the
+           event is part of the message */
+        zlog_debug(category_debug, "[%lld] %s", (long long)record->time,
+                   text);
+    }
+
+    /* The slots are reused only after the records are formatted */
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    dropped_records = __atomic_load_n(&ring->dropped_records,
+                                      __ATOMIC_RELAXED);
+    if(dropped_records != ring->reported_dropped_records){
+        zlog_warn(category_health_report,
+                  "Trace ring full, dropped [%u] records",
+                  (unsigned int)(dropped_records -
+                                 ring->reported_dropped_records));
+        ring->reported_dropped_records = dropped_records;
+    }
+}
+
+
+/* A static function run by the flusher thread, which flushes the ring
+   periodically until it is stopped. */
+static void *trace_flusher_routine(void *param){
+
+    TraceRing *ring = (TraceRing *)param;
+    struct pollfd fds[1];
+
+    fds[0].fd = ring->stop_fd;
+    fds[0].events = POLLIN;
+
+    while(true){
+
+        if(0 > poll(fds, 1, TRACE_FLUSH_INTERVAL_IN_MS) && EINTR != errno){
+            break;
+        }
+
+        flush_trace_records(ring);
+
+        if(fds[0].revents & POLLIN){
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+ErrorCode init_trace_ring(TraceRing *ring){
+
+    memset(ring, 0, sizeof(TraceRing));
+
+    ring->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(0 > ring->stop_fd){
+        return E_OPEN_FILE;
+    }
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+void release_trace_ring(TraceRing *ring){
+
+    close(ring->stop_fd);
+}
+
+
+ErrorCode start_trace_flusher(TraceRing *ring){
+    sigset_t all_signals;
+    sigset_t signal_mask;
+    int return_value;
+
+    /* The thread inherits a mask blocking every signal, so that the
+       signals of the process are left to the event loop */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &signal_mask);
+
+    /* Created joinable rather than with startThread, so that the last
+       records are flushed before the log is closed */
+    return_value = pthread_create(&ring->thread, NULL, trace_flusher_routine,
+                                  ring);
+
+    pthread_sigmask(SIG_SETMASK, &signal_mask, NULL);
+
+    if(0 != return_value){
+        return E_START_THREAD;
+    }
+
+    return WORK_SUCCESSFULLY;
+}
+
+
+void stop_trace_flusher(TraceRing *ring){
+
+    uint64_t value = 1;
+
+    if(sizeof(value) != write(ring->stop_fd, &value, sizeof(value))){
+        zlog_warn(category_health_report,
+                  "Error waking trace flusher up: %s", strerror(errno));
+    }
+
+    pthread_join(ring->thread, NULL);
+}
+
+
+void trace_event(TraceRing *ring,
+                 TraceEvent event,
+                 int num_args,
+                 int32_t *args){
+
+    TraceRecord *record;
+    unsigned int head;
+    unsigned int tail;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if(TRACE_RING_SIZE == head - tail){
+        __atomic_store_n(&ring->dropped_records, ring->dropped_records + 1,
+                         __ATOMIC_RELAXED);
+        return;
+    }
+
+    if(num_args > TRACE_MAX_ARGS){
+        num_args = TRACE_MAX_ARGS;
+    }
+
+    record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->time = get_clock_time_in_us();
+    record->event = event;
+    memcpy(record->args, args, num_args * sizeof(int32_t));
+    memset(&record->args[num_args], 0,
+           (TRACE_MAX_ARGS - num_args) * sizeof(int32_t));
+
+    /* Publish the record after its contents are written */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
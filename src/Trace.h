@@ -0,0 +1,304 @@
+/*
+Copyright (c) 2016 Academia Sinica, Institute of Information Science
+
+License:
+
+    GPL 3.0 : The content of this file is subject to the terms and
+    conditions defined in file 'COPYING.txt', which is part of this source
+    code package.
+
+Project Name:
+
+    BeDIS
+
+File Description:
+
+    This header file contains declarations of the trace of the BLE
+    scanning. Instead of formatting a log message for every advertising
+    report, the event loop writes a compact binary record of the time, the
+    event and a few integer arguments into a preallocated ring. A flusher
+    thread formats the records and writes them to the debug log in the
+    background. The ring has a single producer, the event loop, and a
+    single consumer, the flusher thread, and is shared without locks. A
+    full ring drops new records rather than making the event loop wait.
+
+    The level of the trace is chosen at compile time by defining
+    TRACE_LEVEL before this file is included, e.g. with the TRACE_LEVEL
+    variable of the Makefile. It defaults to the association decisions.
+    The trace macros of higher levels expand to nothing, so their
+    arguments are not even evaluated.
+
+File Name:
+
+    Trace.h
+
+Version:
+
+    1.0,  20190429
+
+Abstract:
+
+Authors:
+
+    Chun Yu Lai, chunyu1202@gmail.com
+
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+* INCLUDES
+*/
+
+#include <sys/eventfd.h>
+#include "BeDIS.h"
+
+/*
+  CONSTANTS
+*/
+
+/* Levels of the trace. Each level also traces the events of the lower
+   levels. */
+
+/* Nothing is traced */
+#define TRACE_LEVEL_NONE 0
+
+/* The association decisions */
+#define TRACE_LEVEL_DECISION 1
+
+/* Every advertising report, and every LBeacon at the end of scan windows */
+#define TRACE_LEVEL_REPORT 2
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_DECISION
+#endif
+
+/* Number of records the ring holds, which has to be a power of 2. This is
+   4 flush intervals of advertising reports at 2000 reports per second. */
+#define TRACE_RING_SIZE 4096
+
+/* Maximum number of integer arguments of a record */
+#define TRACE_MAX_ARGS 7
+
+/* Time in milliseconds between two flushes of the ring */
+#define TRACE_FLUSH_INTERVAL_IN_MS 500
+
+/* Maximum length of a formatted record */
+#define TRACE_TEXT_LENGTH 256
+
+/*
+  MACROS
+*/
+
+/* The 4 arguments holding a UUID, as formatted by TRACE_UUID_FORMAT */
+#define TRACE_UUID_WORD(uuid, i) \
+    (int32_t)(((uint32_t)(uuid)->bytes[4 * (i)] << 24) | \
+              ((uint32_t)(uuid)->bytes[4 * (i) + 1] << 16) | \
+              ((uint32_t)(uuid)->bytes[4 * (i) + 2] << 8) | \
+              (uint32_t)(uuid)->bytes[4 * (i) + 3])
+#define TRACE_UUID_ARGS(uuid) \
+    TRACE_UUID_WORD(uuid, 0), TRACE_UUID_WORD(uuid, 1), \
+    TRACE_UUID_WORD(uuid, 2), TRACE_UUID_WORD(uuid, 3)
+#define TRACE_UUID_FORMAT "%08X%08X%08X%08X"
+
+/* The 2 arguments holding a Bluetooth device address, as formatted by
+   TRACE_ADDRESS_FORMAT */
+#define TRACE_ADDRESS_ARGS(address) \
+    (int32_t)(((uint32_t)(address)->b[5] << 8) | (address)->b[4]), \
+    (int32_t)(((uint32_t)(address)->b[3] << 24) | \
+              ((uint32_t)(address)->b[2] << 16) | \
+              ((uint32_t)(address)->b[1] << 8) | \
+              (uint32_t)(address)->b[0])
+#define TRACE_ADDRESS_FORMAT "%04X%08X"
+
+/* Record an event with its integer arguments into trace_ring, the ring
+   of the Tag */
+#define TRACE_EVENT(event, ...) \
+    trace_event(&trace_ring, (event), \
+                sizeof((int32_t[]){ __VA_ARGS__ }) / sizeof(int32_t), \
+                (int32_t[]){ __VA_ARGS__ })
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DECISION
+#define TRACE_DECISION(event, ...) TRACE_EVENT(event, __VA_ARGS__)
+#else
+#define TRACE_DECISION(event, ...) do{ }while(0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_REPORT
+#define TRACE_REPORT(event, ...) TRACE_EVENT(event, __VA_ARGS__)
+#else
+#define TRACE_REPORT(event, ...) do{ }while(0)
+#endif
+
+/*
+  TYPEDEF ENUMS
+*/
+
+/* The events of the trace. Each event is formatted by the entry of the
+   same index in the table of trace_formats in Trace.c. */
+typedef enum TraceEvent {
+
+    /* An advertising report of a LBeacon: UUID, RSSI, address */
+    TRACE_DETECTED_LBEACON = 0,
+
+    /* The association changed on an advertising report: UUID, RSSI,
+       count */
+    TRACE_REPORT_ASSOCIATION_CHANGE = 1,
+
+    /* A LBeacon at the end of a scan window: index, UUID, RSSI, count */
+    TRACE_WINDOW_LBEACON = 2,
+
+    /* The association changed at the end of a scan window: UUID, RSSI,
+       count */
+    TRACE_WINDOW_ASSOCIATION_CHANGE = 3,
+
+    /* The association is kept at the end of a scan window: UUID, RSSI */
+    TRACE_WINDOW_ASSOCIATION_KEEP = 4,
+
+    max_trace_event
+
+} TraceEvent;
+
+/*
+  TYPEDEF STRUCTS
+*/
+
+/* A record in the ring */
+typedef struct TraceRecord {
+
+    /* Time in micro seconds on the monotonic clock of the event */
+    int64_t time;
+
+    uint32_t event;
+
+    /* The arguments of the event, of which the unused are zero */
+    int32_t args[TRACE_MAX_ARGS];
+
+} TraceRecord;
+
+typedef struct TraceRing {
+
+    TraceRecord records[TRACE_RING_SIZE];
+
+    /* The number of records ever written by the event loop, and ever
+       formatted by the flusher thread. The slot of a record is its number
+       modulo the ring size. */
+    unsigned int head;
+    unsigned int tail;
+
+    /* The flusher thread, and the event file descriptor it is stopped
+       with */
+    pthread_t thread;
+    int stop_fd;
+
+    /* Number of records dropped because the ring is full, and the number
+       already reported by the flusher thread. The counters are 32 bits
+       wide, which are loaded and stored atomically on every target
+       without libatomic, and wrap around, so only their difference is
+       reported. */
+    uint32_t dropped_records;
+    uint32_t reported_dropped_records;
+
+} TraceRing;
+
+/*
+  FUNCTIONS
+*/
+
+/*
+  init_trace_ring:
+
+      This function initializes an empty ring, and creates the event file
+      descriptor its flusher thread is stopped with.
+
+  Parameters:
+
+      ring - the ring to be initialized
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+ErrorCode init_trace_ring(TraceRing *ring);
+
+/*
+  release_trace_ring:
+
+      This function closes the event file descriptor of a ring whose
+      flusher thread is stopped.
+
+  Parameters:
+
+      ring - the ring to be released
+
+  Return value:
+
+      None
+*/
+
+void release_trace_ring(TraceRing *ring);
+
+/*
+  start_trace_flusher:
+
+      This function starts the thread formatting the records of the ring
+      into the debug log every TRACE_FLUSH_INTERVAL_IN_MS. The thread
+      blocks every signal.
+
+  Parameters:
+
+      ring - the ring
+
+  Return value:
+
+      ErrorCode - The error code for the corresponding error if the function
+                  fails or WORK SUCCESSFULLY otherwise
+*/
+
+ErrorCode start_trace_flusher(TraceRing *ring);
+
+/*
+  stop_trace_flusher:
+
+      This function stops the flusher thread after it formats the records
+      left in the ring, and waits until it exits.
+
+  Parameters:
+
+      ring - the ring
+
+  Return value:
+
+      None
+*/
+
+void stop_trace_flusher(TraceRing *ring);
+
+/*
+  trace_event:
+
+      This function writes a record into the ring, or drops it if the ring
+      is full. It is called through the trace macros by the event loop
+      only.
+
+  Parameters:
+
+      ring - the ring
+      event - the event
+      num_args - the number of arguments, at most TRACE_MAX_ARGS
+      args - the arguments of the event
+
+  Return value:
+
+      None
+*/
+
+void trace_event(TraceRing *ring,
+                 TraceEvent event,
+                 int num_args,
+                 int32_t *args);
+
+#endif